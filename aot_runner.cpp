@@ -0,0 +1,165 @@
+﻿#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_aot.h"
+#include "chip8_pool.h"
+
+
+//COMMAND LINE USAGE: ./chip8_aot_runner <ROM> [--cycles N] [--ipf N] [--pool N]
+// runs a rom through the recompiled code linked into this build (CHIP8_AOT_ROMS), same report as chip8_headless
+
+static void print_usage()
+{
+    printf("usage: chip8_aot_runner <ROM> [--cycles N] [--ipf N] [--pool N]\n");
+    printf("  --cycles N   number of instructions to run, rounded up to whole frames (default 1000000)\n");
+    printf("  --ipf N      instructions per frame, the timers tick once per frame (default %d)\n", CHIP8_DEFAULT_IPF);
+    printf("  --pool N     also run it twice on N pool machines with a reset in between, and check every run ends on\n");
+    printf("               the same display and a reset machine is back on the recompiled code\n");
+    printf("recompiled roms:\n");
+    for (const CHIP8_AOT_PROGRAM* program = chip8_aot_programs; program; program = program->next)
+    {
+        printf("  %s\n", program->name);
+    }
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    data.resize(size > 0 ? size : 0);
+    size_t read = data.empty() ? 0 : fread(data.data(), data.size(), 1, file);
+    fclose(file);
+    return data.empty() || read == 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    const char* rom_path = argv[1];
+    uint64_t cycles = 1000000;
+    uint32_t pool_size = 0;
+    CHIP8_FRAME_CONFIG config = chip8_frame_config_default();
+    config.engine = chip8_run_aot;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+        {
+            cycles = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc)
+        {
+            pool_size = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            config.instructions_per_frame = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> rom;
+    if (!read_file(rom_path, rom) || rom.size() > sizeof(CHIP8::memory) - START_ADDRESS)
+    {
+        printf("could not read rom %s\n", rom_path);
+        return 1;
+    }
+
+    CHIP8* chip8 = chip8_init();
+    if (!chip8)
+    {
+        printf("ERROR CANNOT ALLOCATE MACHINE\n");
+        return 1;
+    }
+    chip8_load_rom_memory(chip8, rom.data(), (unsigned int) rom.size());
+
+    const CHIP8_AOT_PROGRAM* program = chip8_aot_find(rom.data(), (unsigned int) rom.size());
+    if (program)
+    {
+        // run the profile the rom was recompiled for
+        chip8_set_quirks(chip8, program->quirks);
+    }
+    if (!chip8_aot_attach(chip8, program))
+    {
+        printf("%s was not recompiled into this build\n", rom_path);
+        print_usage();
+        chip8_free(chip8);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    cycles = chip8_run_frames(chip8, &config, cycles);
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    printf("rom:          %s (%s)\n", rom_path, program->name);
+    printf("instructions: %llu\n", (unsigned long long) cycles);
+    printf("time:         %.6f s\n", seconds);
+    printf("throughput:   %.0f instructions/sec\n", seconds > 0.0 ? cycles / seconds : 0.0);
+    printf("video hash:   %016llx\n", (unsigned long long) chip8_video_hash(chip8));
+
+    // a reset writes the whole memory back, the recompiled code has to pick up again from there
+    if (pool_size > 0)
+    {
+        CHIP8_POOL pool;
+        if (!chip8_pool_init(&pool, pool_size))
+        {
+            printf("could not allocate %u pool machines\n", pool_size);
+            chip8_free(chip8);
+            return 1;
+        }
+        chip8_pool_set_quirks(&pool, program->quirks);
+        chip8_pool_load_rom_memory(&pool, rom.data(), (unsigned int) rom.size());
+
+        uint64_t hash = chip8_video_hash(chip8);
+        uint32_t wrong_display = 0;
+        uint32_t interpreted = 0;
+        auto pool_start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < pool_size; i++)
+        {
+            CHIP8* machine = chip8_pool_get(&pool, i);
+            chip8_pool_reset(&pool, machine);
+            CHIP8_AOT* aot = chip8_aot_attach(machine, program);
+            for (int run = 0; run < 2 && aot; run++)
+            {
+                chip8_pool_reset(&pool, machine);
+                interpreted += aot->modified ? 1 : 0;
+                chip8_run_frames(machine, &config, cycles);
+                wrong_display += chip8_video_hash(machine) != hash ? 1 : 0;
+            }
+            if (!aot)
+            {
+                wrong_display += 2;
+            }
+        }
+        double pool_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - pool_start).count();
+
+        printf("pool:         %u machines x 2 runs, %u ended on a different display%s, %u started on the interpreter%s\n",
+               pool_size, wrong_display, wrong_display ? " !" : "", interpreted, interpreted ? " !" : "");
+        printf("pool time:    %.6f s (%.0f instructions/sec)\n", pool_seconds,
+               pool_seconds > 0.0 ? 2.0 * pool_size * cycles / pool_seconds : 0.0);
+        chip8_pool_free(&pool);
+    }
+
+    chip8_free(chip8);
+    return 0;
+}
@@ -0,0 +1,309 @@
+﻿#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_blocks.h"
+#include "chip8_jit.h"
+#include "chip8_pool.h"
+
+
+//COMMAND LINE USAGE: ./chip8_bench [ROM or directory ...] [--cycles N] [--ipf N] [--repeat N] [--quirks P] [--resets N]
+// runs every rom through every execution engine and compares instructions/sec against the switch engine
+// defaults to every .ch8 in ./games, the roms run in 60hz frames of --ipf instructions so the timers tick like in game
+// then times --resets machine resets (fresh chip8_init + rom load against a CHIP8_POOL reset) with the first rom
+
+struct Bench_Engine
+{
+    const char* name;
+    void (*attach)(CHIP8* chip8); // NULL when the engine needs no setup
+    chip8_engine_fn run; // NULL runs chip8_run_until
+};
+
+static void attach_blocks(CHIP8* chip8)
+{
+    chip8_blocks_attach(chip8);
+}
+
+// chip8_run_jit runs the interpreter when the jit isn't supported on this machine
+static void attach_jit(CHIP8* chip8)
+{
+    chip8_jit_attach(chip8);
+}
+
+// the first engine is the baseline everything else is compared against
+static const Bench_Engine engines[] = {
+    {"switch", NULL, chip8_run_switch},
+    {"table", NULL, chip8_run_table},
+    {"cached", NULL, chip8_run_cached},
+    {"run", NULL, NULL},
+    {"blocks", attach_blocks, chip8_run_blocks},
+    {"jit", attach_jit, chip8_run_jit},
+};
+static const int engine_count = sizeof(engines) / sizeof(engines[0]);
+
+struct Bench_Result
+{
+    double ips;
+    uint64_t video_hash;
+    uint16_t pc;
+    uint16_t index;
+    uint8_t registers[16];
+};
+
+static bool read_file(const std::string& path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    data.resize(size > 0 ? size : 0);
+    size_t read = data.empty() ? 0 : fread(data.data(), data.size(), 1, file);
+    fclose(file);
+    return data.empty() || read == 1;
+}
+
+static Bench_Result bench_engine(const Bench_Engine& engine, const std::vector<uint8_t>& rom, uint64_t cycles,
+                                 uint32_t instructions_per_frame, int repeat, uint8_t quirks)
+{
+    CHIP8_FRAME_CONFIG config = {instructions_per_frame, false, engine.run};
+
+    Bench_Result result{};
+    double best_seconds = 0.0;
+
+    for (int r = 0; r < repeat; r++)
+    {
+        // same seed every run so all engines see the same Cxkk values
+        CHIP8* chip8 = chip8_init(CHIP8_DEFAULT_SEED);
+        if (!chip8)
+        {
+            printf("ERROR CANNOT ALLOCATE MACHINE\n");
+            break;
+        }
+        chip8_set_quirks(chip8, quirks);
+        chip8_load_rom_memory(chip8, rom.data(), (unsigned int) rom.size());
+
+        auto start = std::chrono::steady_clock::now();
+        if (engine.attach)
+        {
+            engine.attach(chip8);
+        }
+        cycles = chip8_run_frames(chip8, &config, cycles);
+        auto end = std::chrono::steady_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (r == 0 || seconds < best_seconds)
+        {
+            best_seconds = seconds;
+        }
+
+        result.video_hash = chip8_video_hash(chip8);
+        result.pc = chip8->pc;
+        result.index = chip8->index;
+        memcpy(result.registers, chip8->registers, sizeof(result.registers));
+        chip8_free(chip8);
+    }
+
+    result.ips = best_seconds > 0.0 ? cycles / best_seconds : 0.0;
+    return result;
+}
+
+#define BENCH_POOL_SIZE 64
+
+// microseconds per machine reset, a new machine every time against a pool machine reset from the pristine copy
+static void bench_resets(const std::vector<uint8_t>& rom, int resets, uint8_t quirks)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < resets; r++)
+    {
+        CHIP8* chip8 = chip8_init(CHIP8_DEFAULT_SEED);
+        if (!chip8)
+        {
+            printf("ERROR CANNOT ALLOCATE MACHINE\n");
+            return;
+        }
+        chip8_set_quirks(chip8, quirks);
+        chip8_load_rom_memory(chip8, rom.data(), (unsigned int) rom.size());
+        chip8_free(chip8);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double init_us = std::chrono::duration<double, std::micro>(end - start).count() / resets;
+
+    CHIP8_POOL pool;
+    if (!chip8_pool_init(&pool, BENCH_POOL_SIZE))
+    {
+        printf("ERROR CANNOT ALLOCATE POOL\n");
+        return;
+    }
+    chip8_pool_set_quirks(&pool, quirks);
+    chip8_pool_load_rom_memory(&pool, rom.data(), (unsigned int) rom.size());
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < resets; r++)
+    {
+        chip8_pool_reset(&pool, chip8_pool_get(&pool, r % BENCH_POOL_SIZE));
+    }
+    end = std::chrono::steady_clock::now();
+    double pool_us = std::chrono::duration<double, std::micro>(end - start).count() / resets;
+    chip8_pool_free(&pool);
+
+    printf("%-48s %8.2fus init+load %8.2fus pool reset (%.1fx)\n", "machine reset", init_us, pool_us,
+           pool_us > 0.0 ? init_us / pool_us : 0.0);
+}
+
+static bool same_state(const Bench_Result& a, const Bench_Result& b)
+{
+    return a.video_hash == b.video_hash && a.pc == b.pc && a.index == b.index &&
+           memcmp(a.registers, b.registers, sizeof(a.registers)) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> inputs;
+    uint64_t cycles = 2000000;
+    uint32_t instructions_per_frame = 1000;
+    int repeat = 3;
+    int resets = 10000;
+    uint8_t quirks = CHIP8_PROFILE_DEFAULT;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+        {
+            cycles = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            instructions_per_frame = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--resets") == 0 && i + 1 < argc)
+        {
+            resets = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            quirks = chip8_profile_from_name(argv[++i]);
+            if (quirks == CHIP8_PROFILE_COUNT)
+            {
+                printf("unknown quirks profile %s (default, vip, chip48, schip)\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (inputs.empty())
+    {
+        inputs.push_back("games");
+    }
+
+    std::vector<std::string> roms;
+    for (const std::string& input : inputs)
+    {
+        std::error_code error;
+        if (std::filesystem::is_directory(input, error))
+        {
+            for (const auto& entry : std::filesystem::directory_iterator(input))
+            {
+                if (entry.path().extension() == ".ch8")
+                {
+                    roms.push_back(entry.path().string());
+                }
+            }
+        }
+        else
+        {
+            roms.push_back(input);
+        }
+    }
+    std::sort(roms.begin(), roms.end());
+
+    if (roms.empty())
+    {
+        printf("no roms found\n");
+        return 1;
+    }
+
+    printf("%-48s", "rom (Minstr/s)");
+    for (int e = 0; e < engine_count; e++)
+    {
+        printf(" %10s", engines[e].name);
+    }
+    printf("\n");
+
+    double log_speedup_sum[engine_count] = {};
+    int mismatches = 0;
+
+    for (const std::string& path : roms)
+    {
+        std::vector<uint8_t> rom;
+        if (!read_file(path, rom))
+        {
+            printf("ERROR CANNOT READ ROM FILE %s\n", path.c_str());
+            continue;
+        }
+
+        std::string name = std::filesystem::path(path).stem().string();
+        if (name.size() > 47)
+        {
+            name.resize(47);
+        }
+        printf("%-48s", name.c_str());
+
+        Bench_Result baseline{};
+        for (int e = 0; e < engine_count; e++)
+        {
+            Bench_Result result = bench_engine(engines[e], rom, cycles, instructions_per_frame, repeat, quirks);
+            if (e == 0)
+            {
+                baseline = result;
+            }
+
+            bool match = same_state(result, baseline);
+            if (!match)
+            {
+                mismatches++;
+            }
+
+            log_speedup_sum[e] += std::log(result.ips / baseline.ips);
+            printf(" %9.1f%c", result.ips / 1e6, match ? ' ' : '!');
+        }
+        printf("\n");
+    }
+
+    printf("\n%-48s", "geomean speedup vs switch");
+    for (int e = 0; e < engine_count; e++)
+    {
+        printf(" %9.2fx", std::exp(log_speedup_sum[e] / roms.size()));
+    }
+    printf("\n");
+
+    std::vector<uint8_t> first_rom;
+    if (read_file(roms[0], first_rom))
+    {
+        bench_resets(first_rom, resets, quirks);
+    }
+
+    if (mismatches > 0)
+    {
+        printf("%d engine runs ended in a different state than the switch engine (marked with !)\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
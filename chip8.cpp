@@ -0,0 +1,4 @@
+﻿
+
+#include "chip8.h"
+#include "chip8_blocks.h"
@@ -1,10 +1,33 @@
 ﻿#ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#include <array>
+#include <bit>
+
+#include "chip8_trace.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHIP8_SSE2 1
+#include <emmintrin.h>
+#else
+#define CHIP8_SSE2 0
+#endif
+
+// the quirk templated dispatchers are instantiated once per profile, which stops the compiler inlining them into the run loops on its own
+#if defined(_MSC_VER)
+#define CHIP8_FORCE_INLINE __forceinline
+#else
+#define CHIP8_FORCE_INLINE inline __attribute__((always_inline))
+#endif
 
 /*** DATA ***/
 
@@ -20,19 +43,57 @@ inline uint8_t VIDEO_SCALE = 10;
 #define VIDEO_WIDTH 64
 #define VIDEO_HEIGHT 32
 
-typedef struct CHIP8
+typedef struct CHIP8_INSTR CHIP8_INSTR;
+typedef struct CHIP8_CODE_CACHE CHIP8_CODE_CACHE;
+
+#define CHIP8_NO_KEY 0xFF
+
+// Things the handlers report back to whoever is running the machine (see chip8_run)
+enum CHIP8_EVENT : uint8_t
 {
-    unsigned short opcode;
+    CHIP8_EVENT_DRAW = 1 << 0, // 00E0 or Dxyn changed the display
+    CHIP8_EVENT_WAIT_KEY = 1 << 1, // halted on Fx0A, it will run again until a key is pressed and released
+    CHIP8_EVENT_SOUND = 1 << 2, // Fx18 started the sound timer
+    CHIP8_EVENT_UNKNOWN_OPCODE = 1 << 3,
+    CHIP8_EVENT_ALL = 0x0F,
+};
 
-    unsigned char registers[16];
-    unsigned char memory[4096]; // 4k memory 1024*4
-    unsigned short index; // index register
+// instances are cache line aligned and sized so two machines never share a line (no false sharing between threads)
+#define CHIP8_CACHE_LINE 64
+
+typedef struct alignas(CHIP8_CACHE_LINE) CHIP8
+{
+    // hot state first, everything most instructions touch fits in the first cache line (checked below)
     unsigned short pc; // program counter
-    unsigned short stack[16];
+    unsigned short index; // index register
     unsigned short sp; // stack pointer
+    unsigned short opcode;
+    unsigned char registers[16];
+
+    //audio
+    // timers are stored as the value they were set to and the 60hz tick it happened on,
+    // the current value is only worked out when something reads it (see TIMERS)
+    uint64_t timer_ticks; // 60hz ticks since power on
+    uint64_t delay_set_tick;
+    uint64_t sound_set_tick;
+    uint8_t delay_set_value;
+    uint8_t sound_set_value;
+
+    uint8_t quirks; // CHIP8_QUIRK_PROFILE, set with chip8_set_quirks (see QUIRKS)
+    uint8_t events; // CHIP8_EVENT bits raised since the last chip8_run
+    bool waiting_key; // halted on Fx0A until a key is pressed and released
+    uint8_t wait_key; // the key that went down while waiting, CHIP8_NO_KEY before one does
+
+    // decoded instruction cache, one record per address (see DECODE CACHE)
+    CHIP8_INSTR* decoded;
+
+    // cold state
+    unsigned short stack[16];
+    uint64_t random_state; // Cxkk generator, per machine so runs are reproducible (see RANDOM)
+    uint64_t idle_skipped; // instructions chip8_run_until skipped inside idle loops instead of running (see IDLE LOOPS)
+    // translated code owned by the block or jit engine, NULL when running the plain interpreter
+    CHIP8_CODE_CACHE* code_cache;
 
-    // unsigned char video[VIDEO_WIDTH * VIDEO_HEIGHT]; // 64*32 monochrome display size
-    unsigned char video[VIDEO_WIDTH * VIDEO_HEIGHT]; // 64*32 monochrome display size
     unsigned char keypad[16]; // Chip 8 had 16 key inputs
     // Keypad       Keyboard
     // +-+-+-+-+    +-+-+-+-+
@@ -45,11 +106,39 @@ typedef struct CHIP8
     // |A|0|B|F|    |Z|X|C|V|
     // +-+-+-+-+    +-+-+-+-+
 
-    //audio
-    unsigned char delay_timer;
-    unsigned char sound_timer;
+    // 64*32 monochrome display, one bit per pixel, one row per word, bit 63 is the leftmost pixel.
+    // chip8_video_expand turns it into one byte per pixel for the texture
+    uint64_t video[VIDEO_HEIGHT];
+    unsigned char memory[4096]; // 4k memory 1024*4
 } CHIP8;
 
+static_assert(offsetof(CHIP8, decoded) + sizeof(CHIP8_INSTR*) <= CHIP8_CACHE_LINE, "CHIP8 hot fields must fit in the first cache line");
+static_assert(sizeof(CHIP8) % CHIP8_CACHE_LINE == 0, "CHIP8 must fill whole cache lines");
+
+// Engines that translate code keep it behind this header so memory writes can throw it away,
+// the engine specific cache struct starts with it
+struct CHIP8_CODE_CACHE
+{
+    void (*invalidate)(CHIP8* chip8, unsigned int address, unsigned int length);
+    void (*destroy)(CHIP8* chip8);
+};
+
+#define DECODE_CACHE_SIZE 4096 // one record per address
+
+// An instruction with its operands already pulled out of the opcode, so handlers don't have to mask and shift
+typedef void (*chip8_op_fn)(CHIP8* chip8, const CHIP8_INSTR* instr);
+
+struct CHIP8_INSTR
+{
+    chip8_op_fn handler;
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t x;
+    uint8_t y;
+    uint8_t kk; // n is the low nibble of kk
+    uint8_t op; // CHIP8_OP id
+};
+
 #define FONTSET_SIZE 80
 #define FONTSET_START_ADDRESS 0x50
 
@@ -74,6 +163,193 @@ inline uint8_t fontset[FONTSET_SIZE] =
 };
 
 
+/*** TIMERS ***/
+// Nothing decrements the timers, a timer is "value v set at tick t" and reads as v - (now - t)
+// clamped at zero, so the per instruction cost is zero and the scheduler can jump any number of
+// ticks at once while reading exactly what decrementing once per tick would have given
+
+inline uint8_t chip8_timer_value(uint64_t set_tick, uint8_t set_value, uint64_t now)
+{
+    uint64_t elapsed = now - set_tick;
+    return elapsed >= set_value ? 0 : (uint8_t) (set_value - elapsed);
+}
+
+inline uint8_t chip8_delay_timer(const CHIP8* chip8)
+{
+    return chip8_timer_value(chip8->delay_set_tick, chip8->delay_set_value, chip8->timer_ticks);
+}
+
+inline uint8_t chip8_sound_timer(const CHIP8* chip8)
+{
+    return chip8_timer_value(chip8->sound_set_tick, chip8->sound_set_value, chip8->timer_ticks);
+}
+
+inline bool chip8_sound_playing(const CHIP8* chip8)
+{
+    return chip8_sound_timer(chip8) > 0;
+}
+
+inline void chip8_set_delay_timer(CHIP8* chip8, uint8_t value)
+{
+    chip8->delay_set_tick = chip8->timer_ticks;
+    chip8->delay_set_value = value;
+}
+
+inline void chip8_set_sound_timer(CHIP8* chip8, uint8_t value)
+{
+    chip8->sound_set_tick = chip8->timer_ticks;
+    chip8->sound_set_value = value;
+}
+
+// move time forward by some number of 60hz ticks, O(1) however many there are
+inline void chip8_advance_timers(CHIP8* chip8, uint64_t ticks)
+{
+    uint8_t sound = chip8_sound_timer(chip8);
+    // the tone itself comes from the sound timer (chip8_audio.h), this is only a trace hook for when it stops
+    if (sound > 0 && ticks >= sound)
+        chip8_trace<CHIP8_TRACE_EVENTS>(CHIP8_TRACE_BEEP, chip8->pc, 0, chip8->index, chip8->sp);
+
+    chip8->timer_ticks += ticks;
+}
+
+
+/*** RANDOM ***/
+// xorshift64* instead of rand(), the state lives in the CHIP8 struct so every machine has its own reproducible
+// sequence, it gets saved along with everything else, and threads running separate machines never share it
+
+#define CHIP8_DEFAULT_SEED 0x43484950u // "CHIP"
+
+inline void chip8_seed_random(CHIP8* chip8, uint64_t seed)
+{
+    // splitmix64 the seed so small and zero seeds still give a good (and never zero) starting state
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    chip8->random_state = z ? z : 1;
+}
+
+inline uint8_t chip8_random_byte(CHIP8* chip8)
+{
+    uint64_t x = chip8->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    chip8->random_state = x;
+    // the top bits of the multiplied output are the good ones
+    return (uint8_t) ((x * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+
+/*** QUIRKS ***/
+// The CHIP-8 family disagrees on a handful of instructions. A profile is a type with constexpr members and the
+// handlers that care are templates over it, so every profile compiles to its own straight line code instead of
+// each instruction checking flags. CHIP8::quirks says which profile a machine runs, the engines look it up once
+// per run call (chip8_with_quirks) and the decode cache stores the matching handlers.
+
+enum CHIP8_INDEX_INCREMENT : uint8_t
+{
+    CHIP8_INDEX_KEEP, // Fx55/Fx65 leave I alone
+    CHIP8_INDEX_ADD_X, // I += x
+    CHIP8_INDEX_ADD_X_PLUS_1, // I += x + 1, I ends up past the last register
+};
+
+// what this interpreter has always done, kept as the default so existing runs don't change
+struct CHIP8_QUIRKS_DEFAULT
+{
+    static constexpr bool shift_uses_vy = false; // 8xy6/8xyE shift Vy into Vx instead of shifting Vx in place
+    static constexpr CHIP8_INDEX_INCREMENT load_store_index = CHIP8_INDEX_KEEP;
+    static constexpr bool jump_uses_vx = false; // Bxnn jumps to xnn + Vx instead of nnn + V0
+    static constexpr bool sprites_wrap = false; // pixels past the right/bottom edge wrap around instead of clipping
+    static constexpr bool logic_resets_vf = false; // 8xy1/8xy2/8xy3 clear VF
+};
+
+// the original interpreter on the RCA COSMAC VIP
+struct CHIP8_QUIRKS_VIP
+{
+    static constexpr bool shift_uses_vy = true;
+    static constexpr CHIP8_INDEX_INCREMENT load_store_index = CHIP8_INDEX_ADD_X_PLUS_1;
+    static constexpr bool jump_uses_vx = false;
+    static constexpr bool sprites_wrap = false;
+    static constexpr bool logic_resets_vf = true;
+};
+
+// CHIP-48 on the HP-48
+struct CHIP8_QUIRKS_CHIP48
+{
+    static constexpr bool shift_uses_vy = false;
+    static constexpr CHIP8_INDEX_INCREMENT load_store_index = CHIP8_INDEX_ADD_X;
+    static constexpr bool jump_uses_vx = true;
+    static constexpr bool sprites_wrap = false;
+    static constexpr bool logic_resets_vf = false;
+};
+
+// SUPER-CHIP 1.1
+struct CHIP8_QUIRKS_SCHIP
+{
+    static constexpr bool shift_uses_vy = false;
+    static constexpr CHIP8_INDEX_INCREMENT load_store_index = CHIP8_INDEX_KEEP;
+    static constexpr bool jump_uses_vx = true;
+    static constexpr bool sprites_wrap = false;
+    static constexpr bool logic_resets_vf = false;
+};
+
+enum CHIP8_QUIRK_PROFILE : uint8_t
+{
+    CHIP8_PROFILE_DEFAULT,
+    CHIP8_PROFILE_VIP,
+    CHIP8_PROFILE_CHIP48,
+    CHIP8_PROFILE_SCHIP,
+    CHIP8_PROFILE_COUNT
+};
+
+inline const char* const chip8_profile_names[CHIP8_PROFILE_COUNT] = {"default", "vip", "chip48", "schip"};
+
+// calls fn.template operator()<Q>() with the profile's type, e.g. [&]<typename Q>() { ... }
+template <typename Fn>
+inline decltype(auto) chip8_with_quirks(uint8_t profile, Fn&& fn)
+{
+    switch (profile)
+    {
+        case CHIP8_PROFILE_VIP: return fn.template operator()<CHIP8_QUIRKS_VIP>();
+        case CHIP8_PROFILE_CHIP48: return fn.template operator()<CHIP8_QUIRKS_CHIP48>();
+        case CHIP8_PROFILE_SCHIP: return fn.template operator()<CHIP8_QUIRKS_SCHIP>();
+        default: return fn.template operator()<CHIP8_QUIRKS_DEFAULT>();
+    }
+}
+
+// the same profile as plain values, for code generators that decide while translating (jit, recompiler)
+typedef struct CHIP8_QUIRK_FLAGS
+{
+    bool shift_uses_vy;
+    CHIP8_INDEX_INCREMENT load_store_index;
+    bool jump_uses_vx;
+    bool sprites_wrap;
+    bool logic_resets_vf;
+} CHIP8_QUIRK_FLAGS;
+
+inline CHIP8_QUIRK_FLAGS chip8_quirk_flags(uint8_t profile)
+{
+    return chip8_with_quirks(profile, []<typename Q>() -> CHIP8_QUIRK_FLAGS
+    {
+        return {Q::shift_uses_vy, Q::load_store_index, Q::jump_uses_vx, Q::sprites_wrap, Q::logic_resets_vf};
+    });
+}
+
+// CHIP8_PROFILE_COUNT if the name isn't one of chip8_profile_names
+inline uint8_t chip8_profile_from_name(const char* name)
+{
+    for (uint8_t profile = 0; profile < CHIP8_PROFILE_COUNT; profile++)
+    {
+        if (strcmp(name, chip8_profile_names[profile]) == 0)
+        {
+            return profile;
+        }
+    }
+    return CHIP8_PROFILE_COUNT;
+}
+
+
 /*** OPCODES ***/
 /*
 // Assume the following:
@@ -128,52 +404,66 @@ memory[pc + 1] == 0xF0
 #define KK(x)  (x & 0x00FF)
 #define NNN(x) (x & 0x0FFF)
 
-inline void OP_00E0(CHIP8* chip8)
+// Fx33 and Fx55 write into memory, which may hold code that has already been decoded
+inline void chip8_code_written(CHIP8* chip8, unsigned int address, unsigned int length);
+
+inline void OP_NULL(CHIP8* chip8, const CHIP8_INSTR* instr)
+{
+    // Anything that does not decode to one of the 35 opcodes above
+    chip8_trace<CHIP8_TRACE_EVENTS>(CHIP8_TRACE_UNKNOWN_OPCODE, chip8->pc - 2, instr->opcode, chip8->index, chip8->sp);
+    chip8->events |= CHIP8_EVENT_UNKNOWN_OPCODE;
+}
+
+inline void OP_00E0(CHIP8* chip8, const CHIP8_INSTR*)
 {
     // 00E0: CLS
     // Clear the display.
     memset(chip8->video, 0, sizeof(chip8->video));
+    chip8->events |= CHIP8_EVENT_DRAW;
 }
 
-inline void OP_00EE(CHIP8* chip8)
+inline void OP_00EE(CHIP8* chip8, const CHIP8_INSTR*)
 {
     // 00EE: RET
     // Return from a subroutine
+    // the stack only has 16 entries, a rom that returns more often than it called wraps around instead of
+    // reading past it
     --chip8->sp;
-    chip8->pc = chip8->stack[chip8->sp];
+    chip8->pc = chip8->stack[chip8->sp & 0x0Fu];
 }
 
-inline void OP_1nnn(CHIP8* chip8)
+inline void OP_1nnn(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 1nnn: JP addr
     // Jump to location nnn.
     // The interpreter sets the program counter to nnn.
 
-    uint16_t address = chip8->opcode & 0x0FFFu;
+    uint16_t address = instr->nnn;
 
     chip8->pc = address;
 }
 
-inline void OP_2nnn(CHIP8* chip8)
+inline void OP_2nnn(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 2nnn - CALL addr
     // Call subroutine at nnn.
 
-    uint16_t address = chip8->opcode & 0x0FFFu;
+    uint16_t address = instr->nnn;
 
-    chip8->stack[chip8->sp] = chip8->pc;
+    // wraps at 16 entries like 00EE, nesting deeper overwrites the oldest return address instead of the fields after the stack
+    chip8->stack[chip8->sp & 0x0Fu] = chip8->pc;
     ++chip8->sp;
     chip8->pc = address;
 }
 
 
-inline void OP_3xkk(CHIP8* chip8)
+inline void OP_3xkk(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 3xkk - SE Vx, byte
     // Skip next instruction if Vx = kk.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t byte = chip8->opcode & 0x00FFu;
+    uint8_t Vx = instr->x;
+    uint8_t byte = instr->kk;
 
     if (chip8->registers[Vx] == byte)
     {
@@ -181,13 +471,13 @@ inline void OP_3xkk(CHIP8* chip8)
     }
 }
 
-inline void OP_4xkk(CHIP8* chip8)
+inline void OP_4xkk(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 4xkk - SNE Vx, byte
     // Skip next instruction if Vx != kk.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t byte = chip8->opcode & 0x00FFu;
+    uint8_t Vx = instr->x;
+    uint8_t byte = instr->kk;
 
     if (chip8->registers[Vx] != byte)
     {
@@ -195,14 +485,14 @@ inline void OP_4xkk(CHIP8* chip8)
     }
 }
 
-inline void OP_5xy0(CHIP8* chip8)
+inline void OP_5xy0(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 5xy0 - SE Vx, Vy
-    // Skip next instruction if Vx = Vy. uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    // Skip next instruction if Vx = Vy.
 
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     if (chip8->registers[Vx] == chip8->registers[Vy])
     {
@@ -210,76 +500,94 @@ inline void OP_5xy0(CHIP8* chip8)
     }
 }
 
-inline void OP_6xkk(CHIP8* chip8)
+inline void OP_6xkk(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 6xkk - LD Vx, byte
     // Set Vx = kk.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t byte = chip8->opcode & 0x00FFu;
+    uint8_t Vx = instr->x;
+    uint8_t byte = instr->kk;
 
     chip8->registers[Vx] = byte;
 }
 
-inline void OP_7xkk(CHIP8* chip8)
+inline void OP_7xkk(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 7xkk - ADD
     // Vx, byte
     // Set Vx = Vx + kk.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t byte = chip8->opcode & 0x00FFu;
+    uint8_t Vx = instr->x;
+    uint8_t byte = instr->kk;
 
     chip8->registers[Vx] += byte;
 }
 
-inline void OP_8xy0(CHIP8* chip8)
+inline void OP_8xy0(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy0 - LD
     // Vx, Vy
     // Set Vx = Vy.uint8_t
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     chip8->registers[Vx] = chip8->registers[Vy];
 }
 
-inline void OP_8xy1(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_8xy1(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy1 - OR Vx, Vy
     // Set Vx = Vx OR Vy.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     chip8->registers[Vx] |= chip8->registers[Vy];
+
+    if constexpr (Q::logic_resets_vf)
+    {
+        chip8->registers[0xF] = 0;
+    }
 }
 
-inline void OP_8xy2(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_8xy2(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy2 - AND Vx, Vy
     // Set Vx = Vx AND Vy.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     chip8->registers[Vx] &= chip8->registers[Vy];
+
+    if constexpr (Q::logic_resets_vf)
+    {
+        chip8->registers[0xF] = 0;
+    }
 }
 
-inline void OP_8xy3(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_8xy3(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy3 - XOR Vx, Vy
     // Set Vx = Vx XOR Vy.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     chip8->registers[Vx] ^= chip8->registers[Vy];
+
+    if constexpr (Q::logic_resets_vf)
+    {
+        chip8->registers[0xF] = 0;
+    }
 }
 
 
-inline void OP_8xy4(CHIP8* chip8)
+inline void OP_8xy4(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy4 - ADD Vx, Vy
     // Set Vx = Vx + Vy, set VF = carry.
@@ -288,8 +596,8 @@ inline void OP_8xy4(CHIP8* chip8)
     // If the result is greater than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0.
     // Only the lowest 8 bits of the result are kept, and stored in Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     uint16_t sum = chip8->registers[Vx] + chip8->registers[Vy];
 
@@ -305,14 +613,14 @@ inline void OP_8xy4(CHIP8* chip8)
     chip8->registers[Vx] = sum & 0xFFu;
 }
 
-inline void OP_8xy5(CHIP8* chip8)
+inline void OP_8xy5(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy5 - SUB Vx, Vy
     // Set Vx = Vx - Vy, set VF = NOT borrow.
     // If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and the results stored in Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     if (chip8->registers[Vx] > chip8->registers[Vy])
     {
@@ -326,28 +634,39 @@ inline void OP_8xy5(CHIP8* chip8)
     chip8->registers[Vx] -= chip8->registers[Vy];
 }
 
-inline void OP_8xy6(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_8xy6(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy6 - SHR Vx
     // Set Vx = Vx SHR 1.
     // If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. Then Vx is divided by 2.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    // Save LSB in VF
-    chip8->registers[0xF] = (chip8->registers[Vx] & 0x1u);
+    if constexpr (Q::shift_uses_vy)
+    {
+        // Vx = Vy SHR 1, the flag is written last
+        uint8_t value = chip8->registers[instr->y];
+        chip8->registers[Vx] = value >> 1;
+        chip8->registers[0xF] = value & 0x1u;
+    }
+    else
+    {
+        // Save LSB in VF
+        chip8->registers[0xF] = (chip8->registers[Vx] & 0x1u);
 
-    chip8->registers[Vx] >>= 1;
+        chip8->registers[Vx] >>= 1;
+    }
 }
 
-inline void OP_8xy7(CHIP8* chip8)
+inline void OP_8xy7(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xy7 - SUBN Vx, Vy
     // Set Vx = Vy - Vx, set VF = NOT borrow.
     // If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and the results stored in Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     if (chip8->registers[Vy] > chip8->registers[Vx])
     {
@@ -362,27 +681,38 @@ inline void OP_8xy7(CHIP8* chip8)
 }
 
 
-inline void OP_8xyE(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_8xyE(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 8xyE - SHL Vx {, Vy}
     // Set Vx = Vx SHL 1.
     // If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    // Save MSB in VF
-    chip8->registers[0xF] = (chip8->registers[Vx] & 0x80u) >> 7u;
+    if constexpr (Q::shift_uses_vy)
+    {
+        // Vx = Vy SHL 1, the flag is written last
+        uint8_t value = chip8->registers[instr->y];
+        chip8->registers[Vx] = value << 1;
+        chip8->registers[0xF] = (value & 0x80u) >> 7u;
+    }
+    else
+    {
+        // Save MSB in VF
+        chip8->registers[0xF] = (chip8->registers[Vx] & 0x80u) >> 7u;
 
-    chip8->registers[Vx] <<= 1;
+        chip8->registers[Vx] <<= 1;
+    }
 }
 
-inline void OP_9xy0(CHIP8* chip8)
+inline void OP_9xy0(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // 9xy0 - SNE Vx, Vy
     // Skip next instruction if Vx != Vy.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
 
     if (chip8->registers[Vx] != chip8->registers[Vy])
     {
@@ -390,82 +720,96 @@ inline void OP_9xy0(CHIP8* chip8)
     }
 }
 
-inline void OP_Annn(CHIP8* chip8)
+inline void OP_Annn(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Annn - LD I, addr
     // Set I = nnn.
 
-    uint16_t address = chip8->opcode & 0x0FFFu;
+    uint16_t address = instr->nnn;
 
     chip8->index = address;
 }
 
-inline void OP_Bnnn(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_Bnnn(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Bnnn - JP V0, addr
     // Jump to location nnn + V0.
+    // (Bxnn - JP Vx, addr on CHIP-48 and SUPER-CHIP, jump to xnn + Vx)
 
-    uint16_t address = chip8->opcode & 0x0FFFu;
+    uint16_t address = instr->nnn;
 
-    chip8->pc = chip8->registers[0] + address;
+    if constexpr (Q::jump_uses_vx)
+    {
+        chip8->pc = chip8->registers[instr->x] + address;
+    }
+    else
+    {
+        chip8->pc = chip8->registers[0] + address;
+    }
 }
 
-inline void OP_Cxkk(CHIP8* chip8)
+inline void OP_Cxkk(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Cxkk - RND Vx, byte
     // Set Vx = random byte AND kk.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t byte = chip8->opcode & 0x00FFu;
+    uint8_t Vx = instr->x;
+    uint8_t byte = instr->kk;
 
-    //TODO: use a different rand on the bytes
-    chip8->registers[Vx] = rand() & byte;
+    chip8->registers[Vx] = chip8_random_byte(chip8) & byte;
 }
 
-inline void OP_Dxyn(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_Dxyn(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Dxyn - DRW Vx, Vy, nibble
     // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
-    uint8_t Vy = (chip8->opcode & 0x00F0u) >> 4u;
-    uint8_t height = chip8->opcode & 0x000Fu;
+    uint8_t Vx = instr->x;
+    uint8_t Vy = instr->y;
+    uint8_t height = instr->kk & 0x000Fu;
 
     // Wrap if going beyond screen boundaries
     uint8_t xPos = chip8->registers[Vx] % VIDEO_WIDTH;
     uint8_t yPos = chip8->registers[Vy] % VIDEO_HEIGHT;
 
-    chip8->registers[0xF] = 0;
+    uint64_t collision = 0;
 
     for (unsigned int row = 0; row < height; ++row)
     {
-        uint8_t spriteByte = chip8->memory[chip8->index + row];
+        uint64_t spriteByte = chip8->memory[(chip8->index + row) & 0x0FFFu];
+        unsigned int y;
+        uint64_t spriteRow;
 
-        for (unsigned int col = 0; col < 8; ++col)
+        if constexpr (Q::sprites_wrap)
         {
-            uint8_t spritePixel = spriteByte & (0x80u >> col);
-            uint8_t* screenPixel = &chip8->video[(yPos + row) * VIDEO_WIDTH + (xPos + col)];
-
-            // Sprite pixel is on
-            if (spritePixel)
+            // rows and columns past the edges come back in on the other side
+            y = (yPos + row) % VIDEO_HEIGHT;
+            spriteRow = std::rotr(spriteByte << (VIDEO_WIDTH - 8), xPos);
+        }
+        else
+        {
+            // Clip rows that fall off the bottom of the screen
+            if (yPos + row >= VIDEO_HEIGHT)
             {
-                // Screen pixel also on - collision
-                if (*screenPixel == 0xFF)
-                {
-                    chip8->registers[0xF] = 1;
-                }
-
-                // XOR with the sprite pixel
-                *screenPixel ^= 0xFF;
+                break;
             }
+            y = yPos + row;
+
+            // Line the sprite up with the row, columns past the right edge get shifted out (clipped)
+            spriteRow = xPos <= VIDEO_WIDTH - 8 ? spriteByte << (VIDEO_WIDTH - 8 - xPos)
+                                                : spriteByte >> (xPos - (VIDEO_WIDTH - 8));
         }
-    }
 
-    //color conversion, so there are no inbetween values
-    for (int i = 0; i < VIDEO_WIDTH*VIDEO_HEIGHT; i++) {
-        chip8->video[i] = chip8->video[i] ? 255 : 0;
+        // Screen pixel also on - collision, then XOR the whole row at once
+        collision |= chip8->video[y] & spriteRow;
+        chip8->video[y] ^= spriteRow;
     }
 
+    chip8->registers[0xF] = collision != 0;
+    chip8->events |= CHIP8_EVENT_DRAW;
+
 
     // uint8_t target_v_reg_x = (chip8->opcode & 0x0F00) >> 8;
     // uint8_t target_v_reg_y = (chip8->opcode & 0x00F0) >> 4;
@@ -489,12 +833,12 @@ inline void OP_Dxyn(CHIP8* chip8)
     // }
 }
 
-inline void OP_Ex9E(CHIP8* chip8)
+inline void OP_Ex9E(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Ex9E - SKP Vx
     // Skip next instruction if key with the value of Vx is pressed.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
     uint8_t key = chip8->registers[Vx];
 
@@ -504,12 +848,12 @@ inline void OP_Ex9E(CHIP8* chip8)
     }
 }
 
-inline void OP_ExA1(CHIP8* chip8)
+inline void OP_ExA1(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // ExA1 - SKNP Vx
     // Skip next instruction if key with the value of Vx is not pressed.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
     uint8_t key = chip8->registers[Vx];
 
@@ -519,195 +863,207 @@ inline void OP_ExA1(CHIP8* chip8)
     }
 }
 
-inline void OP_Fx07(CHIP8* chip8)
+inline void OP_Fx07(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx07 - LD Vx, DT
     // Set Vx = delay timer value.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    chip8->registers[Vx] = chip8->delay_timer;
+    chip8->registers[Vx] = chip8_delay_timer(chip8);
 }
 
-inline void OP_Fx0A(CHIP8* chip8)
+inline void OP_Fx0A(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx0A - LD Vx, K
     // Wait for a key press, store the value of the key in Vx.
+    // Like the COSMAC VIP the key is only taken once it's released again. Until then the CPU is halted here,
+    // the instruction runs again every cycle without changing anything (see chip8_key_wait_blocked)
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    if (chip8->keypad[0])
-    {
-        chip8->registers[Vx] = 0;
-    }
-    else if (chip8->keypad[1])
-    {
-        chip8->registers[Vx] = 1;
-    }
-    else if (chip8->keypad[2])
-    {
-        chip8->registers[Vx] = 2;
-    }
-    else if (chip8->keypad[3])
-    {
-        chip8->registers[Vx] = 3;
-    }
-    else if (chip8->keypad[4])
-    {
-        chip8->registers[Vx] = 4;
-    }
-    else if (chip8->keypad[5])
-    {
-        chip8->registers[Vx] = 5;
-    }
-    else if (chip8->keypad[6])
-    {
-        chip8->registers[Vx] = 6;
-    }
-    else if (chip8->keypad[7])
-    {
-        chip8->registers[Vx] = 7;
-    }
-    else if (chip8->keypad[8])
-    {
-        chip8->registers[Vx] = 8;
-    }
-    else if (chip8->keypad[9])
-    {
-        chip8->registers[Vx] = 9;
-    }
-    else if (chip8->keypad[10])
-    {
-        chip8->registers[Vx] = 10;
-    }
-    else if (chip8->keypad[11])
-    {
-        chip8->registers[Vx] = 11;
-    }
-    else if (chip8->keypad[12])
-    {
-        chip8->registers[Vx] = 12;
-    }
-    else if (chip8->keypad[13])
-    {
-        chip8->registers[Vx] = 13;
-    }
-    else if (chip8->keypad[14])
-    {
-        chip8->registers[Vx] = 14;
-    }
-    else if (chip8->keypad[15])
+    chip8->waiting_key = true;
+
+    if (chip8->wait_key == CHIP8_NO_KEY)
     {
-        chip8->registers[Vx] = 15;
+        for (uint8_t key = 0; key < 16; key++)
+        {
+            if (chip8->keypad[key])
+            {
+                chip8->wait_key = key;
+                break;
+            }
+        }
     }
-    else
+    else if (!chip8->keypad[chip8->wait_key])
     {
-        chip8->pc -= 2;
+        chip8->registers[Vx] = chip8->wait_key;
+        chip8->wait_key = CHIP8_NO_KEY;
+        chip8->waiting_key = false;
+        return;
     }
+
+    chip8->pc -= 2;
+    chip8->events |= CHIP8_EVENT_WAIT_KEY;
 }
 
-inline void OP_Fx15(CHIP8* chip8)
+inline void OP_Fx15(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx15 - LD DT, Vx
     // Set delay timer = Vx.
 
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    chip8->delay_timer = chip8->registers[Vx];
+    chip8_set_delay_timer(chip8, chip8->registers[Vx]);
 }
 
-inline void OP_Fx18(CHIP8* chip8)
+inline void OP_Fx18(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx18 - LD ST, Vx
     // Set sound timer = Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
-    chip8->sound_timer = chip8->registers[Vx];
+    if (!chip8_sound_playing(chip8) && chip8->registers[Vx] > 0)
+    {
+        chip8->events |= CHIP8_EVENT_SOUND;
+    }
+    chip8_set_sound_timer(chip8, chip8->registers[Vx]);
 }
 
-inline void OP_Fx1E(CHIP8* chip8)
+inline void OP_Fx1E(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx1E - ADD I, Vx
     // Set I = I + Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
     chip8->index += chip8->registers[Vx];
 }
 
-inline void OP_Fx29(CHIP8* chip8)
+inline void OP_Fx29(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx29 - LD F, Vx
     // Set I = location of sprite for digit Vx.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
     uint8_t digit = chip8->registers[Vx];
 
     chip8->index = FONTSET_START_ADDRESS + (5 * digit);
 }
 
-inline void OP_Fx33(CHIP8* chip8)
+inline void OP_Fx33(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Store BCD representation of Vx in memory locations I, I+1, and I+2.
     // The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I,
     // the tens digit at location I+1, and the ones digit at location I+2.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
     uint8_t value = chip8->registers[Vx];
 
     // Ones-place
-    chip8->memory[chip8->index + 2] = value % 10;
+    chip8->memory[(chip8->index + 2) & 0x0FFFu] = value % 10;
     value /= 10;
 
     // Tens-place
-    chip8->memory[chip8->index + 1] = value % 10;
+    chip8->memory[(chip8->index + 1) & 0x0FFFu] = value % 10;
     value /= 10;
 
     // Hundreds-place
-    chip8->memory[chip8->index] = value % 10;
+    chip8->memory[chip8->index & 0x0FFFu] = value % 10;
+
+    chip8_code_written(chip8, chip8->index, 3);
+}
+
+// what Fx55/Fx65 leave in I afterwards
+template <typename Q>
+inline void chip8_load_store_index(CHIP8* chip8, uint8_t Vx)
+{
+    if constexpr (Q::load_store_index == CHIP8_INDEX_ADD_X)
+    {
+        chip8->index += Vx;
+    }
+    else if constexpr (Q::load_store_index == CHIP8_INDEX_ADD_X_PLUS_1)
+    {
+        chip8->index += Vx + 1;
+    }
 }
 
-inline void OP_Fx55(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_Fx55(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx55 - LD [I], Vx
     // Store registers V0 through Vx in memory starting at location I.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
     for (uint8_t i = 0; i <= Vx; ++i)
     {
-        chip8->memory[chip8->index + i] = chip8->registers[i];
+        chip8->memory[(chip8->index + i) & 0x0FFFu] = chip8->registers[i];
     }
+
+    chip8_code_written(chip8, chip8->index, Vx + 1);
+
+    chip8_load_store_index<Q>(chip8, Vx);
 }
 
-inline void OP_Fx65(CHIP8* chip8)
+template <typename Q = CHIP8_QUIRKS_DEFAULT>
+inline void OP_Fx65(CHIP8* chip8, const CHIP8_INSTR* instr)
 {
     // Fx65 - LD Vx, [I]
     // Read registers V0 through Vx from memory starting at location I.
 
-    uint8_t Vx = (chip8->opcode & 0x0F00u) >> 8u;
+    uint8_t Vx = instr->x;
 
     for (uint8_t i = 0; i <= Vx; ++i)
     {
-        chip8->registers[i] = chip8->memory[chip8->index + i];
+        chip8->registers[i] = chip8->memory[(chip8->index + i) & 0x0FFFu];
     }
+
+    chip8_load_store_index<Q>(chip8, Vx);
 }
 
 
 /*** FUNCTION ***/
 
-inline CHIP8* chip8_init()
+inline void chip8_decode_cache_build(CHIP8* chip8);
+
+// zeroed memory starting on a cache line, size is rounded up to whole lines
+inline void* chip8_aligned_alloc(size_t size)
 {
-    // Initialize registers and memory once
-    CHIP8* chip8 = (CHIP8 *) malloc(sizeof(CHIP8));
+    size = (size + CHIP8_CACHE_LINE - 1) & ~(size_t) (CHIP8_CACHE_LINE - 1);
+#if defined(_MSC_VER)
+    void* memory = _aligned_malloc(size, CHIP8_CACHE_LINE);
+#else
+    void* memory = aligned_alloc(CHIP8_CACHE_LINE, size);
+#endif
+    if (memory)
+    {
+        memset(memory, 0, size);
+    }
+    return memory;
+}
+
+inline void chip8_aligned_free(void* memory)
+{
+#if defined(_MSC_VER)
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
 
+// puts a zeroed machine into its power on state, the decode cache is left to the caller
+inline void chip8_power_on(CHIP8* chip8, uint64_t seed)
+{
     //init program counter
     chip8->pc = START_ADDRESS;
     //zero index anx stack pointer
     chip8->index = 0;
     chip8->sp = 0;
+    chip8->wait_key = CHIP8_NO_KEY;
+    chip8_seed_random(chip8, seed);
 
     //zero the display
     memset(chip8->video, 0, sizeof(chip8->video));
@@ -717,12 +1073,57 @@ inline CHIP8* chip8_init()
     {
         chip8->memory[FONTSET_START_ADDRESS + i] = fontset[i];
     }
+}
+
+// seed picks the Cxkk sequence, the same seed always gives the same run. NULL if the machine can't be allocated
+inline CHIP8* chip8_init(uint64_t seed = CHIP8_DEFAULT_SEED)
+{
+    // Initialize registers and memory once
+    // zeroed so registers, stack, keypad, timers and memory start the same every run.
+    // for many machines at once see chip8_pool.h
+    CHIP8* chip8 = (CHIP8 *) chip8_aligned_alloc(sizeof(CHIP8));
+    if (!chip8)
+    {
+        return NULL;
+    }
+    chip8_power_on(chip8, seed);
+
+    chip8->decoded = (CHIP8_INSTR*) chip8_aligned_alloc(DECODE_CACHE_SIZE * sizeof(CHIP8_INSTR));
+    if (!chip8->decoded)
+    {
+        chip8_aligned_free(chip8);
+        return NULL;
+    }
+    chip8_decode_cache_build(chip8);
     return chip8;
 }
 
 inline void chip8_free(CHIP8* chip8)
 {
-    free(chip8);
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->destroy(chip8);
+    }
+    chip8_aligned_free(chip8->decoded);
+    chip8_aligned_free(chip8);
+}
+
+inline void chip8_load_rom_memory(CHIP8* chip8, const uint8_t* rom, unsigned int rom_size)
+{
+    //anything past 0xFFF would not fit into memory
+    if (rom_size > sizeof(chip8->memory) - START_ADDRESS)
+    {
+        rom_size = sizeof(chip8->memory) - START_ADDRESS;
+    }
+
+    //put the rom into the chip8's memory
+    memcpy(&chip8->memory[START_ADDRESS], rom, rom_size);
+
+    chip8_decode_cache_build(chip8);
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->invalidate(chip8, 0, sizeof(chip8->memory));
+    }
 }
 
 inline bool chip8_load_rom(CHIP8* chip8, const char* filename)
@@ -747,16 +1148,13 @@ inline bool chip8_load_rom(CHIP8* chip8, const char* filename)
         //buffer, size, count, file pointer
         unsigned char* buffer = (unsigned char*)malloc(rom_size);
 
-        fread(&buffer, rom_size, 1, rom_file);
+        fread(buffer, rom_size, 1, rom_file);
 
         //close file
         fclose(rom_file);
 
         //put buffer memory into the chip8's memory
-        for (int i = 0; i < rom_size; i++)
-        {
-            chip8->memory[START_ADDRESS + i] = buffer[i];
-        }
+        chip8_load_rom_memory(chip8, buffer, rom_size);
         printf("LOADED ROM FILE SUCCESSFUL\n");
 
         free(buffer);
@@ -765,121 +1163,234 @@ inline bool chip8_load_rom(CHIP8* chip8, const char* filename)
 
 
     printf("ERROR CANNOT READ ROM FILE\n");
-    fclose(rom_file);
     return false;
 }
 
-inline void chip8_cycle(CHIP8* chip8)
+// Picks the quirks profile (CHIP8_QUIRK_PROFILE), normally right before or after loading the rom.
+// The decode cache is rebuilt with the profile's handlers and translated code is thrown away
+inline void chip8_set_quirks(CHIP8* chip8, uint8_t profile)
 {
-    /***  Fetch Opcode ***/
-    chip8->opcode = (chip8->memory[chip8->pc] << 8u) | chip8->memory[chip8->pc + 1];
-    // Increment the PC before we execute anything
-    chip8->pc += 2;
+    chip8->quirks = profile < CHIP8_PROFILE_COUNT ? profile : (uint8_t) CHIP8_PROFILE_DEFAULT;
 
-    printf("Opcode: %x \n", chip8->opcode);
-    printf("Program Counter: %x \n", chip8->pc);
-    printf("I: %x \n", chip8->index);
+    chip8_decode_cache_build(chip8);
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->invalidate(chip8, 0, sizeof(chip8->memory));
+    }
+}
 
-    /***  Decode Opcode and Execute Opcode ***/
-    switch (chip8->opcode & 0xF000)
+// The one way input reaches the machine, key is the keypad key 0x0-0xF
+inline void chip8_set_key(CHIP8* chip8, uint8_t key, bool pressed)
+{
+    chip8->keypad[key & 0x0Fu] = pressed ? 1 : 0;
+}
+
+// the keypad as a bit per key, bit n is key n
+inline uint16_t chip8_keypad_mask(const CHIP8* chip8)
+{
+    uint16_t mask = 0;
+    for (unsigned int key = 0; key < 16; key++)
     {
-        case 0x0000:
-            switch (chip8->opcode & 0x00FF)
-            {
-                case 0x00E0:
-                    OP_00E0(chip8);
-                    break;
-                case 0x00EE:
-                    OP_00EE(chip8);
-                    break;
-                default:
-                    printf("Unknown opcode 0x0: 0x%X\n", chip8->opcode);
-                    break;
-            }
-            break;
-        case 0x1000: //1nnn
-            OP_1nnn(chip8);
-            break;
-        case 0x2000:
-            OP_2nnn(chip8);
-            break;
-        case 0x3000:
-            OP_3xkk(chip8);
-            break;
-        case 0x4000:
-            OP_4xkk(chip8);
-            break;
-        case 0x5000:
-            OP_5xy0(chip8);
-            break;
-        case 0x6000:
-            OP_6xkk(chip8);
-            break;
+        mask |= chip8->keypad[key] ? (uint16_t) (1u << key) : 0;
+    }
+    return mask;
+}
+
+inline void chip8_set_keypad_mask(CHIP8* chip8, uint16_t mask)
+{
+    for (uint8_t key = 0; key < 16; key++)
+    {
+        chip8_set_key(chip8, key, (mask >> key) & 1u);
+    }
+}
+
+// Unpacks a display (CHIP8::video, or a copy of one) into one byte per pixel (0 or 255), pixels must hold
+// VIDEO_WIDTH * VIDEO_HEIGHT bytes
+inline void chip8_video_expand_rows(const uint64_t* video, uint8_t* pixels)
+{
+#if CHIP8_SSE2
+    // each 16 pixel chunk: copy its two bytes across 8 lanes each, keep one bit per lane, compare to get 0x00/0xFF
+    const __m128i bits = _mm_set1_epi64x(0x0102040810204080ll);
+
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; y++)
+    {
+        uint64_t row = video[y];
+        for (unsigned int chunk = 0; chunk < VIDEO_WIDTH / 16; chunk++)
+        {
+            uint64_t left = (row >> (56 - chunk * 16)) & 0xFFu;
+            uint64_t right = (row >> (48 - chunk * 16)) & 0xFFu;
+            __m128i lanes = _mm_set_epi64x((long long) (right * 0x0101010101010101ull),
+                                           (long long) (left * 0x0101010101010101ull));
+            __m128i on = _mm_cmpeq_epi8(_mm_and_si128(lanes, bits), bits);
+            _mm_storeu_si128((__m128i*) &pixels[y * VIDEO_WIDTH + chunk * 16], on);
+        }
+    }
+#else
+    for (unsigned int y = 0; y < VIDEO_HEIGHT; y++)
+    {
+        uint64_t row = video[y];
+        for (unsigned int x = 0; x < VIDEO_WIDTH; x++)
+        {
+            pixels[y * VIDEO_WIDTH + x] = (row >> (VIDEO_WIDTH - 1 - x)) & 1u ? 255 : 0;
+        }
+    }
+#endif
+}
+
+inline void chip8_video_expand(const CHIP8* chip8, uint8_t* pixels)
+{
+    chip8_video_expand_rows(chip8->video, pixels);
+}
+
+//FNV-1a over the display (as 0/255 bytes), used by the headless runner to compare runs
+inline uint64_t chip8_video_hash(const CHIP8* chip8)
+{
+    uint8_t pixels[VIDEO_WIDTH * VIDEO_HEIGHT];
+    chip8_video_expand(chip8, pixels);
+
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned int i = 0; i < sizeof(pixels); i++)
+    {
+        hash ^= pixels[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline void chip8_fetch(CHIP8* chip8)
+{
+    /***  Fetch Opcode ***/
+    chip8->opcode = (chip8->memory[chip8->pc & 0x0FFFu] << 8u) | chip8->memory[(chip8->pc + 1) & 0x0FFFu];
+    chip8_trace<CHIP8_TRACE_INSTRUCTIONS>(CHIP8_TRACE_INSTR, chip8->pc, chip8->opcode, chip8->index, chip8->sp);
+
+    // Increment the PC before we execute anything
+    chip8->pc += 2;
+}
+
+// once per 60hz frame (see chip8_run_frame), not per instruction
+inline void chip8_update_timers(CHIP8* chip8)
+{
+    chip8_advance_timers(chip8, 1);
+}
+
+inline CHIP8_INSTR chip8_decode_operands(uint16_t opcode)
+{
+    CHIP8_INSTR instr;
+    instr.handler = nullptr;
+    instr.opcode = opcode;
+    instr.nnn = opcode & 0x0FFFu;
+    instr.x = (opcode & 0x0F00u) >> 8u;
+    instr.y = (opcode & 0x00F0u) >> 4u;
+    instr.kk = opcode & 0x00FFu;
+    instr.op = 0;
+    return instr;
+}
+
+template <typename Q>
+CHIP8_FORCE_INLINE void chip8_execute_switch(CHIP8* chip8)
+{
+    /***  Decode Opcode and Execute Opcode ***/
+    CHIP8_INSTR instr = chip8_decode_operands(chip8->opcode);
+
+    switch (chip8->opcode & 0xF000)
+    {
+        case 0x0000:
+            switch (chip8->opcode & 0x00FF)
+            {
+                case 0x00E0:
+                    OP_00E0(chip8, &instr);
+                    break;
+                case 0x00EE:
+                    OP_00EE(chip8, &instr);
+                    break;
+                default:
+                    OP_NULL(chip8, &instr);
+                    break;
+            }
+            break;
+        case 0x1000: //1nnn
+            OP_1nnn(chip8, &instr);
+            break;
+        case 0x2000:
+            OP_2nnn(chip8, &instr);
+            break;
+        case 0x3000:
+            OP_3xkk(chip8, &instr);
+            break;
+        case 0x4000:
+            OP_4xkk(chip8, &instr);
+            break;
+        case 0x5000:
+            OP_5xy0(chip8, &instr);
+            break;
+        case 0x6000:
+            OP_6xkk(chip8, &instr);
+            break;
         case 0x7000:
-            OP_7xkk(chip8);
+            OP_7xkk(chip8, &instr);
             break;
         case 0x8000:
             switch (chip8->opcode & 0x000F)
             {
                 case 0x0000:
-                    OP_8xy0(chip8);
+                    OP_8xy0(chip8, &instr);
                     break;
                 case 0x0001:
-                    OP_8xy1(chip8);
+                    OP_8xy1<Q>(chip8, &instr);
                     break;
                 case 0x0002:
-                    OP_8xy2(chip8);
+                    OP_8xy2<Q>(chip8, &instr);
                     break;
                 case 0x0003:
-                    OP_8xy3(chip8);
+                    OP_8xy3<Q>(chip8, &instr);
                     break;
                 case 0x0004:
-                    OP_8xy4(chip8);
+                    OP_8xy4(chip8, &instr);
                     break;
                 case 0x0005:
-                    OP_8xy5(chip8);
+                    OP_8xy5(chip8, &instr);
                     break;
                 case 0x0006:
-                    OP_8xy6(chip8);
+                    OP_8xy6<Q>(chip8, &instr);
                     break;
                 case 0x0007:
-                    OP_8xy7(chip8);
+                    OP_8xy7(chip8, &instr);
                     break;
                 case 0x000E:
-                    OP_8xyE(chip8);
+                    OP_8xyE<Q>(chip8, &instr);
                     break;
                 default:
-                    printf("Unknown opcode 0x8: 0x%X\n", chip8->opcode);
+                    OP_NULL(chip8, &instr);
                     break;
             }
             break;
 
         case 0x9000:
-            OP_9xy0(chip8);
+            OP_9xy0(chip8, &instr);
             break;
         case 0xA000:
-            OP_Annn(chip8);
+            OP_Annn(chip8, &instr);
             break;
         case 0xB000:
-            OP_Bnnn(chip8);
+            OP_Bnnn<Q>(chip8, &instr);
             break;
         case 0xC000:
-            OP_Cxkk(chip8);
+            OP_Cxkk(chip8, &instr);
             break;
         case 0xD000:
-            OP_Dxyn(chip8);
+            OP_Dxyn<Q>(chip8, &instr);
             break;
         case 0xE000: //Exkk
             switch (chip8->opcode & 0x00FF)
             {
                 case 0x009E: //Ex9E
-                    OP_Ex9E(chip8);
+                    OP_Ex9E(chip8, &instr);
                     break;
                 case 0x00A1: //ExA1
-                    OP_ExA1(chip8);
+                    OP_ExA1(chip8, &instr);
                     break;
                 default:
-                    printf("Unknown opcode E: 0x%X\n", chip8->opcode);
+                    OP_NULL(chip8, &instr);
                     break;
             }
             break;
@@ -887,61 +1398,796 @@ inline void chip8_cycle(CHIP8* chip8)
             switch (chip8->opcode & 0x00FF)
             {
                 case 0x0007: //$Fx07
-                    OP_Fx07(chip8);
+                    OP_Fx07(chip8, &instr);
                     break;
                 case 0x000A: // $Fx0A
-                    OP_Fx0A(chip8);
+                    OP_Fx0A(chip8, &instr);
                     break;
                 case 0x0015: // $Fx15
-                    OP_Fx15(chip8);
+                    OP_Fx15(chip8, &instr);
                     break;
                 case 0x0018: // $Fx18
-                    OP_Fx18(chip8);
+                    OP_Fx18(chip8, &instr);
                     break;
                 case 0x001E: // $Fx1E
-                    OP_Fx1E(chip8);
+                    OP_Fx1E(chip8, &instr);
                     break;
                 case 0x0029: // $Fx29
-                    OP_Fx29(chip8);
+                    OP_Fx29(chip8, &instr);
                     break;
                 case 0x0033: // $Fx33
-                    OP_Fx33(chip8);
+                    OP_Fx33(chip8, &instr);
                     break;
                 case 0x0055: // $Fx55
-                    OP_Fx55(chip8);
+                    OP_Fx55<Q>(chip8, &instr);
                     break;
                 case 0x0065: // $Fx65
-                    OP_Fx65(chip8);
+                    OP_Fx65<Q>(chip8, &instr);
                     break;
                 default:
-                    printf("Unknown opcode F: 0x%X\n", chip8->opcode);
+                    OP_NULL(chip8, &instr);
                     break;
             }
             break;
         default:
-            printf("Unknown opcode [0x0000]: 0x%X\n", chip8->opcode);
+            OP_NULL(chip8, &instr);
             break;
     }
+}
+
+
+/*** DISPATCH TABLE ***/
+// Alternative to the nested switch: every opcode maps to its handler through a single table lookup.
+// The key is the high nibble plus the low byte, which is enough to tell all 35 opcodes apart,
+// so the table is 16 * 256 one byte entries (4k, stays in L1) instead of 65536 entries.
+// The entry is a dense opcode id, so executing it is one jump through the compiler's jump table
+// and the handlers still get inlined, unlike calling through a table of function pointers.
+
+enum CHIP8_OP : uint8_t
+{
+    CHIP8_OP_NULL,
+    CHIP8_OP_00E0,
+    CHIP8_OP_00EE,
+    CHIP8_OP_1nnn,
+    CHIP8_OP_2nnn,
+    CHIP8_OP_3xkk,
+    CHIP8_OP_4xkk,
+    CHIP8_OP_5xy0,
+    CHIP8_OP_6xkk,
+    CHIP8_OP_7xkk,
+    CHIP8_OP_8xy0,
+    CHIP8_OP_8xy1,
+    CHIP8_OP_8xy2,
+    CHIP8_OP_8xy3,
+    CHIP8_OP_8xy4,
+    CHIP8_OP_8xy5,
+    CHIP8_OP_8xy6,
+    CHIP8_OP_8xy7,
+    CHIP8_OP_8xyE,
+    CHIP8_OP_9xy0,
+    CHIP8_OP_Annn,
+    CHIP8_OP_Bnnn,
+    CHIP8_OP_Cxkk,
+    CHIP8_OP_Dxyn,
+    CHIP8_OP_Ex9E,
+    CHIP8_OP_ExA1,
+    CHIP8_OP_Fx07,
+    CHIP8_OP_Fx0A,
+    CHIP8_OP_Fx15,
+    CHIP8_OP_Fx18,
+    CHIP8_OP_Fx1E,
+    CHIP8_OP_Fx29,
+    CHIP8_OP_Fx33,
+    CHIP8_OP_Fx55,
+    CHIP8_OP_Fx65,
+    CHIP8_OP_COUNT
+};
+
+// one table per quirks profile, the decode cache fills its records from the machine's
+template <typename Q>
+inline constexpr chip8_op_fn chip8_op_handlers[CHIP8_OP_COUNT] =
+{
+    OP_NULL,
+    OP_00E0,
+    OP_00EE,
+    OP_1nnn,
+    OP_2nnn,
+    OP_3xkk,
+    OP_4xkk,
+    OP_5xy0,
+    OP_6xkk,
+    OP_7xkk,
+    OP_8xy0,
+    OP_8xy1<Q>,
+    OP_8xy2<Q>,
+    OP_8xy3<Q>,
+    OP_8xy4,
+    OP_8xy5,
+    OP_8xy6<Q>,
+    OP_8xy7,
+    OP_8xyE<Q>,
+    OP_9xy0,
+    OP_Annn,
+    OP_Bnnn<Q>,
+    OP_Cxkk,
+    OP_Dxyn<Q>,
+    OP_Ex9E,
+    OP_ExA1,
+    OP_Fx07,
+    OP_Fx0A,
+    OP_Fx15,
+    OP_Fx18,
+    OP_Fx1E,
+    OP_Fx29,
+    OP_Fx33,
+    OP_Fx55<Q>,
+    OP_Fx65<Q>,
+};
+
+#define DISPATCH_KEY(x) ((((x) & 0xF000u) >> 4u) | ((x) & 0x00FFu))
+#define DISPATCH_TABLE_SIZE 4096
+
+consteval CHIP8_OP chip8_decode_op(uint16_t opcode)
+{
+    unsigned int low_byte = opcode & 0x00FFu;
+
+    switch (opcode >> 12u)
+    {
+        case 0x0:
+            if (low_byte == 0xE0) return CHIP8_OP_00E0;
+            if (low_byte == 0xEE) return CHIP8_OP_00EE;
+            return CHIP8_OP_NULL;
+        case 0x1: return CHIP8_OP_1nnn;
+        case 0x2: return CHIP8_OP_2nnn;
+        case 0x3: return CHIP8_OP_3xkk;
+        case 0x4: return CHIP8_OP_4xkk;
+        case 0x5: return CHIP8_OP_5xy0;
+        case 0x6: return CHIP8_OP_6xkk;
+        case 0x7: return CHIP8_OP_7xkk;
+        case 0x8:
+            switch (opcode & 0x000Fu)
+            {
+                case 0x0: return CHIP8_OP_8xy0;
+                case 0x1: return CHIP8_OP_8xy1;
+                case 0x2: return CHIP8_OP_8xy2;
+                case 0x3: return CHIP8_OP_8xy3;
+                case 0x4: return CHIP8_OP_8xy4;
+                case 0x5: return CHIP8_OP_8xy5;
+                case 0x6: return CHIP8_OP_8xy6;
+                case 0x7: return CHIP8_OP_8xy7;
+                case 0xE: return CHIP8_OP_8xyE;
+                default: return CHIP8_OP_NULL;
+            }
+        case 0x9: return CHIP8_OP_9xy0;
+        case 0xA: return CHIP8_OP_Annn;
+        case 0xB: return CHIP8_OP_Bnnn;
+        case 0xC: return CHIP8_OP_Cxkk;
+        case 0xD: return CHIP8_OP_Dxyn;
+        case 0xE:
+            if (low_byte == 0x9E) return CHIP8_OP_Ex9E;
+            if (low_byte == 0xA1) return CHIP8_OP_ExA1;
+            return CHIP8_OP_NULL;
+        default:
+            switch (low_byte)
+            {
+                case 0x07: return CHIP8_OP_Fx07;
+                case 0x0A: return CHIP8_OP_Fx0A;
+                case 0x15: return CHIP8_OP_Fx15;
+                case 0x18: return CHIP8_OP_Fx18;
+                case 0x1E: return CHIP8_OP_Fx1E;
+                case 0x29: return CHIP8_OP_Fx29;
+                case 0x33: return CHIP8_OP_Fx33;
+                case 0x55: return CHIP8_OP_Fx55;
+                case 0x65: return CHIP8_OP_Fx65;
+                default: return CHIP8_OP_NULL;
+            }
+    }
+}
+
+consteval std::array<CHIP8_OP, DISPATCH_TABLE_SIZE> chip8_build_dispatch_table()
+{
+    std::array<CHIP8_OP, DISPATCH_TABLE_SIZE> table{};
+
+    for (unsigned int key = 0; key < DISPATCH_TABLE_SIZE; key++)
+    {
+        // rebuild an opcode with the same key, the x/y nibbles don't matter
+        uint16_t opcode = ((key & 0xF00u) << 4u) | (key & 0x0FFu);
+        table[key] = chip8_decode_op(opcode);
+    }
+
+    return table;
+}
+
+inline constexpr std::array<CHIP8_OP, DISPATCH_TABLE_SIZE> chip8_dispatch_table = chip8_build_dispatch_table();
+
+inline CHIP8_OP chip8_lookup_op(uint16_t opcode)
+{
+    return chip8_dispatch_table[DISPATCH_KEY(opcode)];
+}
 
+inline const chip8_op_fn* chip8_profile_handlers(uint8_t profile)
+{
+    return chip8_with_quirks(profile, []<typename Q>() -> const chip8_op_fn* { return chip8_op_handlers<Q>; });
+}
 
-    /*** Update timers ***/
+inline CHIP8_INSTR chip8_decode(uint16_t opcode, uint8_t profile = CHIP8_PROFILE_DEFAULT)
+{
+    CHIP8_INSTR instr = chip8_decode_operands(opcode);
+    instr.op = chip8_lookup_op(opcode);
+    instr.handler = chip8_profile_handlers(profile)[instr.op];
+    return instr;
+}
 
+// ops with a handler per quirks profile
+inline bool chip8_op_has_quirks(uint8_t op)
+{
+    switch (op)
+    {
+        case CHIP8_OP_8xy1:
+        case CHIP8_OP_8xy2:
+        case CHIP8_OP_8xy3:
+        case CHIP8_OP_8xy6:
+        case CHIP8_OP_8xyE:
+        case CHIP8_OP_Bnnn:
+        case CHIP8_OP_Dxyn:
+        case CHIP8_OP_Fx55:
+        case CHIP8_OP_Fx65:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    // Decrement the delay timer if it's been set
-    if (chip8->delay_timer > 0)
+// run an already decoded instruction, one jump on the op id
+template <typename Q>
+CHIP8_FORCE_INLINE void chip8_execute_instr(CHIP8* chip8, const CHIP8_INSTR* instr)
+{
+    switch (instr->op)
     {
-        //pre decrement
-        --chip8->delay_timer;
+        case CHIP8_OP_NULL:
+            OP_NULL(chip8, instr);
+            break;
+        case CHIP8_OP_00E0:
+            OP_00E0(chip8, instr);
+            break;
+        case CHIP8_OP_00EE:
+            OP_00EE(chip8, instr);
+            break;
+        case CHIP8_OP_1nnn:
+            OP_1nnn(chip8, instr);
+            break;
+        case CHIP8_OP_2nnn:
+            OP_2nnn(chip8, instr);
+            break;
+        case CHIP8_OP_3xkk:
+            OP_3xkk(chip8, instr);
+            break;
+        case CHIP8_OP_4xkk:
+            OP_4xkk(chip8, instr);
+            break;
+        case CHIP8_OP_5xy0:
+            OP_5xy0(chip8, instr);
+            break;
+        case CHIP8_OP_6xkk:
+            OP_6xkk(chip8, instr);
+            break;
+        case CHIP8_OP_7xkk:
+            OP_7xkk(chip8, instr);
+            break;
+        case CHIP8_OP_8xy0:
+            OP_8xy0(chip8, instr);
+            break;
+        case CHIP8_OP_8xy1:
+            OP_8xy1<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_8xy2:
+            OP_8xy2<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_8xy3:
+            OP_8xy3<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_8xy4:
+            OP_8xy4(chip8, instr);
+            break;
+        case CHIP8_OP_8xy5:
+            OP_8xy5(chip8, instr);
+            break;
+        case CHIP8_OP_8xy6:
+            OP_8xy6<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_8xy7:
+            OP_8xy7(chip8, instr);
+            break;
+        case CHIP8_OP_8xyE:
+            OP_8xyE<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_9xy0:
+            OP_9xy0(chip8, instr);
+            break;
+        case CHIP8_OP_Annn:
+            OP_Annn(chip8, instr);
+            break;
+        case CHIP8_OP_Bnnn:
+            OP_Bnnn<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_Cxkk:
+            OP_Cxkk(chip8, instr);
+            break;
+        case CHIP8_OP_Dxyn:
+            OP_Dxyn<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_Ex9E:
+            OP_Ex9E(chip8, instr);
+            break;
+        case CHIP8_OP_ExA1:
+            OP_ExA1(chip8, instr);
+            break;
+        case CHIP8_OP_Fx07:
+            OP_Fx07(chip8, instr);
+            break;
+        case CHIP8_OP_Fx0A:
+            OP_Fx0A(chip8, instr);
+            break;
+        case CHIP8_OP_Fx15:
+            OP_Fx15(chip8, instr);
+            break;
+        case CHIP8_OP_Fx18:
+            OP_Fx18(chip8, instr);
+            break;
+        case CHIP8_OP_Fx1E:
+            OP_Fx1E(chip8, instr);
+            break;
+        case CHIP8_OP_Fx29:
+            OP_Fx29(chip8, instr);
+            break;
+        case CHIP8_OP_Fx33:
+            OP_Fx33(chip8, instr);
+            break;
+        case CHIP8_OP_Fx55:
+            OP_Fx55<Q>(chip8, instr);
+            break;
+        case CHIP8_OP_Fx65:
+            OP_Fx65<Q>(chip8, instr);
+            break;
+        default:
+            break;
     }
+}
 
-    // Decrement the sound timer if it's been set
-    if (chip8->sound_timer > 0)
+template <typename Q>
+CHIP8_FORCE_INLINE void chip8_execute_table(CHIP8* chip8)
+{
+    // the switch only needs the op id, leave the handler out of the decode
+    CHIP8_INSTR instr = chip8_decode_operands(chip8->opcode);
+    instr.op = chip8_lookup_op(chip8->opcode);
+    chip8_execute_instr<Q>(chip8, &instr);
+}
+
+
+/*** DECODE CACHE ***/
+// Every address in memory has a pre-decoded record (handler plus operands), built when the rom is loaded,
+// so running an instruction is a single load from the cache instead of fetch, rebuild opcode and decode.
+// There is one record per byte address since jumps can land on odd addresses.
+// Fx33 and Fx55 are the only instructions that write memory, they re-decode the records they overwrite
+// so self modifying roms still run correctly.
+
+inline void chip8_decode_at(CHIP8* chip8, unsigned int address)
+{
+    address &= 0x0FFFu;
+    uint16_t opcode = (chip8->memory[address] << 8u) | chip8->memory[(address + 1) & 0x0FFFu];
+    chip8->decoded[address] = chip8_decode(opcode, chip8->quirks);
+}
+
+inline void chip8_decode_cache_build(CHIP8* chip8)
+{
+    for (unsigned int address = 0; address < DECODE_CACHE_SIZE; address++)
+    {
+        chip8_decode_at(chip8, address);
+    }
+}
+
+inline void chip8_code_written(CHIP8* chip8, unsigned int address, unsigned int length)
+{
+    if (!chip8->decoded)
+    {
+        return;
+    }
+
+    // the instruction starting one byte before the write also reads the first written byte
+    for (unsigned int i = 0; i <= length; i++)
+    {
+        chip8_decode_at(chip8, address - 1 + i);
+    }
+
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->invalidate(chip8, address, length);
+    }
+}
+
+
+/*** CYCLE ***/
+
+enum CHIP8_DISPATCH
+{
+    CHIP8_DISPATCH_SWITCH, // nested switch on the opcode groups
+    CHIP8_DISPATCH_TABLE, // one lookup in chip8_dispatch_table
+    CHIP8_DISPATCH_CACHED, // pre-decoded records from the decode cache
+};
+
+// one instruction with the quirks fixed at compile time, the run loops pick Q once per call
+template <typename Q>
+CHIP8_FORCE_INLINE void chip8_cycle_quirks(CHIP8* chip8)
+{
+    chip8_fetch(chip8);
+    chip8_execute_switch<Q>(chip8);
+}
+
+template <typename Q>
+CHIP8_FORCE_INLINE void chip8_cycle_table_quirks(CHIP8* chip8)
+{
+    chip8_fetch(chip8);
+    chip8_execute_table<Q>(chip8);
+}
+
+// one instruction, the timers are ticked by the frame scheduler (FRAMES)
+inline void chip8_cycle(CHIP8* chip8)
+{
+    chip8_with_quirks(chip8->quirks, [&]<typename Q>() { chip8_cycle_quirks<Q>(chip8); });
+}
+
+inline void chip8_cycle_table(CHIP8* chip8)
+{
+    chip8_with_quirks(chip8->quirks, [&]<typename Q>() { chip8_cycle_table_quirks<Q>(chip8); });
+}
+
+inline void chip8_cycle_cached(CHIP8* chip8)
+{
+    const CHIP8_INSTR* instr = &chip8->decoded[chip8->pc & 0x0FFFu];
+    chip8_trace<CHIP8_TRACE_INSTRUCTIONS>(CHIP8_TRACE_INSTR, chip8->pc, instr->opcode, chip8->index, chip8->sp);
+    chip8->pc += 2;
+
+    // calling through the record's handler measured faster than switching on its op id here
+    instr->handler(chip8, instr);
+}
+
+inline void chip8_cycle(CHIP8* chip8, CHIP8_DISPATCH dispatch)
+{
+    if (dispatch == CHIP8_DISPATCH_TABLE)
+    {
+        chip8_cycle_table(chip8);
+    }
+    else if (dispatch == CHIP8_DISPATCH_CACHED)
+    {
+        chip8_cycle_cached(chip8);
+    }
+    else
+    {
+        chip8_cycle(chip8);
+    }
+}
+
+
+/*** RUN ***/
+// Runs many instructions per call in a tight loop instead of one chip8_cycle at a time,
+// stopping early when a handler raises one of the events the caller asked for.
+
+enum CHIP8_EXIT
+{
+    CHIP8_EXIT_BUDGET, // ran all max_cycles instructions
+    CHIP8_EXIT_DRAW,
+    CHIP8_EXIT_WAIT_KEY,
+    CHIP8_EXIT_SOUND,
+    CHIP8_EXIT_UNKNOWN_OPCODE,
+};
+
+typedef struct CHIP8_RUN_RESULT
+{
+    CHIP8_EXIT exit;
+    uint64_t cycles; // instructions run, including the one that raised the event
+    uint8_t events; // every CHIP8_EVENT raised during the run, not only the stopping one
+} CHIP8_RUN_RESULT;
+
+inline CHIP8_EXIT chip8_exit_for(uint8_t events)
+{
+    // most urgent first
+    if (events & CHIP8_EVENT_UNKNOWN_OPCODE) return CHIP8_EXIT_UNKNOWN_OPCODE;
+    if (events & CHIP8_EVENT_WAIT_KEY) return CHIP8_EXIT_WAIT_KEY;
+    if (events & CHIP8_EVENT_SOUND) return CHIP8_EXIT_SOUND;
+    if (events & CHIP8_EVENT_DRAW) return CHIP8_EXIT_DRAW;
+    return CHIP8_EXIT_BUDGET;
+}
+
+/*** IDLE LOOPS ***/
+// Lots of ROMs wait with a short backward loop, Fx07/3xkk/1nnn polling the delay timer or a 1nnn jumping to
+// itself. If the loop only reads registers, the delay timer and the keys and only writes registers, nothing it
+// reads can change before the next timer tick or key change, and neither happens inside one chip8_run_until.
+// So once one pass comes back to the jump with the registers it started with every later pass will too,
+// and whole passes can be counted instead of run.
+
+#define CHIP8_IDLE_MAX_LENGTH 8 // longest loop body in instructions worth checking
+
+// Walks one pass of the loop closed by the 1nnn at jump_pc on a copy of the registers.
+// Returns the instructions in a pass (jump included) when it's an idle loop, 0 when it isn't
+inline uint32_t chip8_idle_loop_length(const CHIP8* chip8, uint16_t jump_pc, uint16_t target)
+{
+    if (target > jump_pc || jump_pc - target > 2 * CHIP8_IDLE_MAX_LENGTH)
+        return 0;
+
+    uint8_t V[16];
+    memcpy(V, chip8->registers, sizeof(V));
+    uint16_t index = chip8->index;
+    uint8_t delay = chip8_delay_timer(chip8);
+
+    uint32_t length = 1;
+    uint16_t pc = target;
+    // everything allowed in here moves forward, so the pass either gets back to the jump or leaves the loop
+    while (pc < jump_pc)
+    {
+        const CHIP8_INSTR* instr = &chip8->decoded[pc];
+        pc += 2;
+        length++;
+
+        switch (instr->op)
+        {
+            case CHIP8_OP_3xkk: if (V[instr->x] == instr->kk) pc += 2; break;
+            case CHIP8_OP_4xkk: if (V[instr->x] != instr->kk) pc += 2; break;
+            case CHIP8_OP_5xy0: if (V[instr->x] == V[instr->y]) pc += 2; break;
+            case CHIP8_OP_9xy0: if (V[instr->x] != V[instr->y]) pc += 2; break;
+            case CHIP8_OP_6xkk: V[instr->x] = instr->kk; break;
+            case CHIP8_OP_8xy0: V[instr->x] = V[instr->y]; break;
+            case CHIP8_OP_Annn: index = instr->nnn; break;
+            case CHIP8_OP_Fx07: V[instr->x] = delay; break;
+            case CHIP8_OP_Ex9E:
+                if (V[instr->x] > 0xF) return 0;
+                if (chip8->keypad[V[instr->x]]) pc += 2;
+                break;
+            case CHIP8_OP_ExA1:
+                if (V[instr->x] > 0xF) return 0;
+                if (!chip8->keypad[V[instr->x]]) pc += 2;
+                break;
+            default: return 0;
+        }
+    }
+
+    if (pc != jump_pc || index != chip8->index || memcmp(V, chip8->registers, sizeof(V)) != 0)
+        return 0;
+    return length;
+}
+
+// Called with pc on a backward 1nnn, skips as many whole passes of an idle loop as fit in budget and returns
+// how many instructions that was. The state afterwards is exactly what running them would have left
+inline uint64_t chip8_idle_skip(CHIP8* chip8, uint64_t budget)
+{
+    const CHIP8_INSTR* jump = &chip8->decoded[chip8->pc & 0x0FFFu];
+    uint32_t length = chip8_idle_loop_length(chip8, chip8->pc & 0x0FFFu, jump->nnn);
+    if (length == 0)
+        return 0;
+
+    uint64_t skipped = budget / length * length;
+    chip8->idle_skipped += skipped;
+    return skipped;
+}
+
+// True while the program sits on Fx0A, the host can sleep until the next key event
+inline bool chip8_waiting_for_key(const CHIP8* chip8)
+{
+    return chip8->waiting_key;
+}
+
+// True when running Fx0A again with the current keys would change nothing, so any number of
+// cycles can pass without running them
+inline bool chip8_key_wait_blocked(const CHIP8* chip8)
+{
+    if (!chip8->waiting_key)
+        return false;
+
+    if (chip8->wait_key != CHIP8_NO_KEY)
+        return chip8->keypad[chip8->wait_key] != 0;
+
+    for (int key = 0; key < 16; key++)
+    {
+        if (chip8->keypad[key])
+            return false;
+    }
+    return true;
+}
+
+// Runs up to max_cycles instructions, returns after the first one that raises an event in stop_events
+// (0 runs the whole budget and just collects the events)
+inline CHIP8_RUN_RESULT chip8_run_until(CHIP8* chip8, uint64_t max_cycles, uint8_t stop_events)
+{
+    chip8->events = 0;
+
+    for (uint64_t cycles = 0; cycles < max_cycles; )
+    {
+        const CHIP8_INSTR* instr = &chip8->decoded[chip8->pc & 0x0FFFu];
+        if (instr->op == CHIP8_OP_1nnn && instr->nnn <= (chip8->pc & 0x0FFFu))
+        {
+            cycles += chip8_idle_skip(chip8, max_cycles - cycles);
+            if (cycles == max_cycles)
+                break;
+        }
+
+        chip8_cycle_cached(chip8);
+        cycles++;
+
+        if (chip8->events & (stop_events | CHIP8_EVENT_WAIT_KEY))
+        {
+            if (chip8->events & stop_events)
+            {
+                return {chip8_exit_for(chip8->events & stop_events), cycles, chip8->events};
+            }
+
+            // halted on Fx0A and the keys can't change before this returns, the rest of the budget does nothing
+            chip8->idle_skipped += max_cycles - cycles;
+            break;
+        }
+    }
+
+    return {CHIP8_EXIT_BUDGET, max_cycles, chip8->events};
+}
+
+// Runs up to max_cycles instructions, stopping at the first event of any kind
+inline CHIP8_RUN_RESULT chip8_run(CHIP8* chip8, uint64_t max_cycles)
+{
+    return chip8_run_until(chip8, max_cycles, CHIP8_EVENT_ALL);
+}
+
+
+/*** FRAMES ***/
+// The CPU and the timers run on separate clocks. A frame runs instructions_per_frame instructions and then ticks
+// the delay and sound timers once, and the frontend runs 60 frames a second, so raising instructions_per_frame
+// speeds the CPU up (fast forward, benchmarks) without changing how fast the timers count down.
+
+#define CHIP8_FRAME_RATE 60
+#define CHIP8_DEFAULT_IPF 11 // ~660 instructions a second
+
+// runs exactly max_cycles instructions and returns how many ran (chip8_run_blocks, chip8_run_jit, chip8_run_aot...)
+typedef uint64_t (*chip8_engine_fn)(CHIP8* chip8, uint64_t max_cycles);
+
+inline uint64_t chip8_run_switch(CHIP8* chip8, uint64_t max_cycles)
+{
+    return chip8_with_quirks(chip8->quirks, [&]<typename Q>()
+    {
+        for (uint64_t i = 0; i < max_cycles; i++)
+        {
+            chip8_cycle_quirks<Q>(chip8);
+        }
+        return max_cycles;
+    });
+}
+
+inline uint64_t chip8_run_table(CHIP8* chip8, uint64_t max_cycles)
+{
+    return chip8_with_quirks(chip8->quirks, [&]<typename Q>()
+    {
+        for (uint64_t i = 0; i < max_cycles; i++)
+        {
+            chip8_cycle_table_quirks<Q>(chip8);
+        }
+        return max_cycles;
+    });
+}
+
+inline uint64_t chip8_run_cached(CHIP8* chip8, uint64_t max_cycles)
+{
+    for (uint64_t i = 0; i < max_cycles; i++)
+    {
+        chip8_cycle_cached(chip8);
+    }
+    return max_cycles;
+}
+
+typedef struct CHIP8_FRAME_CONFIG
+{
+    uint32_t instructions_per_frame;
+    // display wait quirk: like on the COSMAC VIP a draw waits for the vertical blank, so 00E0/Dxyn end the frame.
+    // Only the interpreter loop can stop halfway through a budget, so this ignores engine
+    bool vblank_wait;
+    chip8_engine_fn engine; // NULL runs chip8_run_until
+} CHIP8_FRAME_CONFIG;
+
+inline CHIP8_FRAME_CONFIG chip8_frame_config_default()
+{
+    return {CHIP8_DEFAULT_IPF, false, NULL};
+}
+
+// The next cycles instructions of a frame without the timer tick. With the display wait quirk a draw stops it early
+// (exit CHIP8_EXIT_DRAW), the rest of the frame is then skipped
+inline CHIP8_RUN_RESULT chip8_run_frame_part(CHIP8* chip8, const CHIP8_FRAME_CONFIG* config, uint64_t cycles)
+{
+    if (chip8_key_wait_blocked(chip8))
+    {
+        // still halted on Fx0A, whatever the engine the frame's instructions would all be the same no-op
+        chip8->events = CHIP8_EVENT_WAIT_KEY;
+        chip8->idle_skipped += cycles;
+        return {CHIP8_EXIT_BUDGET, cycles, chip8->events};
+    }
+    if (config->engine && !config->vblank_wait)
+    {
+        chip8->events = 0;
+        uint64_t ran = config->engine(chip8, cycles);
+        return {CHIP8_EXIT_BUDGET, ran, chip8->events};
+    }
+    return chip8_run_until(chip8, cycles, config->vblank_wait ? CHIP8_EVENT_DRAW : 0);
+}
+
+// One 60hz frame: the instructions, then exactly one timer tick
+inline CHIP8_RUN_RESULT chip8_run_frame(CHIP8* chip8, const CHIP8_FRAME_CONFIG* config)
+{
+    CHIP8_RUN_RESULT result = chip8_run_frame_part(chip8, config, config->instructions_per_frame);
+    chip8_update_timers(chip8);
+    return result;
+}
+
+#define CHIP8_FRAME_KEYS_MAX 32
+
+typedef struct CHIP8_KEY_CHANGE
+{
+    uint32_t cycle; // instruction of the frame it applies before, 0 is the start of the frame
+    uint16_t keys; // the whole keypad after the change, bit n is key n
+} CHIP8_KEY_CHANGE;
+
+// keypad changes that land inside one frame, in cycle order (chip8_input.h, chip8_replay.h)
+typedef struct CHIP8_FRAME_KEYS
+{
+    uint32_t count;
+    CHIP8_KEY_CHANGE changes[CHIP8_FRAME_KEYS_MAX];
+} CHIP8_FRAME_KEYS;
+
+// One frame with the keypad changing partway through: the instructions run in pieces with each change applied at
+// its cycle, so a key that goes down and up within a frame is still seen by the instructions in between.
+// If the display wait quirk ends the frame early the changes still to come are applied at the end
+inline CHIP8_RUN_RESULT chip8_run_frame_keys(CHIP8* chip8, const CHIP8_FRAME_CONFIG* config, const CHIP8_FRAME_KEYS* keys)
+{
+    CHIP8_RUN_RESULT result = {CHIP8_EXIT_BUDGET, 0, 0};
+    uint32_t frame_cycles = config->instructions_per_frame;
+    uint32_t done = 0;
+    uint32_t next = 0;
+
+    while (true)
+    {
+        while (next < keys->count && keys->changes[next].cycle <= done)
+        {
+            chip8_set_keypad_mask(chip8, keys->changes[next].keys);
+            next++;
+        }
+        if (done >= frame_cycles)
+        {
+            break;
+        }
+
+        uint32_t until = next < keys->count && keys->changes[next].cycle < frame_cycles ? keys->changes[next].cycle : frame_cycles;
+        CHIP8_RUN_RESULT part = chip8_run_frame_part(chip8, config, until - done);
+        result.cycles += part.cycles;
+        result.events |= part.events;
+        if (part.exit != CHIP8_EXIT_BUDGET)
+        {
+            result.exit = part.exit;
+            break;
+        }
+        done = until;
+    }
+
+    for (; next < keys->count; next++)
+    {
+        chip8_set_keypad_mask(chip8, keys->changes[next].keys);
+    }
+    chip8->events = result.events;
+    chip8_update_timers(chip8);
+    return result;
+}
+
+// Runs frames until at least max_cycles instructions ran, returns the instructions run
+inline uint64_t chip8_run_frames(CHIP8* chip8, const CHIP8_FRAME_CONFIG* config, uint64_t max_cycles)
+{
+    uint64_t cycles = 0;
+    while (cycles < max_cycles && config->instructions_per_frame > 0)
     {
-        //TODO: testing for now, replace with audio
-        if (chip8->sound_timer == 1)
-            printf("BEEP!\n");
-        --chip8->sound_timer;
+        cycles += chip8_run_frame(chip8, config).cycles;
     }
+    return cycles;
 }
 
 
@@ -0,0 +1,169 @@
+﻿#ifndef CHIP8_AOT_H
+#define CHIP8_AOT_H
+
+#include "chip8.h"
+
+
+/*** AHEAD OF TIME RECOMPILED ROMS ***/
+/*
+ chip8_recompile walks a rom's control flow from 0x200 and writes a C++ file with one case per basic block,
+ each block calling the OP_* handlers with constant operands so the compiler can inline and fold everything.
+ The generated file registers itself here, chip8_aot_find picks the program matching the loaded rom.
+ Anything the recompiler couldn't reach (Bnnn targets outside a jump table, returns to odd places...) falls back
+ to the interpreter one instruction at a time, and so does the whole rom while it has its own code written over.
+ Once every recompiled byte holds the rom again (a pool reset, a restored state, a rom that puts its code back)
+ the recompiled code runs again.
+
+ USAGE:
+    const CHIP8_AOT_PROGRAM* program = chip8_aot_find(rom, rom_size);
+    chip8_aot_attach(chip8, program);
+    chip8_run_aot(chip8, cycles);
+ */
+
+typedef struct CHIP8_AOT_PROGRAM CHIP8_AOT_PROGRAM;
+
+struct CHIP8_AOT_PROGRAM
+{
+    const char* name;
+    const uint8_t* rom;
+    unsigned int rom_size;
+    const uint8_t* covered; // one bit per memory byte that is part of recompiled code
+    uint8_t quirks; // CHIP8_QUIRK_PROFILE the code was generated for
+    // runs blocks until the pc is unknown, the budget is too small for the next block or *stop is set
+    uint64_t (*run)(CHIP8* chip8, uint64_t max_cycles, const bool* stop);
+    CHIP8_AOT_PROGRAM* next;
+};
+
+typedef struct CHIP8_AOT
+{
+    CHIP8_CODE_CACHE header;
+
+    const CHIP8_AOT_PROGRAM* program;
+    uint8_t differs[4096 / 8]; // one bit per recompiled byte that doesn't hold the rom right now
+    uint32_t differs_count;
+    bool modified; // differs_count > 0, recompiled code is written over and only the interpreter is correct
+} CHIP8_AOT;
+
+inline CHIP8_AOT_PROGRAM* chip8_aot_programs = NULL;
+
+// called by the generated files during static initialization
+inline bool chip8_aot_register(CHIP8_AOT_PROGRAM* program)
+{
+    program->next = chip8_aot_programs;
+    chip8_aot_programs = program;
+    return true;
+}
+
+inline const CHIP8_AOT_PROGRAM* chip8_aot_find(const uint8_t* rom, unsigned int rom_size)
+{
+    for (const CHIP8_AOT_PROGRAM* program = chip8_aot_programs; program; program = program->next)
+    {
+        if (program->rom_size == rom_size && memcmp(program->rom, rom, rom_size) == 0)
+        {
+            return program;
+        }
+    }
+    return NULL;
+}
+
+// what the rom image (chip8_init plus chip8_load_rom_memory) has at address
+inline uint8_t chip8_aot_rom_byte(const CHIP8_AOT_PROGRAM* program, unsigned int address)
+{
+    if (address >= START_ADDRESS && address - START_ADDRESS < program->rom_size)
+    {
+        return program->rom[address - START_ADDRESS];
+    }
+    if (address >= FONTSET_START_ADDRESS && address - FONTSET_START_ADDRESS < FONTSET_SIZE)
+    {
+        return fontset[address - FONTSET_START_ADDRESS];
+    }
+    return 0;
+}
+
+// rechecks the recompiled bytes in the range against the rom, so code that is written back turns the recompiled code on again
+inline void chip8_aot_invalidate(CHIP8* chip8, unsigned int address, unsigned int length)
+{
+    CHIP8_AOT* aot = (CHIP8_AOT*) chip8->code_cache;
+
+    for (unsigned int i = 0; i < length && i < sizeof(chip8->memory); i++)
+    {
+        unsigned int byte = (address + i) & 0x0FFFu;
+        uint8_t bit = (uint8_t) (1u << (byte & 7u));
+        if (!(aot->program->covered[byte >> 3] & bit))
+        {
+            continue;
+        }
+
+        bool differs = chip8->memory[byte] != chip8_aot_rom_byte(aot->program, byte);
+        if (differs != ((aot->differs[byte >> 3] & bit) != 0))
+        {
+            aot->differs[byte >> 3] ^= bit;
+            if (differs)
+            {
+                aot->differs_count++;
+            }
+            else
+            {
+                aot->differs_count--;
+            }
+        }
+    }
+    aot->modified = aot->differs_count > 0;
+}
+
+inline void chip8_aot_destroy(CHIP8* chip8)
+{
+    free(chip8->code_cache);
+    chip8->code_cache = NULL;
+}
+
+// Attach after the rom is loaded, returns NULL if memory doesn't hold the rom the program was made from
+// or the machine runs a different quirks profile than the one the code was generated for, or on allocation failure
+inline CHIP8_AOT* chip8_aot_attach(CHIP8* chip8, const CHIP8_AOT_PROGRAM* program)
+{
+    if (!program || program->quirks != chip8->quirks || START_ADDRESS + program->rom_size > sizeof(chip8->memory) ||
+        memcmp(&chip8->memory[START_ADDRESS], program->rom, program->rom_size) != 0)
+    {
+        return NULL;
+    }
+
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->destroy(chip8);
+    }
+
+    CHIP8_AOT* aot = (CHIP8_AOT*) calloc(1, sizeof(CHIP8_AOT));
+    if (!aot)
+    {
+        return NULL;
+    }
+    aot->header.invalidate = chip8_aot_invalidate;
+    aot->header.destroy = chip8_aot_destroy;
+    aot->program = program;
+
+    chip8->code_cache = &aot->header;
+    return aot;
+}
+
+// Runs exactly max_cycles instructions, needs chip8_aot_attach first. Returns the instructions run.
+inline uint64_t chip8_run_aot(CHIP8* chip8, uint64_t max_cycles)
+{
+    CHIP8_AOT* aot = (CHIP8_AOT*) chip8->code_cache;
+    uint64_t executed = 0;
+
+    while (executed < max_cycles)
+    {
+        executed += aot->program->run(chip8, max_cycles - executed, &aot->modified);
+        if (executed < max_cycles)
+        {
+            // the recompiled code doesn't know this pc (or the next block doesn't fit), step over it
+            chip8_cycle_cached(chip8);
+            executed++;
+        }
+    }
+
+    return executed;
+}
+
+
+#endif //CHIP8_AOT_H
@@ -0,0 +1,389 @@
+﻿#ifndef CHIP8_AUDIO_H
+#define CHIP8_AUDIO_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "chip8.h"
+
+
+/*** AUDIO ***/
+/*
+ The sound timer as an actual tone. After every emulated frame the emulation writes that frame's worth of samples
+ (sample_rate / 60) into a lock free single producer, single consumer ring: a square wave while the sound timer is
+ running, silence otherwise. The audio device takes samples out of the ring from its own callback (chip8_audio_pull).
+ Neither side ever waits for the other or allocates: a full ring drops the new samples (overrun), an empty ring plays
+ silence (underrun), both are counted. The ring is allocated once, sized by CHIP8_AUDIO_CONFIG::buffer_samples, and
+ the time a sample spends in it is the latency, reported by chip8_audio_print_stats.
+ The square wave is made 8 samples at a time with SSE2 (a 32 bit phase accumulator per lane, the top bit picks the
+ half of the wave), written straight into the ring.
+
+ Backends (CHIP8_AUDIO_OUTPUT): a device thread that pulls period samples every period in real time and throws them
+ away (null) or writes them to a WAV file, or with realtime off everything is pulled after each frame (headless runs
+ at full speed). A sound card backend calls chip8_audio_pull from its callback in the same way.
+
+ USAGE:
+    CHIP8_AUDIO audio;
+    chip8_audio_init(&audio, chip8_audio_config_default());
+    CHIP8_AUDIO_OUTPUT output;
+    chip8_audio_output_open(&output, &audio, "beeps.wav", true);
+    ... emulation thread, for each frame ...
+    bool sound = chip8_sound_playing(chip8);
+    sound |= (chip8_run_frame(chip8, &frame_config).events & CHIP8_EVENT_SOUND) != 0; // Fx18 started it this frame
+    chip8_audio_frame(&audio, sound);
+    ... at the end ...
+    chip8_audio_output_close(&output);
+    chip8_audio_print_stats(&audio);
+    chip8_audio_free(&audio);
+ */
+
+typedef struct CHIP8_AUDIO_CONFIG
+{
+    uint32_t sample_rate;
+    uint32_t buffer_samples; // ring size, rounded up to a power of two. Bigger rides out longer stalls but adds latency
+    uint32_t period_samples; // what the device takes per callback
+    uint32_t tone_hz;
+    int16_t volume; // square wave amplitude
+} CHIP8_AUDIO_CONFIG;
+
+inline CHIP8_AUDIO_CONFIG chip8_audio_config_default()
+{
+    // 2048 samples is ~43ms at 48khz, room for two and a half 60hz frames
+    return {48000, 2048, 256, 440, 6000};
+}
+
+typedef struct CHIP8_AUDIO
+{
+    CHIP8_AUDIO_CONFIG config;
+    int16_t* ring;
+    uint32_t mask; // ring size - 1
+
+    // producer side
+    alignas(CHIP8_CACHE_LINE) std::atomic<uint32_t> head; // next sample to write, only the producer stores it
+    uint32_t phase; // square wave position, carries over between frames so the tone doesn't click
+    uint32_t phase_step;
+    uint32_t frame_remainder; // sample_rate % 60 builds up here, a frame gets one extra sample when it wraps
+    uint64_t frames;
+    uint64_t written;
+    uint64_t dropped;
+    std::atomic<bool> idle; // the producer stopped on purpose (chip8_audio_idle), running dry isn't an underrun
+
+    // consumer side
+    alignas(CHIP8_CACHE_LINE) std::atomic<uint32_t> tail; // next sample to read, only the consumer stores it
+    bool started; // an empty ring before the first samples arrive isn't an underrun
+    uint64_t pulls;
+    uint64_t played;
+    uint64_t underruns;
+    uint64_t silence;
+    uint64_t queued_total;
+    uint32_t queued_max;
+} CHIP8_AUDIO;
+
+// count samples of square wave (or silence with volume 0) starting at phase, returns the phase after them
+inline uint32_t chip8_audio_square(int16_t* out, uint32_t count, uint32_t phase, uint32_t step, int16_t volume)
+{
+    if (volume == 0)
+    {
+        memset(out, 0, count * sizeof(int16_t));
+        return phase + count * step;
+    }
+
+    uint32_t i = 0;
+#if CHIP8_SSE2
+    // lanes 0-3 and 4-7 hold the phases of 8 samples in a row, the arithmetic shift of the top bit gives 0 for the
+    // first half of the wave and -1 for the second, (volume ^ mask) - mask turns that into +volume or -volume
+    const __m128i amplitude = _mm_set1_epi32(volume);
+    const __m128i advance = _mm_set1_epi32((int) (step * 8));
+    __m128i low = _mm_setr_epi32((int) phase, (int) (phase + step), (int) (phase + step * 2), (int) (phase + step * 3));
+    __m128i high = _mm_add_epi32(low, _mm_set1_epi32((int) (step * 4)));
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i low_mask = _mm_srai_epi32(low, 31);
+        __m128i high_mask = _mm_srai_epi32(high, 31);
+        __m128i low_samples = _mm_sub_epi32(_mm_xor_si128(amplitude, low_mask), low_mask);
+        __m128i high_samples = _mm_sub_epi32(_mm_xor_si128(amplitude, high_mask), high_mask);
+        _mm_storeu_si128((__m128i*) &out[i], _mm_packs_epi32(low_samples, high_samples));
+        low = _mm_add_epi32(low, advance);
+        high = _mm_add_epi32(high, advance);
+    }
+    phase += i * step;
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = (phase & 0x80000000u) ? (int16_t) -volume : volume;
+        phase += step;
+    }
+    return phase;
+}
+
+inline bool chip8_audio_init(CHIP8_AUDIO* audio, CHIP8_AUDIO_CONFIG config)
+{
+    uint32_t size = std::bit_ceil(config.buffer_samples > config.period_samples ? config.buffer_samples : config.period_samples);
+    audio->config = config;
+    audio->config.buffer_samples = size;
+    audio->ring = (int16_t*) chip8_aligned_alloc(size * sizeof(int16_t));
+    if (!audio->ring)
+    {
+        return false;
+    }
+    audio->mask = size - 1;
+
+    audio->head.store(0, std::memory_order_relaxed);
+    audio->phase = 0;
+    audio->phase_step = (uint32_t) (((uint64_t) config.tone_hz << 32) / config.sample_rate);
+    audio->frame_remainder = 0;
+    audio->frames = 0;
+    audio->written = 0;
+    audio->dropped = 0;
+    audio->idle.store(false, std::memory_order_relaxed);
+
+    audio->tail.store(0, std::memory_order_relaxed);
+    audio->started = false;
+    audio->pulls = 0;
+    audio->played = 0;
+    audio->underruns = 0;
+    audio->silence = 0;
+    audio->queued_total = 0;
+    audio->queued_max = 0;
+    return true;
+}
+
+inline void chip8_audio_free(CHIP8_AUDIO* audio)
+{
+    chip8_aligned_free(audio->ring);
+    audio->ring = NULL;
+}
+
+// producer only, one emulated frame of samples, the tone if sound is on
+inline void chip8_audio_frame(CHIP8_AUDIO* audio, bool sound)
+{
+    uint32_t count = audio->config.sample_rate / CHIP8_FRAME_RATE;
+    audio->frame_remainder += audio->config.sample_rate % CHIP8_FRAME_RATE;
+    if (audio->frame_remainder >= CHIP8_FRAME_RATE)
+    {
+        audio->frame_remainder -= CHIP8_FRAME_RATE;
+        count++;
+    }
+    audio->frames++;
+    audio->idle.store(false, std::memory_order_relaxed);
+
+    uint32_t head = audio->head.load(std::memory_order_relaxed);
+    uint32_t space = audio->mask + 1 - (head - audio->tail.load(std::memory_order_acquire));
+    if (count > space)
+    {
+        audio->dropped += count - space;
+        count = space;
+    }
+
+    // the free space can wrap around the end of the ring, then it's two pieces
+    int16_t volume = sound ? audio->config.volume : 0;
+    uint32_t start = head & audio->mask;
+    uint32_t first = count < audio->mask + 1 - start ? count : audio->mask + 1 - start;
+    audio->phase = chip8_audio_square(&audio->ring[start], first, audio->phase, audio->phase_step, volume);
+    audio->phase = chip8_audio_square(&audio->ring[0], count - first, audio->phase, audio->phase_step, volume);
+
+    audio->written += count;
+    audio->head.store(head + count, std::memory_order_release);
+}
+
+// producer only, no frames are coming for a while (the machine is halted with the sound off), until the next chip8_audio_frame
+inline void chip8_audio_idle(CHIP8_AUDIO* audio)
+{
+    audio->idle.store(true, std::memory_order_relaxed);
+}
+
+// consumer only, the audio callback: fills out with count samples, silence for whatever the ring doesn't have
+inline void chip8_audio_pull(CHIP8_AUDIO* audio, int16_t* out, uint32_t count)
+{
+    uint32_t tail = audio->tail.load(std::memory_order_relaxed);
+    uint32_t queued = audio->head.load(std::memory_order_acquire) - tail;
+    uint32_t take = queued < count ? queued : count;
+
+    uint32_t start = tail & audio->mask;
+    uint32_t first = take < audio->mask + 1 - start ? take : audio->mask + 1 - start;
+    memcpy(out, &audio->ring[start], first * sizeof(int16_t));
+    memcpy(out + first, &audio->ring[0], (take - first) * sizeof(int16_t));
+    memset(out + take, 0, (count - take) * sizeof(int16_t));
+    audio->tail.store(tail + take, std::memory_order_release);
+
+    audio->started |= take > 0;
+    audio->pulls++;
+    audio->played += take;
+    if (take < count && audio->started && !audio->idle.load(std::memory_order_relaxed))
+    {
+        audio->underruns++;
+        audio->silence += count - take;
+    }
+    audio->queued_total += queued;
+    audio->queued_max = queued > audio->queued_max ? queued : audio->queued_max;
+}
+
+// producer only, the samples waiting to be pulled
+inline uint32_t chip8_audio_queued(const CHIP8_AUDIO* audio)
+{
+    return audio->head.load(std::memory_order_relaxed) - audio->tail.load(std::memory_order_acquire);
+}
+
+// call with both sides stopped
+inline void chip8_audio_print_stats(const CHIP8_AUDIO* audio)
+{
+    if (audio->frames == 0)
+    {
+        return;
+    }
+
+    const CHIP8_AUDIO_CONFIG* config = &audio->config;
+    double ms_per_sample = 1000.0 / config->sample_rate;
+    double queued_mean = audio->pulls > 0 ? (double) audio->queued_total / audio->pulls : 0.0;
+    printf("audio:        %u hz, %u sample ring (%.1f ms), %u sample period, %llu frames\n", config->sample_rate,
+           config->buffer_samples, config->buffer_samples * ms_per_sample, config->period_samples, (unsigned long long) audio->frames);
+    printf("audio out:    %llu samples written, %llu dropped, %llu played, %llu underruns (%llu samples of silence)\n",
+           (unsigned long long) audio->written, (unsigned long long) audio->dropped, (unsigned long long) audio->played,
+           (unsigned long long) audio->underruns, (unsigned long long) audio->silence);
+    // a sample waits behind what's queued, then plays out over a period
+    printf("audio delay:  %.1f ms mean, %.1f ms max (queued samples + one period)\n",
+           (queued_mean + config->period_samples) * ms_per_sample, (audio->queued_max + config->period_samples) * ms_per_sample);
+}
+
+
+/*** AUDIO BACKENDS ***/
+
+typedef struct CHIP8_AUDIO_OUTPUT
+{
+    CHIP8_AUDIO* audio;
+    FILE* wav; // NULL for the null backend
+    uint32_t wav_samples;
+    bool realtime;
+    int16_t* period; // the device's buffer, one period
+    std::thread device;
+    std::atomic<bool> running;
+} CHIP8_AUDIO_OUTPUT;
+
+inline void chip8_wav_put(FILE* file, uint32_t value, unsigned int bytes)
+{
+    for (unsigned int i = 0; i < bytes; i++)
+    {
+        fputc((value >> (i * 8)) & 0xFFu, file);
+    }
+}
+
+// 16 bit mono PCM header, the sizes are patched by chip8_audio_output_close
+inline void chip8_wav_header(FILE* file, uint32_t sample_rate, uint32_t samples)
+{
+    fwrite("RIFF", 1, 4, file);
+    chip8_wav_put(file, 36 + samples * 2, 4);
+    fwrite("WAVEfmt ", 1, 8, file);
+    chip8_wav_put(file, 16, 4); // fmt chunk size
+    chip8_wav_put(file, 1, 2); // PCM
+    chip8_wav_put(file, 1, 2); // mono
+    chip8_wav_put(file, sample_rate, 4);
+    chip8_wav_put(file, sample_rate * 2, 4); // bytes a second
+    chip8_wav_put(file, 2, 2); // bytes a sample
+    chip8_wav_put(file, 16, 2); // bits a sample
+    fwrite("data", 1, 4, file);
+    chip8_wav_put(file, samples * 2, 4);
+}
+
+inline void chip8_audio_output_write(CHIP8_AUDIO_OUTPUT* output, const int16_t* samples, uint32_t count)
+{
+    if (output->wav)
+    {
+        // WAV is little endian
+        for (uint32_t i = 0; i < count; i++)
+        {
+            chip8_wav_put(output->wav, (uint16_t) samples[i], 2);
+        }
+        output->wav_samples += count;
+    }
+}
+
+// stands in for a sound card: a period of samples every period, on time
+inline void chip8_audio_device_thread(CHIP8_AUDIO_OUTPUT* output)
+{
+    CHIP8_AUDIO* audio = output->audio;
+    auto period = std::chrono::nanoseconds(1000000000ull * audio->config.period_samples / audio->config.sample_rate);
+    auto deadline = std::chrono::steady_clock::now();
+    while (output->running.load(std::memory_order_acquire))
+    {
+        deadline += period;
+        std::this_thread::sleep_until(deadline);
+        chip8_audio_pull(audio, output->period, audio->config.period_samples);
+        chip8_audio_output_write(output, output->period, audio->config.period_samples);
+    }
+}
+
+// wav_path NULL is the null backend. With realtime a device thread pulls the samples as a sound card would, without
+// it nothing runs on its own and chip8_audio_output_pump takes whatever was made (headless at full speed)
+inline bool chip8_audio_output_open(CHIP8_AUDIO_OUTPUT* output, CHIP8_AUDIO* audio, const char* wav_path, bool realtime)
+{
+    output->audio = audio;
+    output->wav = NULL;
+    output->wav_samples = 0;
+    output->realtime = realtime;
+    output->period = (int16_t*) chip8_aligned_alloc(audio->config.period_samples * sizeof(int16_t));
+    if (!output->period)
+    {
+        return false;
+    }
+
+    if (wav_path)
+    {
+        output->wav = fopen(wav_path, "wb");
+        if (!output->wav)
+        {
+            printf("ERROR CANNOT WRITE WAV FILE %s\n", wav_path);
+            chip8_aligned_free(output->period);
+            return false;
+        }
+        chip8_wav_header(output->wav, audio->config.sample_rate, 0);
+    }
+
+    output->running.store(realtime, std::memory_order_release);
+    if (realtime)
+    {
+        output->device = std::thread(chip8_audio_device_thread, output);
+    }
+    return true;
+}
+
+// without realtime, takes everything queued, call it after chip8_audio_frame
+inline void chip8_audio_output_pump(CHIP8_AUDIO_OUTPUT* output)
+{
+    if (output->realtime)
+    {
+        return;
+    }
+
+    CHIP8_AUDIO* audio = output->audio;
+    uint32_t queued;
+    while ((queued = chip8_audio_queued(audio)) > 0)
+    {
+        uint32_t count = queued < audio->config.period_samples ? queued : audio->config.period_samples;
+        chip8_audio_pull(audio, output->period, count);
+        chip8_audio_output_write(output, output->period, count);
+    }
+}
+
+inline void chip8_audio_output_close(CHIP8_AUDIO_OUTPUT* output)
+{
+    if (output->device.joinable())
+    {
+        output->running.store(false, std::memory_order_release);
+        output->device.join();
+    }
+    chip8_audio_output_pump(output);
+
+    if (output->wav)
+    {
+        fseek(output->wav, 0, SEEK_SET);
+        chip8_wav_header(output->wav, output->audio->config.sample_rate, output->wav_samples);
+        fclose(output->wav);
+        output->wav = NULL;
+    }
+    chip8_aligned_free(output->period);
+    output->period = NULL;
+}
+
+
+#endif //CHIP8_AUDIO_H
@@ -0,0 +1,438 @@
+﻿#ifndef CHIP8_BLOCKS_H
+#define CHIP8_BLOCKS_H
+
+#include "chip8.h"
+
+
+/*** BLOCK ENGINE ***/
+/*
+ Runs the rom one basic block at a time instead of one instruction at a time.
+ A block is a run of instructions that ends at anything that can change the flow of the program
+ (1nnn, 2nnn, 00EE, Bnnn and Fx0A), or at Fx33/Fx55 since those can overwrite code.
+ A skip (3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1) doesn't end the block, a taken skip steps over the next entry instead.
+ Games spend most of their time in 2-3 instruction polling loops (Fx07/3xkk/1nnn, ExA1/1nnn), which this keeps
+ to one block per pass instead of two.
+ Each block is turned into threaded code: a list of pre-decoded instructions where every entry holds the
+ address of the code that runs it, so one instruction jumps straight into the next without going back
+ through a dispatcher. At the end of a block the engine follows a link to the block that ran after it
+ last time, so hot loops only look a block up the first time around.
+ A write into memory that is covered by a block throws every block away, they get rebuilt from the decode cache.
+
+ USAGE:
+    chip8_blocks_attach(chip8);
+    chip8_run_blocks(chip8, cycles);
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BLOCKS_COMPUTED_GOTO 1 // labels as values, direct threading
+#else
+#define BLOCKS_COMPUTED_GOTO 0 // no labels as values (msvc), call each instruction's handler instead
+#endif
+
+#define BLOCK_MAX_LENGTH 64 // instructions
+#define BLOCK_MAX_COUNT 4096
+#define BLOCK_CODE_SIZE 16384 // threaded entries shared by all blocks
+#define BLOCK_END_MARKERS 2 // a taken skip on the last entry steps past the first one
+
+typedef struct CHIP8_THREADED
+{
+    const void* label; // code that runs this instruction, NULL/block_end marks the end of the block
+    CHIP8_INSTR instr;
+} CHIP8_THREADED;
+
+typedef struct CHIP8_BLOCK CHIP8_BLOCK;
+
+struct CHIP8_BLOCK
+{
+    CHIP8_THREADED* code;
+    uint16_t start;
+    uint16_t length; // instructions
+    // the last two blocks that ran after this one, most blocks only ever go to one or two places
+    uint16_t link_pc[2];
+    CHIP8_BLOCK* link[2];
+};
+
+typedef struct CHIP8_BLOCK_CACHE
+{
+    CHIP8_CODE_CACHE header;
+
+    CHIP8_BLOCK* block_at[4096]; // by start address
+    uint8_t covered[4096]; // memory bytes that are part of some block
+    bool flush_pending; // a write hit a block, everything is flushed before the next block runs
+
+    CHIP8_BLOCK blocks[BLOCK_MAX_COUNT];
+    unsigned int block_count;
+    CHIP8_THREADED code[BLOCK_CODE_SIZE];
+    unsigned int code_used;
+
+    //stats
+    uint64_t blocks_built;
+    uint64_t flushes;
+} CHIP8_BLOCK_CACHE;
+
+
+inline bool chip8_block_ends_at(uint8_t op)
+{
+    switch (op)
+    {
+        case CHIP8_OP_00EE:
+        case CHIP8_OP_1nnn:
+        case CHIP8_OP_2nnn:
+        case CHIP8_OP_3xkk:
+        case CHIP8_OP_4xkk:
+        case CHIP8_OP_5xy0:
+        case CHIP8_OP_9xy0:
+        case CHIP8_OP_Bnnn:
+        case CHIP8_OP_Ex9E:
+        case CHIP8_OP_ExA1:
+        case CHIP8_OP_Fx0A:
+        case CHIP8_OP_Fx33:
+        case CHIP8_OP_Fx55:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the skips the block engine runs inside a block, the jit and the recompiler still end their blocks at them
+inline bool chip8_block_skips(uint8_t op)
+{
+    switch (op)
+    {
+        case CHIP8_OP_3xkk:
+        case CHIP8_OP_4xkk:
+        case CHIP8_OP_5xy0:
+        case CHIP8_OP_9xy0:
+        case CHIP8_OP_Ex9E:
+        case CHIP8_OP_ExA1:
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline void chip8_blocks_flush(CHIP8_BLOCK_CACHE* cache)
+{
+    memset(cache->block_at, 0, sizeof(cache->block_at));
+    memset(cache->covered, 0, sizeof(cache->covered));
+    cache->block_count = 0;
+    cache->code_used = 0;
+    cache->flush_pending = false;
+    cache->flushes++;
+}
+
+inline void chip8_blocks_invalidate(CHIP8* chip8, unsigned int address, unsigned int length)
+{
+    CHIP8_BLOCK_CACHE* cache = (CHIP8_BLOCK_CACHE*) chip8->code_cache;
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if (cache->covered[(address + i) & 0x0FFFu])
+        {
+            // the block doing the write may still be running, so only flush once it is done
+            cache->flush_pending = true;
+            return;
+        }
+    }
+}
+
+inline void chip8_blocks_destroy(CHIP8* chip8)
+{
+    free(chip8->code_cache);
+    chip8->code_cache = NULL;
+}
+
+inline CHIP8_BLOCK_CACHE* chip8_blocks_attach(CHIP8* chip8)
+{
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->destroy(chip8);
+    }
+
+    CHIP8_BLOCK_CACHE* cache = (CHIP8_BLOCK_CACHE*) calloc(1, sizeof(CHIP8_BLOCK_CACHE));
+    cache->header.invalidate = chip8_blocks_invalidate;
+    cache->header.destroy = chip8_blocks_destroy;
+
+    chip8->code_cache = &cache->header;
+    return cache;
+}
+
+inline bool chip8_blocks_have_room(const CHIP8_BLOCK_CACHE* cache)
+{
+    return cache->block_count < BLOCK_MAX_COUNT && cache->code_used + BLOCK_MAX_LENGTH + BLOCK_END_MARKERS <= BLOCK_CODE_SIZE;
+}
+
+// labels is the table of instruction code from chip8_run_blocks, NULL when it calls handlers instead.
+// A skip with an entry after it gets labels[CHIP8_OP_COUNT + 1 + op], the code that also steps over that entry
+inline CHIP8_BLOCK* chip8_block_translate(CHIP8* chip8, CHIP8_BLOCK_CACHE* cache, uint16_t pc,
+                                          const void* const* labels)
+{
+    unsigned int address = pc & 0x0FFFu;
+
+    CHIP8_BLOCK* block = &cache->blocks[cache->block_count++];
+    block->code = &cache->code[cache->code_used];
+    block->start = address;
+    block->length = 0;
+    block->link[0] = NULL;
+    block->link[1] = NULL;
+
+    while (block->length < BLOCK_MAX_LENGTH)
+    {
+        const CHIP8_INSTR* instr = &chip8->decoded[address];
+
+        CHIP8_THREADED* entry = &block->code[block->length++];
+        entry->instr = *instr;
+        entry->label = labels ? labels[instr->op] : (const void*) instr->handler;
+
+        cache->covered[address] = 1;
+        cache->covered[(address + 1) & 0x0FFFu] = 1;
+        address = (address + 2) & 0x0FFFu;
+
+        if (chip8_block_skips(instr->op) && block->length < BLOCK_MAX_LENGTH)
+        {
+            // the instruction it may skip is always in the block
+            entry->label = labels ? labels[CHIP8_OP_COUNT + 1 + instr->op] : (const void*) instr->handler;
+            continue;
+        }
+        if (chip8_block_ends_at(instr->op))
+        {
+            break;
+        }
+    }
+
+    // end of block markers
+    for (unsigned int i = 0; i < BLOCK_END_MARKERS; i++)
+    {
+        block->code[block->length + i].label = labels ? labels[CHIP8_OP_COUNT] : NULL;
+    }
+    cache->code_used += block->length + BLOCK_END_MARKERS;
+
+    cache->block_at[block->start] = block;
+    cache->blocks_built++;
+    return block;
+}
+
+// the threaded code jumps straight into each profile's handlers, so the label table (and the blocks built
+// from it) belong to one instantiation. chip8_set_quirks throws the blocks away when the profile changes
+template <typename Q>
+inline uint64_t chip8_run_blocks_quirks(CHIP8* chip8, uint64_t max_cycles)
+{
+    CHIP8_BLOCK_CACHE* cache = (CHIP8_BLOCK_CACHE*) chip8->code_cache;
+
+#if BLOCKS_COMPUTED_GOTO
+    static const void* const labels[] =
+    {
+        &&op_NULL,
+        &&op_00E0,
+        &&op_00EE,
+        &&op_1nnn,
+        &&op_2nnn,
+        &&op_3xkk,
+        &&op_4xkk,
+        &&op_5xy0,
+        &&op_6xkk,
+        &&op_7xkk,
+        &&op_8xy0,
+        &&op_8xy1,
+        &&op_8xy2,
+        &&op_8xy3,
+        &&op_8xy4,
+        &&op_8xy5,
+        &&op_8xy6,
+        &&op_8xy7,
+        &&op_8xyE,
+        &&op_9xy0,
+        &&op_Annn,
+        &&op_Bnnn,
+        &&op_Cxkk,
+        &&op_Dxyn,
+        &&op_Ex9E,
+        &&op_ExA1,
+        &&op_Fx07,
+        &&op_Fx0A,
+        &&op_Fx15,
+        &&op_Fx18,
+        &&op_Fx1E,
+        &&op_Fx29,
+        &&op_Fx33,
+        &&op_Fx55,
+        &&op_Fx65,
+        &&block_end,
+        // the same ops stepping over the next entry when they skip, only the skips are ever used
+        &&op_NULL, &&op_00E0, &&op_00EE, &&op_1nnn, &&op_2nnn,
+        &&skip_3xkk, &&skip_4xkk, &&skip_5xy0,
+        &&op_6xkk, &&op_7xkk, &&op_8xy0, &&op_8xy1, &&op_8xy2, &&op_8xy3, &&op_8xy4, &&op_8xy5, &&op_8xy6, &&op_8xy7,
+        &&op_8xyE, &&skip_9xy0, &&op_Annn, &&op_Bnnn, &&op_Cxkk, &&op_Dxyn, &&skip_Ex9E, &&skip_ExA1,
+        &&op_Fx07, &&op_Fx0A, &&op_Fx15, &&op_Fx18, &&op_Fx1E, &&op_Fx29, &&op_Fx33, &&op_Fx55, &&op_Fx65,
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == 2 * CHIP8_OP_COUNT + 1, "one label per op, the end, one per op again");
+#else
+    const void* const* labels = NULL;
+#endif
+
+    uint64_t executed = 0;
+    CHIP8_BLOCK* previous = NULL;
+
+    while (true)
+    {
+        if (cache->flush_pending)
+        {
+            chip8_blocks_flush(cache);
+            previous = NULL;
+        }
+
+        /*** Find the next block, following the links first ***/
+        uint16_t pc = chip8->pc;
+        CHIP8_BLOCK* block;
+
+        if (previous && previous->link[0] && previous->link_pc[0] == pc)
+        {
+            block = previous->link[0];
+        }
+        else if (previous && previous->link[1] && previous->link_pc[1] == pc)
+        {
+            block = previous->link[1];
+        }
+        else
+        {
+            block = cache->block_at[pc & 0x0FFFu];
+            if (!block)
+            {
+                if (!chip8_blocks_have_room(cache))
+                {
+                    chip8_blocks_flush(cache);
+                    previous = NULL;
+                }
+                block = chip8_block_translate(chip8, cache, pc, labels);
+            }
+
+            if (previous)
+            {
+                previous->link[1] = previous->link[0];
+                previous->link_pc[1] = previous->link_pc[0];
+                previous->link[0] = block;
+                previous->link_pc[0] = pc;
+            }
+        }
+
+        if (max_cycles - executed < block->length)
+        {
+            break;
+        }
+
+        /*** Run the block ***/
+        const CHIP8_THREADED* ip = block->code;
+        uint32_t skipped = 0; // entries a taken skip stepped over
+
+#if BLOCKS_COMPUTED_GOTO
+        goto *ip->label;
+
+#define BLOCK_OP(name)                          \
+        op_##name:                              \
+            chip8->pc += 2;                     \
+            OP_##name(chip8, &ip->instr);       \
+            ++ip;                               \
+            goto *ip->label;
+
+#define BLOCK_OP_QUIRKS(name)                   \
+        op_##name:                              \
+            chip8->pc += 2;                     \
+            OP_##name<Q>(chip8, &ip->instr);    \
+            ++ip;                               \
+            goto *ip->label;
+
+        BLOCK_OP(NULL)
+        BLOCK_OP(00E0)
+        BLOCK_OP(00EE)
+        BLOCK_OP(1nnn)
+        BLOCK_OP(2nnn)
+        BLOCK_OP(3xkk)
+        BLOCK_OP(4xkk)
+        BLOCK_OP(5xy0)
+        BLOCK_OP(6xkk)
+        BLOCK_OP(7xkk)
+        BLOCK_OP(8xy0)
+        BLOCK_OP_QUIRKS(8xy1)
+        BLOCK_OP_QUIRKS(8xy2)
+        BLOCK_OP_QUIRKS(8xy3)
+        BLOCK_OP(8xy4)
+        BLOCK_OP(8xy5)
+        BLOCK_OP_QUIRKS(8xy6)
+        BLOCK_OP(8xy7)
+        BLOCK_OP_QUIRKS(8xyE)
+        BLOCK_OP(9xy0)
+        BLOCK_OP(Annn)
+        BLOCK_OP_QUIRKS(Bnnn)
+        BLOCK_OP(Cxkk)
+        BLOCK_OP_QUIRKS(Dxyn)
+        BLOCK_OP(Ex9E)
+        BLOCK_OP(ExA1)
+        BLOCK_OP(Fx07)
+        BLOCK_OP(Fx0A)
+        BLOCK_OP(Fx15)
+        BLOCK_OP(Fx18)
+        BLOCK_OP(Fx1E)
+        BLOCK_OP(Fx29)
+        BLOCK_OP(Fx33)
+        BLOCK_OP_QUIRKS(Fx55)
+        BLOCK_OP_QUIRKS(Fx65)
+
+#define BLOCK_SKIP(name)                        \
+        skip_##name:                            \
+        {                                       \
+            chip8->pc += 2;                     \
+            uint16_t next = chip8->pc;          \
+            OP_##name(chip8, &ip->instr);       \
+            uint32_t taken = chip8->pc != next; \
+            skipped += taken;                   \
+            ip += 1 + taken;                    \
+            goto *ip->label;                    \
+        }
+
+        BLOCK_SKIP(3xkk)
+        BLOCK_SKIP(4xkk)
+        BLOCK_SKIP(5xy0)
+        BLOCK_SKIP(9xy0)
+        BLOCK_SKIP(Ex9E)
+        BLOCK_SKIP(ExA1)
+
+#undef BLOCK_OP
+#undef BLOCK_OP_QUIRKS
+#undef BLOCK_SKIP
+
+    block_end:
+#else
+        while (ip->label)
+        {
+            chip8->pc += 2;
+            uint16_t next = chip8->pc;
+            ip->instr.handler(chip8, &ip->instr);
+            // only a skip moves pc, and a skip that isn't the last entry steps over the next one with it
+            uint32_t taken = chip8->pc != next && chip8_block_skips(ip->instr.op) && ip + 1 != block->code + block->length;
+            skipped += taken;
+            ip += 1 + taken;
+        }
+#endif
+
+        executed += block->length - skipped;
+        previous = block;
+    }
+
+    // not enough cycles left for a whole block, finish one instruction at a time
+    while (executed < max_cycles)
+    {
+        chip8_cycle_cached(chip8);
+        executed++;
+    }
+
+    return executed;
+}
+
+// Runs exactly max_cycles instructions, needs chip8_blocks_attach first. Returns the instructions run.
+inline uint64_t chip8_run_blocks(CHIP8* chip8, uint64_t max_cycles)
+{
+    return chip8_with_quirks(chip8->quirks, [&]<typename Q>() { return chip8_run_blocks_quirks<Q>(chip8, max_cycles); });
+}
+
+
+#endif //CHIP8_BLOCKS_H
@@ -0,0 +1,165 @@
+﻿#ifndef CHIP8_INPUT_H
+#define CHIP8_INPUT_H
+
+#include <atomic>
+
+#include "chip8.h"
+
+
+/*** INPUT QUEUE ***/
+/*
+ Key presses and releases as they happen, instead of sampling the keyboard once a frame. The window side (glfw key
+ callback) pushes timestamped events, the emulation side takes them a frame at a time and turns them into keypad
+ changes at the instruction they fall on (CHIP8_FRAME_KEYS for chip8_run_frame_keys).
+ A key that goes down and up between two samples used to be lost, here every event reaches the machine and a key
+ always stays down for at least one instruction.
+ The queue is single producer, single consumer and lock free, so the two sides can be on different threads.
+ The consumer also keeps the keypad as of the last event it took, which is what the machine's keypad should be.
+
+ USAGE:
+    CHIP8_INPUT_QUEUE queue;
+    chip8_input_init(&queue);
+    ... input thread ...
+    chip8_input_push(&queue, {now_ns, key, true});
+    ... emulation thread, each frame ...
+    CHIP8_FRAME_KEYS keys;
+    chip8_input_take_frame(&queue, chip8, frame_start_ns, frame_ns, frame_config.instructions_per_frame, &keys);
+    chip8_run_frame_keys(chip8, &frame_config, &keys);
+ */
+
+#define CHIP8_INPUT_QUEUE_SIZE 256 // power of two
+
+typedef struct CHIP8_INPUT_EVENT
+{
+    uint64_t time_ns; // when it happened, same clock as the frame times given to chip8_input_take_frame
+    uint8_t key; // keypad key, 0x0-0xF
+    bool pressed;
+} CHIP8_INPUT_EVENT;
+
+typedef struct CHIP8_INPUT_QUEUE
+{
+    CHIP8_INPUT_EVENT events[CHIP8_INPUT_QUEUE_SIZE];
+    // each index on its own cache line so the two threads don't keep taking the line from each other
+    alignas(CHIP8_CACHE_LINE) std::atomic<uint32_t> head; // next slot to write, only the producer stores it
+    uint32_t dropped; // events pushed while the queue was full, producer side
+    alignas(CHIP8_CACHE_LINE) std::atomic<uint32_t> tail; // next slot to read, only the consumer stores it
+    uint16_t keys; // keypad after the last event taken, consumer side
+} CHIP8_INPUT_QUEUE;
+
+inline void chip8_input_init(CHIP8_INPUT_QUEUE* queue)
+{
+    queue->head.store(0, std::memory_order_relaxed);
+    queue->tail.store(0, std::memory_order_relaxed);
+    queue->dropped = 0;
+    queue->keys = 0;
+}
+
+// producer only, false (and counted in dropped) if the consumer is CHIP8_INPUT_QUEUE_SIZE events behind
+inline bool chip8_input_push(CHIP8_INPUT_QUEUE* queue, CHIP8_INPUT_EVENT event)
+{
+    uint32_t head = queue->head.load(std::memory_order_relaxed);
+    if (head - queue->tail.load(std::memory_order_acquire) == CHIP8_INPUT_QUEUE_SIZE)
+    {
+        queue->dropped++;
+        return false;
+    }
+    queue->events[head & (CHIP8_INPUT_QUEUE_SIZE - 1)] = event;
+    queue->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// consumer only, the oldest event without taking it
+inline bool chip8_input_peek(const CHIP8_INPUT_QUEUE* queue, CHIP8_INPUT_EVENT* event)
+{
+    uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+    if (tail == queue->head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    *event = queue->events[tail & (CHIP8_INPUT_QUEUE_SIZE - 1)];
+    return true;
+}
+
+// consumer only, takes the event chip8_input_peek returned
+inline void chip8_input_pop(CHIP8_INPUT_QUEUE* queue)
+{
+    const CHIP8_INPUT_EVENT& event = queue->events[queue->tail.load(std::memory_order_relaxed) & (CHIP8_INPUT_QUEUE_SIZE - 1)];
+    uint16_t bit = (uint16_t) (1u << (event.key & 0x0Fu));
+    queue->keys = event.pressed ? (uint16_t) (queue->keys | bit) : (uint16_t) (queue->keys & ~bit);
+    queue->tail.store(queue->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// consumer only, takes everything queued (while the machine isn't running, rewinding), returns the keypad after it
+inline uint16_t chip8_input_drain(CHIP8_INPUT_QUEUE* queue)
+{
+    CHIP8_INPUT_EVENT event;
+    while (chip8_input_peek(queue, &event))
+    {
+        chip8_input_pop(queue);
+    }
+    return queue->keys;
+}
+
+/*
+ Takes the events for the frame running from frame_start_ns to frame_start_ns + frame_ns and places each on the
+ instruction it falls on, proportionally through the frame. Events from before the frame land on its first instruction.
+ Every change of a key is at least one instruction after the one before it, so a tap shorter than an instruction
+ still shows; one pushed past the end of the frame stays queued and starts the next frame. Events later than the
+ frame stay queued too.
+ If the machine's keypad doesn't match the queue's (restored from a save state or rewound), the first change puts it back.
+ */
+inline void chip8_input_take_frame(CHIP8_INPUT_QUEUE* queue, const CHIP8* chip8, uint64_t frame_start_ns,
+                                   uint64_t frame_ns, uint32_t frame_cycles, CHIP8_FRAME_KEYS* keys)
+{
+    keys->count = 0;
+    if (chip8_keypad_mask(chip8) != queue->keys)
+    {
+        keys->changes[keys->count++] = {0, queue->keys};
+    }
+
+    uint32_t next_cycle[16] = {}; // earliest cycle each key can change again
+    CHIP8_INPUT_EVENT event;
+    while (keys->count < CHIP8_FRAME_KEYS_MAX && chip8_input_peek(queue, &event))
+    {
+        if (event.time_ns >= frame_start_ns + frame_ns)
+        {
+            break;
+        }
+
+        uint32_t cycle = 0;
+        if (event.time_ns > frame_start_ns)
+        {
+            cycle = (uint32_t) ((event.time_ns - frame_start_ns) * frame_cycles / frame_ns);
+        }
+        uint8_t key = event.key & 0x0Fu;
+        cycle = cycle > next_cycle[key] ? cycle : next_cycle[key];
+        if (cycle >= frame_cycles && frame_cycles > 0)
+        {
+            break;
+        }
+        // keep the changes in order, one can't go before the change of another key it came after
+        if (keys->count > 0 && keys->changes[keys->count - 1].cycle > cycle)
+        {
+            cycle = keys->changes[keys->count - 1].cycle;
+        }
+
+        uint16_t before = queue->keys;
+        chip8_input_pop(queue);
+        if (queue->keys == before)
+        {
+            continue; // pressed while already down, or released while up
+        }
+        next_cycle[key] = cycle + 1;
+        if (keys->count > 0 && keys->changes[keys->count - 1].cycle == cycle)
+        {
+            keys->changes[keys->count - 1].keys = queue->keys; // same instruction as the change before, one change
+        }
+        else
+        {
+            keys->changes[keys->count++] = {cycle, queue->keys};
+        }
+    }
+}
+
+
+#endif //CHIP8_INPUT_H
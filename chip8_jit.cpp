@@ -0,0 +1,1141 @@
+﻿#include "chip8_jit.h"
+
+#include <stddef.h>
+
+#if CHIP8_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+#if CHIP8_JIT_SUPPORTED
+
+/*** EMITTER ***/
+/*
+ Register use inside a block:
+    rbx       CHIP8*
+    r14       the block table (CHIP8_JIT::blocks)
+    r15       instructions left in the budget
+    rax, rcx  scratch
+    the rest  V registers and I, in jit_host_regs order
+ Every V register is held as a zero extended byte and only touched with 8 bit instructions,
+ so wrapping and the carry flag come for free.
+ Between blocks nothing but rbx, r14 and r15 is live, the enter stub saves every callee saved register once.
+ */
+
+enum JIT_REG : uint8_t
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// callee saved first, so they are what most blocks end up using
+static const uint8_t jit_host_regs[] = {R12, R13, RBP, R8, R9, R10, R11, RSI, RDI, RDX};
+#define JIT_HOST_REG_COUNT (sizeof(jit_host_regs) / sizeof(jit_host_regs[0]))
+
+// worst case bytes for one instruction: spill + reload of every register and a call
+#define JIT_MAX_INSTR_BYTES 256
+// the block's exits on top, see jit_translate
+#define JIT_MAX_BLOCK_BYTES(length) ((length) * JIT_MAX_INSTR_BYTES + 512)
+
+static_assert(JIT_MAX_BLOCK_BYTES(BLOCK_MAX_LENGTH) <= JIT_BATCH_BYTES, "a batch must hold at least the longest block");
+static_assert(sizeof(CHIP8_JIT_BLOCK) == 16, "the dispatch stub indexes the block table with a shift by 4");
+
+enum JIT_CC : uint8_t
+{
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+};
+
+// 8 bit alu ops, r/m8 <- r8 opcodes and their /digit for the imm8 form
+enum JIT_ALU : uint8_t
+{
+    ALU_ADD = 0x00,
+    ALU_OR = 0x08,
+    ALU_AND = 0x20,
+    ALU_SUB = 0x28,
+    ALU_XOR = 0x30,
+    ALU_CMP = 0x38,
+};
+
+typedef struct JIT_EMITTER
+{
+    uint8_t* p;
+} JIT_EMITTER;
+
+static void emit8(JIT_EMITTER* e, uint8_t b) { *e->p++ = b; }
+
+static void emit16(JIT_EMITTER* e, uint16_t v)
+{
+    memcpy(e->p, &v, 2);
+    e->p += 2;
+}
+
+static void emit32(JIT_EMITTER* e, uint32_t v)
+{
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit64(JIT_EMITTER* e, uint64_t v)
+{
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+static uint8_t rex(bool w, uint8_t reg, uint8_t rm)
+{
+    return 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+}
+
+static uint8_t modrm(uint8_t mod, uint8_t reg, uint8_t rm)
+{
+    return (mod << 6) | ((reg & 7) << 3) | (rm & 7);
+}
+
+// [rbx + disp32]
+static void emit_chip8_operand(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, modrm(2, reg, RBX));
+    emit32(e, offset);
+}
+
+// movzx r32, byte [rbx + offset]
+static void emit_load_byte(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, rex(false, reg, RBX));
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// mov byte [rbx + offset], r8 (the rex prefix is always there so sil/dil/bpl are reachable)
+static void emit_store_byte(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, rex(false, reg, RBX));
+    emit8(e, 0x88);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// movzx r32, word [rbx + offset]
+static void emit_load_word(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, rex(false, reg, RBX));
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// mov word [rbx + offset], r16
+static void emit_store_word(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, 0x66);
+    emit8(e, rex(false, reg, RBX));
+    emit8(e, 0x89);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// mov word [rbx + offset], imm16
+static void emit_store_word_imm(JIT_EMITTER* e, uint32_t offset, uint16_t value)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit_chip8_operand(e, 0, offset);
+    emit16(e, value);
+}
+
+// mov r64, qword [rbx + offset]
+static void emit_load_qword(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, rex(true, reg, RBX));
+    emit8(e, 0x8B);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// sub r64, qword [rbx + offset]
+static void emit_sub_qword(JIT_EMITTER* e, uint8_t reg, uint32_t offset)
+{
+    emit8(e, rex(true, reg, RBX));
+    emit8(e, 0x2B);
+    emit_chip8_operand(e, reg, offset);
+}
+
+// mov r32, imm32
+static void emit_mov_imm32(JIT_EMITTER* e, uint8_t reg, uint32_t value)
+{
+    emit8(e, rex(false, 0, reg));
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, value);
+}
+
+// mov r64, imm64
+static void emit_mov_imm64(JIT_EMITTER* e, uint8_t reg, uint64_t value)
+{
+    emit8(e, rex(true, 0, reg));
+    emit8(e, 0xB8 + (reg & 7));
+    emit64(e, value);
+}
+
+// mov dst64, src64
+static void emit_mov64(JIT_EMITTER* e, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(true, src, dst));
+    emit8(e, 0x89);
+    emit8(e, modrm(3, src, dst));
+}
+
+// mov r8, imm8
+static void emit_mov8_imm(JIT_EMITTER* e, uint8_t reg, uint8_t value)
+{
+    emit8(e, rex(false, 0, reg));
+    emit8(e, 0xB0 + (reg & 7));
+    emit8(e, value);
+}
+
+// mov dst8, src8
+static void emit_mov8(JIT_EMITTER* e, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(false, src, dst));
+    emit8(e, 0x88);
+    emit8(e, modrm(3, src, dst));
+}
+
+// op dst8, src8
+static void emit_alu8(JIT_EMITTER* e, JIT_ALU op, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(false, src, dst));
+    emit8(e, op);
+    emit8(e, modrm(3, src, dst));
+}
+
+// op dst8, imm8
+static void emit_alu8_imm(JIT_EMITTER* e, JIT_ALU op, uint8_t dst, uint8_t value)
+{
+    emit8(e, rex(false, 0, dst));
+    emit8(e, 0x80);
+    emit8(e, modrm(3, op >> 3, dst));
+    emit8(e, value);
+}
+
+// shr/shl r8, 1
+static void emit_shift8(JIT_EMITTER* e, bool left, uint8_t reg)
+{
+    emit8(e, rex(false, 0, reg));
+    emit8(e, 0xD0);
+    emit8(e, modrm(3, left ? 4 : 5, reg));
+}
+
+// setcc r8
+static void emit_setcc(JIT_EMITTER* e, JIT_CC cc, uint8_t reg)
+{
+    emit8(e, rex(false, 0, reg));
+    emit8(e, 0x0F);
+    emit8(e, 0x90 + cc);
+    emit8(e, modrm(3, 0, reg));
+}
+
+// cmovcc dst32, src32
+static void emit_cmov(JIT_EMITTER* e, JIT_CC cc, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(false, dst, src));
+    emit8(e, 0x0F);
+    emit8(e, 0x40 + cc);
+    emit8(e, modrm(3, dst, src));
+}
+
+// movzx dst32, src8
+static void emit_movzx8(JIT_EMITTER* e, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(false, dst, src));
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, modrm(3, dst, src));
+}
+
+// add dst32, src32
+static void emit_add32(JIT_EMITTER* e, uint8_t dst, uint8_t src)
+{
+    emit8(e, rex(false, dst, src));
+    emit8(e, 0x03);
+    emit8(e, modrm(3, dst, src));
+}
+
+// and r32, imm32
+static void emit_and32_imm(JIT_EMITTER* e, uint8_t reg, uint32_t value)
+{
+    emit8(e, rex(false, 0, reg));
+    emit8(e, 0x81);
+    emit8(e, modrm(3, 4, reg));
+    emit32(e, value);
+}
+
+// sub r64, imm32
+static void emit_sub64_imm(JIT_EMITTER* e, uint8_t reg, uint32_t value)
+{
+    emit8(e, rex(true, 0, reg));
+    emit8(e, 0x81);
+    emit8(e, modrm(3, 5, reg));
+    emit32(e, value);
+}
+
+// cmp r64, imm32
+static void emit_cmp64_imm(JIT_EMITTER* e, uint8_t reg, uint32_t value)
+{
+    emit8(e, rex(true, 0, reg));
+    emit8(e, 0x81);
+    emit8(e, modrm(3, 7, reg));
+    emit32(e, value);
+}
+
+// inc r64
+static void emit_inc64(JIT_EMITTER* e, uint8_t reg)
+{
+    emit8(e, rex(true, 0, reg));
+    emit8(e, 0xFF);
+    emit8(e, modrm(3, 0, reg));
+}
+
+static void emit_push(JIT_EMITTER* e, uint8_t reg)
+{
+    if (reg >= 8) emit8(e, 0x41);
+    emit8(e, 0x50 + (reg & 7));
+}
+
+static void emit_pop(JIT_EMITTER* e, uint8_t reg)
+{
+    if (reg >= 8) emit8(e, 0x41);
+    emit8(e, 0x58 + (reg & 7));
+}
+
+static void patch_rel32(uint8_t* field, const uint8_t* target)
+{
+    int32_t rel = (int32_t) (target - (field + 4));
+    memcpy(field, &rel, 4);
+}
+
+// jmp rel32, returns the displacement so a forward jump can be patched once its target is known
+static uint8_t* emit_jmp(JIT_EMITTER* e, const uint8_t* target)
+{
+    emit8(e, 0xE9);
+    uint8_t* field = e->p;
+    emit32(e, 0);
+    patch_rel32(field, target ? target : e->p);
+    return field;
+}
+
+// jcc rel32
+static uint8_t* emit_jcc(JIT_EMITTER* e, JIT_CC cc, const uint8_t* target)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+    uint8_t* field = e->p;
+    emit32(e, 0);
+    patch_rel32(field, target ? target : e->p);
+    return field;
+}
+
+
+/*** INTERPRETER FALLBACK ***/
+
+// length of the block starting at address, same boundaries as the block engine
+static uint16_t jit_block_length(const CHIP8* chip8, unsigned int address)
+{
+    uint16_t length = 0;
+    while (length < BLOCK_MAX_LENGTH)
+    {
+        const CHIP8_INSTR* instr = &chip8->decoded[(address + length * 2u) & 0x0FFFu];
+        length++;
+        if (chip8_block_skips(instr->op) && length < BLOCK_MAX_LENGTH)
+        {
+            continue;
+        }
+        if (chip8_block_ends_at(instr->op))
+        {
+            break;
+        }
+    }
+    return length;
+}
+
+static void jit_interpret(CHIP8* chip8, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; i++)
+    {
+        chip8_cycle_cached(chip8);
+    }
+}
+
+
+/*** TRANSLATION ***/
+
+#define JIT_OFFSET_REGISTERS ((uint32_t) offsetof(CHIP8, registers))
+#define JIT_OFFSET_INDEX ((uint32_t) offsetof(CHIP8, index))
+#define JIT_OFFSET_PC ((uint32_t) offsetof(CHIP8, pc))
+#define JIT_OFFSET_KEYPAD ((uint32_t) offsetof(CHIP8, keypad))
+#define JIT_OFFSET_TIMER_TICKS ((uint32_t) offsetof(CHIP8, timer_ticks))
+#define JIT_OFFSET_DELAY_SET_TICK ((uint32_t) offsetof(CHIP8, delay_set_tick))
+#define JIT_OFFSET_DELAY_SET_VALUE ((uint32_t) offsetof(CHIP8, delay_set_value))
+
+#define JIT_NO_REG 0xFF
+
+typedef struct JIT_ALLOC
+{
+    uint8_t v[16]; // host register for each V register, JIT_NO_REG when the block never touches it natively
+    uint8_t index; // host register for I
+    uint8_t used;
+} JIT_ALLOC;
+
+// ops that get native code, everything else calls its handler.
+// The native code is the default profile's behaviour, ops the machine's profile changes go to its handler instead
+static bool jit_is_native(const CHIP8_QUIRK_FLAGS* quirks, uint8_t op)
+{
+    switch (op)
+    {
+        case CHIP8_OP_8xy1:
+        case CHIP8_OP_8xy2:
+        case CHIP8_OP_8xy3:
+            return !quirks->logic_resets_vf;
+        case CHIP8_OP_8xy6:
+        case CHIP8_OP_8xyE:
+            return !quirks->shift_uses_vy;
+        case CHIP8_OP_1nnn:
+        case CHIP8_OP_3xkk:
+        case CHIP8_OP_4xkk:
+        case CHIP8_OP_5xy0:
+        case CHIP8_OP_6xkk:
+        case CHIP8_OP_7xkk:
+        case CHIP8_OP_8xy0:
+        case CHIP8_OP_8xy4:
+        case CHIP8_OP_8xy5:
+        case CHIP8_OP_8xy7:
+        case CHIP8_OP_9xy0:
+        case CHIP8_OP_Annn:
+        case CHIP8_OP_Ex9E:
+        case CHIP8_OP_ExA1:
+        case CHIP8_OP_Fx07:
+        case CHIP8_OP_Fx1E:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool jit_alloc_v(JIT_ALLOC* alloc, uint8_t v)
+{
+    if (alloc->v[v] != JIT_NO_REG)
+    {
+        return true;
+    }
+    if (alloc->used == JIT_HOST_REG_COUNT)
+    {
+        return false;
+    }
+    alloc->v[v] = jit_host_regs[alloc->used++];
+    return true;
+}
+
+// give every register a native instruction reads or writes a host register, false if they don't all fit
+static bool jit_alloc_block(const CHIP8_INSTR* const* instrs, uint16_t length, JIT_ALLOC* alloc)
+{
+    memset(alloc->v, JIT_NO_REG, sizeof(alloc->v));
+    alloc->index = JIT_NO_REG;
+    alloc->used = 0;
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        const CHIP8_INSTR* instr = instrs[i];
+        bool ok = true;
+
+        switch (instr->op)
+        {
+            case CHIP8_OP_3xkk:
+            case CHIP8_OP_4xkk:
+            case CHIP8_OP_6xkk:
+            case CHIP8_OP_7xkk:
+            case CHIP8_OP_Ex9E:
+            case CHIP8_OP_ExA1:
+            case CHIP8_OP_Fx07:
+                ok = jit_alloc_v(alloc, instr->x);
+                break;
+            case CHIP8_OP_5xy0:
+            case CHIP8_OP_9xy0:
+            case CHIP8_OP_8xy0:
+            case CHIP8_OP_8xy1:
+            case CHIP8_OP_8xy2:
+            case CHIP8_OP_8xy3:
+                ok = jit_alloc_v(alloc, instr->x) && jit_alloc_v(alloc, instr->y);
+                break;
+            case CHIP8_OP_8xy4:
+            case CHIP8_OP_8xy5:
+            case CHIP8_OP_8xy7:
+                ok = jit_alloc_v(alloc, instr->x) && jit_alloc_v(alloc, instr->y) && jit_alloc_v(alloc, 0xF);
+                break;
+            case CHIP8_OP_8xy6:
+            case CHIP8_OP_8xyE:
+                ok = jit_alloc_v(alloc, instr->x) && jit_alloc_v(alloc, 0xF);
+                break;
+            case CHIP8_OP_Annn:
+            case CHIP8_OP_Fx1E:
+                if (instr->op == CHIP8_OP_Fx1E)
+                {
+                    ok = jit_alloc_v(alloc, instr->x);
+                }
+                if (ok && alloc->index == JIT_NO_REG)
+                {
+                    ok = alloc->used < JIT_HOST_REG_COUNT;
+                    if (ok)
+                    {
+                        alloc->index = jit_host_regs[alloc->used++];
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void emit_load_state(JIT_EMITTER* e, const JIT_ALLOC* alloc)
+{
+    for (uint8_t v = 0; v < 16; v++)
+    {
+        if (alloc->v[v] != JIT_NO_REG)
+        {
+            emit_load_byte(e, alloc->v[v], JIT_OFFSET_REGISTERS + v);
+        }
+    }
+    if (alloc->index != JIT_NO_REG)
+    {
+        emit_load_word(e, alloc->index, JIT_OFFSET_INDEX);
+    }
+}
+
+static void emit_store_state(JIT_EMITTER* e, const JIT_ALLOC* alloc)
+{
+    for (uint8_t v = 0; v < 16; v++)
+    {
+        if (alloc->v[v] != JIT_NO_REG)
+        {
+            emit_store_byte(e, alloc->v[v], JIT_OFFSET_REGISTERS + v);
+        }
+    }
+    if (alloc->index != JIT_NO_REG)
+    {
+        emit_store_word(e, alloc->index, JIT_OFFSET_INDEX);
+    }
+}
+
+// spill, set pc like the interpreter would have, call the handler, reload
+static void emit_call_handler(JIT_EMITTER* e, const JIT_ALLOC* alloc, const CHIP8_INSTR* instr, uint16_t next_pc)
+{
+    emit_store_state(e, alloc);
+    emit_store_word_imm(e, JIT_OFFSET_PC, next_pc);
+
+    emit_mov64(e, RDI, RBX);
+    emit_mov_imm64(e, RSI, (uint64_t) (uintptr_t) instr);
+    emit_mov_imm64(e, RAX, (uint64_t) (uintptr_t) instr->handler);
+
+    // call rax
+    emit8(e, 0xFF);
+    emit8(e, 0xD0);
+
+    emit_load_state(e, alloc);
+}
+
+// pc = condition ? skip_pc : next_pc, flags already set by a compare
+static void emit_skip(JIT_EMITTER* e, JIT_CC cc, uint16_t next_pc)
+{
+    emit_mov_imm32(e, RAX, next_pc);
+    emit_mov_imm32(e, RCX, (uint16_t) (next_pc + 2));
+    emit_cmov(e, cc, RAX, RCX);
+    emit_store_word(e, RAX, JIT_OFFSET_PC);
+}
+
+// sets the flags for a skip, returns the condition it skips on
+static JIT_CC emit_skip_compare(JIT_EMITTER* e, const JIT_ALLOC* alloc, const CHIP8_INSTR* instr)
+{
+    uint8_t vx = alloc->v[instr->x];
+    uint8_t vy = alloc->v[instr->y];
+
+    switch (instr->op)
+    {
+        case CHIP8_OP_3xkk:
+            emit_alu8_imm(e, ALU_CMP, vx, instr->kk);
+            return CC_E;
+        case CHIP8_OP_4xkk:
+            emit_alu8_imm(e, ALU_CMP, vx, instr->kk);
+            return CC_NE;
+        case CHIP8_OP_5xy0:
+            emit_alu8(e, ALU_CMP, vx, vy);
+            return CC_E;
+        case CHIP8_OP_9xy0:
+            emit_alu8(e, ALU_CMP, vx, vy);
+            return CC_NE;
+        default:
+            // Ex9E/ExA1: cmp byte [rbx + keypad + Vx], 0, same unchecked index as the handlers
+            emit_movzx8(e, RAX, vx);
+            emit8(e, 0x80);
+            emit8(e, modrm(2, 7, 4));
+            emit8(e, modrm(0, RAX, RBX)); // sib, rbx + rax
+            emit32(e, JIT_OFFSET_KEYPAD);
+            emit8(e, 0);
+            return instr->op == CHIP8_OP_Ex9E ? CC_NE : CC_E;
+    }
+}
+
+static void emit_native(JIT_EMITTER* e, const JIT_ALLOC* alloc, const CHIP8_INSTR* instr)
+{
+    uint8_t vx = alloc->v[instr->x];
+    uint8_t vy = alloc->v[instr->y];
+    uint8_t vf = alloc->v[0xF];
+
+    switch (instr->op)
+    {
+        case CHIP8_OP_6xkk:
+            emit_mov8_imm(e, vx, instr->kk);
+            break;
+        case CHIP8_OP_7xkk:
+            emit_alu8_imm(e, ALU_ADD, vx, instr->kk);
+            break;
+        case CHIP8_OP_8xy0:
+            emit_mov8(e, vx, vy);
+            break;
+        case CHIP8_OP_8xy1:
+            emit_alu8(e, ALU_OR, vx, vy);
+            break;
+        case CHIP8_OP_8xy2:
+            emit_alu8(e, ALU_AND, vx, vy);
+            break;
+        case CHIP8_OP_8xy3:
+            emit_alu8(e, ALU_XOR, vx, vy);
+            break;
+
+        // the flag ops write VF before Vx, exactly like the handlers, so x or y == F comes out the same
+        case CHIP8_OP_8xy4:
+            emit_mov8(e, RAX, vx);
+            emit_alu8(e, ALU_ADD, RAX, vy);
+            emit_setcc(e, CC_B, vf);
+            emit_mov8(e, vx, RAX);
+            break;
+        case CHIP8_OP_8xy5:
+            emit_alu8(e, ALU_CMP, vx, vy);
+            emit_setcc(e, CC_A, vf);
+            emit_alu8(e, ALU_SUB, vx, vy);
+            break;
+        case CHIP8_OP_8xy6:
+            emit_mov8(e, RAX, vx);
+            emit_alu8_imm(e, ALU_AND, RAX, 0x01);
+            emit_mov8(e, vf, RAX);
+            emit_shift8(e, false, vx);
+            break;
+        case CHIP8_OP_8xy7:
+            emit_alu8(e, ALU_CMP, vy, vx);
+            emit_setcc(e, CC_A, vf);
+            emit_mov8(e, RAX, vy);
+            emit_alu8(e, ALU_SUB, RAX, vx);
+            emit_mov8(e, vx, RAX);
+            break;
+        case CHIP8_OP_8xyE:
+            emit_mov8(e, RAX, vx);
+            emit_alu8_imm(e, ALU_AND, RAX, 0x80);
+            emit_setcc(e, CC_NE, vf); // and sets ZF, so this is msb != 0
+            emit_shift8(e, true, vx);
+            break;
+        case CHIP8_OP_Annn:
+            emit_mov_imm32(e, alloc->index, instr->nnn);
+            break;
+        case CHIP8_OP_Fx07:
+            // chip8_timer_value: set_value - (now - set_tick), or 0 once that many ticks have gone by
+            emit_load_qword(e, RAX, JIT_OFFSET_TIMER_TICKS);
+            emit_sub_qword(e, RAX, JIT_OFFSET_DELAY_SET_TICK);
+            emit_load_byte(e, RCX, JIT_OFFSET_DELAY_SET_VALUE);
+            // sub rcx, rax
+            emit8(e, rex(true, RAX, RCX));
+            emit8(e, 0x29);
+            emit8(e, modrm(3, RAX, RCX));
+            emit_mov_imm32(e, RAX, 0); // not xor, that would clobber the flags
+            emit_cmov(e, CC_BE, RCX, RAX);
+            emit_mov8(e, vx, RCX);
+            break;
+        case CHIP8_OP_Fx1E:
+            emit_movzx8(e, RAX, vx);
+            emit_add32(e, alloc->index, RAX);
+            emit_and32_imm(e, alloc->index, 0xFFFF);
+            break;
+        default:
+            break;
+    }
+}
+
+// Leaves a block: spill, pc (unless the last instruction already stored it), take the instructions off the
+// budget and go on to the next block. Fx33/Fx55 go back to C instead when they wrote over translated code
+static void emit_block_exit(JIT_EMITTER* e, const CHIP8_JIT* jit, const JIT_ALLOC* alloc, bool store_pc, uint16_t pc,
+                            uint16_t length, bool check_flush)
+{
+    emit_store_state(e, alloc);
+    if (store_pc)
+    {
+        emit_store_word_imm(e, JIT_OFFSET_PC, pc);
+    }
+    emit_sub64_imm(e, R15, length);
+
+    if (check_flush)
+    {
+        emit_mov_imm64(e, RAX, (uint64_t) (uintptr_t) &jit->flush_pending);
+        // cmp byte [rax], 0
+        emit8(e, 0x80);
+        emit8(e, modrm(0, 7, RAX));
+        emit8(e, 0);
+        emit_jcc(e, CC_NE, jit->exit);
+    }
+    emit_jmp(e, jit->dispatch);
+}
+
+// Emits the block at address, returns false if it has to be interpreted.
+// successors gets the start of every block it can go to that is known now
+static bool jit_translate(CHIP8* chip8, CHIP8_JIT* jit, CHIP8_JIT_BLOCK* block, unsigned int address,
+                          uint16_t* successors, unsigned int* successor_count)
+{
+    uint16_t length = block->length;
+    const CHIP8_INSTR* instrs[BLOCK_MAX_LENGTH];
+    for (uint16_t i = 0; i < length; i++)
+    {
+        instrs[i] = &chip8->decoded[(address + i * 2u) & 0x0FFFu];
+    }
+
+    JIT_ALLOC alloc;
+    if (!jit_alloc_block(instrs, length, &alloc))
+    {
+        return false;
+    }
+
+    JIT_EMITTER e = {jit->code + jit->code_used};
+    uint8_t* start = e.p;
+
+    emit_load_state(&e, &alloc);
+    uint8_t* loop_top = e.p;
+
+    /*** Body ***/
+    CHIP8_QUIRK_FLAGS quirks = chip8_quirk_flags(chip8->quirks);
+    uint8_t* labels[BLOCK_MAX_LENGTH + 1]; // code of each instruction, the last one is the fall through exit
+    uint8_t* skip_jumps[BLOCK_MAX_LENGTH]; // jumps over the next instruction, to labels[i + 2]
+    uint16_t pc = (uint16_t) address;
+    uint16_t end_pc = (uint16_t) (address + length * 2u);
+    bool falls_through = true; // the last instruction didn't leave the block itself
+    bool end_used = false; // a skip steps over the last instruction
+    unsigned int count = 0;
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        const CHIP8_INSTR* instr = instrs[i];
+        uint16_t next_pc = (uint16_t) (pc + 2);
+        bool last = i + 1 == length;
+        labels[i] = e.p;
+        skip_jumps[i] = NULL;
+
+        if (chip8_block_skips(instr->op))
+        {
+            JIT_CC cc = emit_skip_compare(&e, &alloc, instr);
+            if (!last)
+            {
+                // jncc over; inc r15 (the skipped instruction doesn't count); jmp labels[i + 2]
+                emit8(&e, 0x70 + (cc ^ 1));
+                emit8(&e, 8);
+                emit_inc64(&e, R15);
+                skip_jumps[i] = emit_jmp(&e, NULL);
+                end_used |= i + 2 == length;
+            }
+            else
+            {
+                // only when the block ran out of length, both ways lead out of it
+                emit_skip(&e, cc, next_pc);
+                emit_block_exit(&e, jit, &alloc, false, 0, length, false);
+                successors[count++] = next_pc;
+                successors[count++] = (uint16_t) (next_pc + 2);
+                falls_through = false;
+            }
+        }
+        else if (instr->op == CHIP8_OP_1nnn && last)
+        {
+            if (instr->nnn == address)
+            {
+                // a loop back to the start of the block stays in native code while the budget lasts
+                emit_sub64_imm(&e, R15, length);
+                emit_cmp64_imm(&e, R15, length);
+                emit_jcc(&e, CC_AE, loop_top);
+                emit_store_state(&e, &alloc);
+                emit_store_word_imm(&e, JIT_OFFSET_PC, instr->nnn);
+                emit_jmp(&e, jit->exit);
+            }
+            else
+            {
+                emit_block_exit(&e, jit, &alloc, true, instr->nnn, length, false);
+                successors[count++] = instr->nnn;
+            }
+            falls_through = false;
+        }
+        else if (jit_is_native(&quirks, instr->op))
+        {
+            emit_native(&e, &alloc, instr);
+        }
+        else
+        {
+            emit_call_handler(&e, &alloc, instr, next_pc);
+            if (last && chip8_block_ends_at(instr->op))
+            {
+                // the handler left pc where the program goes next
+                bool writes = instr->op == CHIP8_OP_Fx33 || instr->op == CHIP8_OP_Fx55;
+                emit_block_exit(&e, jit, &alloc, false, 0, length, writes);
+                if (instr->op == CHIP8_OP_2nnn)
+                {
+                    successors[count++] = instr->nnn;
+                }
+                if (instr->op == CHIP8_OP_2nnn || writes)
+                {
+                    successors[count++] = next_pc;
+                }
+                falls_through = false;
+            }
+        }
+
+        pc = next_pc;
+    }
+
+    labels[length] = e.p;
+    if (falls_through || end_used)
+    {
+        emit_block_exit(&e, jit, &alloc, true, end_pc, length, false);
+        successors[count++] = end_pc;
+    }
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        if (skip_jumps[i])
+        {
+            patch_rel32(skip_jumps[i], labels[i + 2]);
+        }
+    }
+
+    block->code = start;
+    jit->code_used += (unsigned int) (e.p - start);
+    *successor_count = count;
+    return true;
+}
+
+// page aligned range of the code buffer, read/write or read/execute, never both
+static bool jit_protect(CHIP8_JIT* jit, unsigned int begin, unsigned int end, bool writable)
+{
+    static const unsigned int page = (unsigned int) sysconf(_SC_PAGESIZE);
+    begin &= ~(page - 1);
+    end = (end + page - 1) & ~(page - 1);
+    if (end > JIT_CODE_SIZE)
+    {
+        end = JIT_CODE_SIZE;
+    }
+
+    int result = mprotect(jit->code + begin, end - begin, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC));
+    if (result != 0)
+    {
+        jit->failed = true;
+        return false;
+    }
+    return true;
+}
+
+static void jit_flush(CHIP8_JIT* jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->code_used = jit->code_start;
+    jit->flush_pending = false;
+    jit->flushes++;
+}
+
+// Translates the block at address and the blocks it leads to, with one flip of the pages they land in
+static void jit_translate_batch(CHIP8* chip8, CHIP8_JIT* jit, uint16_t address)
+{
+    if (jit->code_used + JIT_BATCH_BYTES > JIT_CODE_SIZE)
+    {
+        jit_flush(jit);
+    }
+
+    unsigned int window_begin = jit->code_used;
+    unsigned int window_end = jit->code_used + JIT_BATCH_BYTES;
+    if (!jit_protect(jit, window_begin, window_end, true))
+    {
+        return;
+    }
+    jit->batches++;
+
+    uint16_t pending[JIT_BATCH_BLOCKS * 2 + 2];
+    unsigned int pending_count = 0;
+    pending[pending_count++] = address;
+
+    for (unsigned int translated = 0; pending_count > 0 && translated < JIT_BATCH_BLOCKS;)
+    {
+        uint16_t pc = pending[--pending_count];
+        if (pc > 0x0FFFu || jit->blocks[pc].state != JIT_BLOCK_UNKNOWN)
+        {
+            continue;
+        }
+
+        CHIP8_JIT_BLOCK* block = &jit->blocks[pc];
+        block->length = jit_block_length(chip8, pc);
+        if (jit->code_used + JIT_MAX_BLOCK_BYTES(block->length) > window_end)
+        {
+            break;
+        }
+
+        uint16_t successors[4];
+        unsigned int successor_count = 0;
+        if (jit_translate(chip8, jit, block, pc, successors, &successor_count))
+        {
+            block->state = JIT_BLOCK_NATIVE;
+            jit->blocks_native++;
+        }
+        else
+        {
+            block->state = JIT_BLOCK_INTERPRET;
+            jit->blocks_interpreted++;
+        }
+        translated++;
+
+        for (uint16_t i = 0; i < block->length * 2u; i++)
+        {
+            jit->covered[(pc + i) & 0x0FFFu] = 1;
+        }
+        for (unsigned int i = 0; i < successor_count && pending_count < sizeof(pending) / sizeof(pending[0]); i++)
+        {
+            pending[pending_count++] = successors[i];
+        }
+    }
+
+    jit_protect(jit, window_begin, window_end, false);
+}
+
+// enter, dispatch and exit, shared by every block
+static void jit_emit_stubs(CHIP8_JIT* jit)
+{
+    static const uint8_t saved[] = {RBX, RBP, R12, R13, R14, R15};
+
+    JIT_EMITTER e = {jit->code};
+
+    /*** Enter: enter(chip8, budget, blocks) ***/
+    jit->enter = (chip8_jit_enter_fn) e.p;
+    for (uint8_t reg : saved)
+    {
+        emit_push(&e, reg);
+    }
+    // sub rsp, 8 (keep the stack 16 byte aligned for handler calls)
+    emit8(&e, 0x48);
+    emit8(&e, 0x83);
+    emit8(&e, 0xEC);
+    emit8(&e, 0x08);
+    emit_mov64(&e, RBX, RDI);
+    emit_mov64(&e, R15, RSI);
+    emit_mov64(&e, R14, RDX);
+    uint8_t* enter_jump = emit_jmp(&e, NULL);
+
+    /*** Exit: returns what is left of the budget ***/
+    jit->exit = e.p;
+    emit_mov64(&e, RAX, R15);
+    // add rsp, 8
+    emit8(&e, 0x48);
+    emit8(&e, 0x83);
+    emit8(&e, 0xC4);
+    emit8(&e, 0x08);
+    for (int i = (int) sizeof(saved) - 1; i >= 0; i--)
+    {
+        emit_pop(&e, saved[i]);
+    }
+    emit8(&e, 0xC3); // ret
+
+    /*** Dispatch: the block at pc if it is native and fits the budget, else back to C ***/
+    jit->dispatch = e.p;
+    patch_rel32(enter_jump, jit->dispatch);
+    emit_load_word(&e, RAX, JIT_OFFSET_PC);
+    // cmp eax, 0xFFF
+    emit8(&e, 0x3D);
+    emit32(&e, 0x0FFFu);
+    emit_jcc(&e, CC_A, jit->exit);
+    // shl eax, 4
+    emit8(&e, 0xC1);
+    emit8(&e, 0xE0);
+    emit8(&e, 0x04);
+    // mov rcx, [r14 + rax] (code)
+    emit8(&e, rex(true, RCX, R14));
+    emit8(&e, 0x8B);
+    emit8(&e, modrm(0, RCX, 4));
+    emit8(&e, modrm(0, RAX, R14)); // sib
+    // test rcx, rcx
+    emit8(&e, rex(true, RCX, RCX));
+    emit8(&e, 0x85);
+    emit8(&e, modrm(3, RCX, RCX));
+    emit_jcc(&e, CC_E, jit->exit);
+    // movzx eax, word [r14 + rax + length]
+    emit8(&e, rex(false, RAX, R14));
+    emit8(&e, 0x0F);
+    emit8(&e, 0xB7);
+    emit8(&e, modrm(1, RAX, 4));
+    emit8(&e, modrm(0, RAX, R14)); // sib
+    emit8(&e, (uint8_t) offsetof(CHIP8_JIT_BLOCK, length));
+    // cmp r15, rax
+    emit8(&e, rex(true, RAX, R15));
+    emit8(&e, 0x39);
+    emit8(&e, modrm(3, RAX, R15));
+    emit_jcc(&e, CC_B, jit->exit);
+    // jmp rcx
+    emit8(&e, 0xFF);
+    emit8(&e, 0xE1);
+
+    jit->code_start = (unsigned int) (e.p - jit->code);
+    jit->code_used = jit->code_start;
+}
+
+static void chip8_jit_invalidate(CHIP8* chip8, unsigned int address, unsigned int length)
+{
+    CHIP8_JIT* jit = (CHIP8_JIT*) chip8->code_cache;
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if (jit->covered[(address + i) & 0x0FFFu])
+        {
+            // the block doing the write is still running, flush once it is back in C
+            jit->flush_pending = true;
+            return;
+        }
+    }
+}
+
+static void chip8_jit_destroy(CHIP8* chip8)
+{
+    CHIP8_JIT* jit = (CHIP8_JIT*) chip8->code_cache;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+    chip8->code_cache = NULL;
+}
+
+CHIP8_JIT* chip8_jit_attach(CHIP8* chip8)
+{
+    void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    CHIP8_JIT* jit = (CHIP8_JIT*) calloc(1, sizeof(CHIP8_JIT));
+    if (!jit)
+    {
+        munmap(code, JIT_CODE_SIZE);
+        return NULL;
+    }
+    jit->code = (uint8_t*) code;
+
+    jit_emit_stubs(jit);
+    if (!jit_protect(jit, 0, JIT_CODE_SIZE, false))
+    {
+        munmap(code, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+
+    if (chip8->code_cache)
+    {
+        chip8->code_cache->destroy(chip8);
+    }
+
+    jit->header.invalidate = chip8_jit_invalidate;
+    jit->header.destroy = chip8_jit_destroy;
+
+    chip8->code_cache = &jit->header;
+    return jit;
+}
+
+uint64_t chip8_run_jit(CHIP8* chip8, uint64_t max_cycles)
+{
+    CHIP8_JIT* jit = (CHIP8_JIT*) chip8->code_cache;
+    uint64_t executed = 0;
+
+    while (jit && !jit->failed && executed < max_cycles)
+    {
+        if (jit->flush_pending)
+        {
+            jit_flush(jit);
+        }
+
+        uint16_t pc = chip8->pc;
+        if (pc > 0x0FFFu)
+        {
+            // the code has constant pc values baked in, a pc that wrapped past 4k is left to the interpreter
+            chip8_cycle_cached(chip8);
+            executed++;
+            continue;
+        }
+
+        CHIP8_JIT_BLOCK* block = &jit->blocks[pc];
+        if (block->state == JIT_BLOCK_UNKNOWN)
+        {
+            jit_translate_batch(chip8, jit, pc);
+            if (block->state == JIT_BLOCK_UNKNOWN)
+            {
+                // mprotect failed
+                break;
+            }
+        }
+
+        if (max_cycles - executed < block->length)
+        {
+            break;
+        }
+
+        if (block->state == JIT_BLOCK_NATIVE)
+        {
+            // runs this block and every native block after it, until one isn't native or doesn't fit
+            uint64_t budget = max_cycles - executed;
+            executed += budget - jit->enter(chip8, budget, jit->blocks);
+        }
+        else
+        {
+            jit_interpret(chip8, block->length);
+            executed += block->length;
+        }
+    }
+
+    // not enough cycles left for a whole block, finish one instruction at a time
+    while (executed < max_cycles)
+    {
+        chip8_cycle_cached(chip8);
+        executed++;
+    }
+
+    return executed;
+}
+
+#else
+
+CHIP8_JIT* chip8_jit_attach(CHIP8* chip8)
+{
+    (void) chip8;
+    return NULL;
+}
+
+uint64_t chip8_run_jit(CHIP8* chip8, uint64_t max_cycles)
+{
+    for (uint64_t i = 0; i < max_cycles; i++)
+    {
+        chip8_cycle_cached(chip8);
+    }
+    return max_cycles;
+}
+
+#endif
@@ -0,0 +1,88 @@
+﻿#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+#include "chip8.h"
+#include "chip8_blocks.h"
+
+
+/*** JIT ***/
+/*
+ Translates basic blocks (same boundaries as the block engine, skips stay inside the block) into native x86-64 code.
+ Inside a block the V registers it touches and I live in host registers, pc is a constant baked into the code.
+ Register arithmetic, skips, Fx07 and the keypad skips are native, anything else (Dxyn, Cxkk, memory, calls...)
+ spills the registers back into the CHIP8 struct and calls the normal OP_* handler.
+ Blocks don't return to C: each one ends by jumping to a small dispatch stub that looks the next block up and jumps
+ straight into it while the budget lasts, and a block that jumps back to its own start loops without leaving.
+ C only sees the machine again for blocks that aren't translated yet, the end of the budget and Fx33/Fx55 writes.
+ Blocks are cached by start address and thrown away when Fx33/Fx55 write over them.
+ A block that can't be translated (or a pc outside 0x000-0xFFF) is run by the interpreter instead.
+ Blocks are translated in batches (a block and the blocks it leads to), with one write/execute flip of only the
+ pages being written per batch.
+
+ Only built for x86-64 linux (System V calling convention, mmap'd code that is never writable and executable
+ at the same time). Everywhere else chip8_jit_attach returns NULL and chip8_run_jit runs the interpreter.
+
+ USAGE:
+    chip8_jit_attach(chip8);
+    chip8_run_jit(chip8, cycles);
+ */
+
+#if defined(__x86_64__) && defined(__linux__)
+#define CHIP8_JIT_SUPPORTED 1
+#else
+#define CHIP8_JIT_SUPPORTED 0
+#endif
+
+#define JIT_CODE_SIZE (1024 * 1024)
+
+#define JIT_BATCH_BYTES (64 * 1024) // code made writable per batch of translations
+#define JIT_BATCH_BLOCKS 32
+
+enum CHIP8_JIT_STATE : uint8_t
+{
+    JIT_BLOCK_UNKNOWN,
+    JIT_BLOCK_NATIVE,
+    JIT_BLOCK_INTERPRET, // couldn't be translated
+};
+
+// read by the dispatch stub, keep the layout in step with it
+typedef struct CHIP8_JIT_BLOCK
+{
+    const uint8_t* code; // NULL when the block isn't native, the stub hands it back to C
+    uint16_t length; // instructions
+    uint8_t state;
+} CHIP8_JIT_BLOCK;
+
+// runs native blocks until one isn't native or doesn't fit in budget, returns what is left of budget
+typedef uint64_t (*chip8_jit_enter_fn)(CHIP8* chip8, uint64_t budget, const CHIP8_JIT_BLOCK* blocks);
+
+typedef struct CHIP8_JIT
+{
+    CHIP8_CODE_CACHE header;
+
+    CHIP8_JIT_BLOCK blocks[4096]; // by start address
+    uint8_t covered[4096]; // memory bytes that are part of a translated block
+    bool flush_pending;
+
+    uint8_t* code; // JIT_CODE_SIZE bytes, the stubs first and then the blocks
+    unsigned int code_used;
+    unsigned int code_start; // first byte after the stubs
+    chip8_jit_enter_fn enter;
+    const uint8_t* dispatch;
+    const uint8_t* exit;
+    bool failed; // mprotect refused, everything runs in the interpreter from then on
+
+    //stats
+    uint64_t blocks_native;
+    uint64_t blocks_interpreted;
+    uint64_t flushes;
+    uint64_t batches; // write/execute flips
+} CHIP8_JIT;
+
+
+CHIP8_JIT* chip8_jit_attach(CHIP8* chip8);
+// Runs exactly max_cycles instructions, needs chip8_jit_attach first. Returns the instructions run.
+uint64_t chip8_run_jit(CHIP8* chip8, uint64_t max_cycles);
+
+
+#endif //CHIP8_JIT_H
@@ -0,0 +1,114 @@
+﻿#ifndef CHIP8_POOL_H
+#define CHIP8_POOL_H
+
+#include "chip8.h"
+
+
+/*** INSTANCE POOL ***/
+/*
+ Machines for batch runs that create and reset thousands of them.
+ All the machines are allocated up front in one cache line aligned arena (and their decode caches in another),
+ every CHIP8 fills whole cache lines so machines run on different threads never share one.
+ The pool keeps a pristine machine (powered on, fontset loaded, optionally a rom and quirks profile) and resetting
+ a machine is a memcpy of it plus its decode cache, instead of freeing and allocating again.
+ A reset keeps the machine's decode cache and code cache (blocks, jit or aot), the code cache is only invalidated.
+
+ USAGE:
+    CHIP8_POOL pool;
+    chip8_pool_init(&pool, 1000);
+    chip8_pool_load_rom_memory(&pool, rom, rom_size);
+    CHIP8* chip8 = chip8_pool_get(&pool, i);
+    chip8_pool_reset(&pool, chip8);
+    chip8_pool_free(&pool);
+ */
+
+typedef struct CHIP8_POOL
+{
+    CHIP8* machines; // count machines back to back, then the pristine one
+    CHIP8_INSTR* decoded; // a DECODE_CACHE_SIZE record decode cache per machine, same order
+    CHIP8* pristine; // what a reset copies, the last machine in the arena
+    uint32_t count;
+} CHIP8_POOL;
+
+inline CHIP8* chip8_pool_get(CHIP8_POOL* pool, uint32_t i)
+{
+    return &pool->machines[i];
+}
+
+// back to the pristine state, the machine keeps its decode cache and code cache
+inline void chip8_pool_reset(CHIP8_POOL* pool, CHIP8* chip8)
+{
+    CHIP8_INSTR* decoded = chip8->decoded;
+    CHIP8_CODE_CACHE* code_cache = chip8->code_cache;
+
+    memcpy(chip8, pool->pristine, sizeof(CHIP8));
+    memcpy(decoded, pool->pristine->decoded, DECODE_CACHE_SIZE * sizeof(CHIP8_INSTR));
+    chip8->decoded = decoded;
+    chip8->code_cache = code_cache;
+
+    if (code_cache)
+    {
+        code_cache->invalidate(chip8, 0, sizeof(chip8->memory));
+    }
+}
+
+// Every machine starts out as a copy of the pristine one. Returns false if the arenas can't be allocated
+inline bool chip8_pool_init(CHIP8_POOL* pool, uint32_t count, uint64_t seed = CHIP8_DEFAULT_SEED)
+{
+    pool->count = count;
+    pool->machines = (CHIP8*) chip8_aligned_alloc((size_t) (count + 1) * sizeof(CHIP8));
+    pool->decoded = (CHIP8_INSTR*) chip8_aligned_alloc((size_t) (count + 1) * DECODE_CACHE_SIZE * sizeof(CHIP8_INSTR));
+    if (!pool->machines || !pool->decoded)
+    {
+        chip8_aligned_free(pool->machines);
+        chip8_aligned_free(pool->decoded);
+        pool->machines = NULL;
+        pool->decoded = NULL;
+        pool->pristine = NULL;
+        pool->count = 0;
+        return false;
+    }
+
+    pool->pristine = &pool->machines[count];
+    pool->pristine->decoded = &pool->decoded[(size_t) count * DECODE_CACHE_SIZE];
+    chip8_power_on(pool->pristine, seed);
+    chip8_decode_cache_build(pool->pristine);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pool->machines[i].decoded = &pool->decoded[(size_t) i * DECODE_CACHE_SIZE];
+        chip8_pool_reset(pool, &pool->machines[i]);
+    }
+    return true;
+}
+
+// These change the pristine machine, so they only show up in machines reset afterwards
+inline void chip8_pool_load_rom_memory(CHIP8_POOL* pool, const uint8_t* rom, unsigned int rom_size)
+{
+    chip8_load_rom_memory(pool->pristine, rom, rom_size);
+}
+
+inline void chip8_pool_set_quirks(CHIP8_POOL* pool, uint8_t profile)
+{
+    chip8_set_quirks(pool->pristine, profile);
+}
+
+inline void chip8_pool_free(CHIP8_POOL* pool)
+{
+    for (uint32_t i = 0; i < pool->count; i++)
+    {
+        if (pool->machines[i].code_cache)
+        {
+            pool->machines[i].code_cache->destroy(&pool->machines[i]);
+        }
+    }
+    chip8_aligned_free(pool->machines);
+    chip8_aligned_free(pool->decoded);
+    pool->machines = NULL;
+    pool->decoded = NULL;
+    pool->pristine = NULL;
+    pool->count = 0;
+}
+
+
+#endif //CHIP8_POOL_H
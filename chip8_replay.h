@@ -0,0 +1,405 @@
+﻿#ifndef CHIP8_REPLAY_H
+#define CHIP8_REPLAY_H
+
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_state.h"
+
+
+/*** REPLAYS ***/
+/*
+ Records a session as the keypad changes plus everything else the run depends on (rom hash, seed, quirks profile,
+ instructions per frame, vblank quirk), so playing it back gives the exact same machine frame for frame.
+ Each change is stamped with the 60hz frame it applies in (the machine's timer_ticks) and the instruction of that
+ frame it applies before, 0 for changes made between frames (chip8_set_key), later ones for keys that changed partway
+ through a frame (CHIP8_FRAME_KEYS, chip8_run_frame_keys).
+ Every keyframe_interval frames a save state (chip8_state_encode) goes in too, so the player seeks to any frame by
+ restoring the keyframe below it and running at most keyframe_interval frames.
+ If the recorded machine is rewound (chip8_rewind.h) the recording is cut back to match.
+
+ USAGE:
+    CHIP8_RECORDER recorder;
+    chip8_recorder_init(&recorder, chip8, rom, rom_size, seed, &frame_config, 600);
+    ... every frame, after input and before chip8_run_frame (or chip8_run_frame_keys with the same keys) ...
+    chip8_recorder_frame(&recorder, chip8, &keys);
+    chip8_recorder_save(&recorder, chip8, "session.c8replay");
+
+    CHIP8_REPLAY replay;
+    chip8_replay_load(&replay, "session.c8replay");
+    chip8_replay_seek(&replay, chip8, rom, rom_size, &frame_config, frame);
+    chip8_replay_run(&replay, chip8, &frame_config, replay.info.end_frame);
+ */
+
+typedef struct CHIP8_REPLAY_INFO
+{
+    uint64_t rom_hash; // chip8_rom_hash
+    uint64_t seed; // what chip8_init was given
+    uint8_t quirks;
+    uint32_t instructions_per_frame;
+    bool vblank_wait;
+    uint32_t keyframe_interval;
+    uint64_t start_frame; // timer_ticks when recording started, the first keyframe
+    uint64_t end_frame; // timer_ticks when it was saved
+    uint64_t end_video_hash; // chip8_video_hash at end_frame, lets a player check it reproduced the session
+} CHIP8_REPLAY_INFO;
+
+typedef struct CHIP8_REPLAY_EVENT
+{
+    uint64_t frame; // applies during this frame
+    uint32_t cycle; // before this instruction of the frame, 0 before the frame runs
+    uint16_t keys; // the whole keypad after the change, bit n is key n
+} CHIP8_REPLAY_EVENT;
+
+typedef struct CHIP8_REPLAY_KEYFRAME
+{
+    uint64_t frame; // start_frame + n * keyframe_interval
+    uint32_t first_event; // first event at or after frame
+    uint32_t offset; // of the encoded save state, in the recorder's state buffer or the replay file
+    uint32_t size;
+} CHIP8_REPLAY_KEYFRAME;
+
+typedef struct CHIP8_RECORDER
+{
+    CHIP8_REPLAY_INFO info;
+    const uint8_t* rom; // not owned, keyframes are stored against it
+    unsigned int rom_size;
+
+    uint16_t start_keys; // keypad when recording started
+    uint16_t keys; // keypad as of the last event
+    std::vector<CHIP8_REPLAY_EVENT> events;
+    std::vector<CHIP8_REPLAY_KEYFRAME> keyframes;
+    std::vector<uint8_t> states; // encoded keyframe save states back to back
+} CHIP8_RECORDER;
+
+typedef struct CHIP8_REPLAY
+{
+    CHIP8_REPLAY_INFO info;
+    std::vector<CHIP8_REPLAY_EVENT> events;
+    std::vector<CHIP8_REPLAY_KEYFRAME> keyframes;
+    std::vector<uint8_t> data; // the whole file, keyframe offsets point into it
+    uint32_t next_event; // playback position
+} CHIP8_REPLAY;
+
+#define CHIP8_REPLAY_MAGIC 0x50523843u // "C8RP"
+#define CHIP8_REPLAY_VERSION 2 // 2 added the cycle to events, version 1 files still load
+
+// Starts recording from the machine as it is now, normally right after the rom is loaded.
+// seed is the one the machine was created with, the config the one every frame will run with
+inline void chip8_recorder_init(CHIP8_RECORDER* recorder, const CHIP8* chip8, const uint8_t* rom, unsigned int rom_size,
+                                uint64_t seed, const CHIP8_FRAME_CONFIG* config, uint32_t keyframe_interval)
+{
+    recorder->info = {};
+    recorder->info.rom_hash = chip8_rom_hash(rom, rom_size);
+    recorder->info.seed = seed;
+    recorder->info.quirks = chip8->quirks;
+    recorder->info.instructions_per_frame = config->instructions_per_frame;
+    recorder->info.vblank_wait = config->vblank_wait;
+    recorder->info.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    recorder->info.start_frame = chip8->timer_ticks;
+    recorder->rom = rom;
+    recorder->rom_size = rom_size;
+    recorder->start_keys = chip8_keypad_mask(chip8);
+    recorder->keys = recorder->start_keys;
+    recorder->events.clear();
+    recorder->keyframes.clear();
+    recorder->states.clear();
+}
+
+// Drops everything recorded for frame and later, for when the machine went back in time
+inline void chip8_recorder_cut(CHIP8_RECORDER* recorder, uint64_t frame)
+{
+    while (!recorder->events.empty() && recorder->events.back().frame >= frame)
+    {
+        recorder->events.pop_back();
+    }
+    while (!recorder->keyframes.empty() && recorder->keyframes.back().frame >= frame)
+    {
+        recorder->states.resize(recorder->keyframes.back().offset);
+        recorder->keyframes.pop_back();
+    }
+}
+
+// Call once per frame, after the input for it was set and before it runs. keys are the changes the frame will run
+// with (chip8_run_frame_keys), NULL if it's run with chip8_run_frame
+inline void chip8_recorder_frame(CHIP8_RECORDER* recorder, const CHIP8* chip8, const CHIP8_FRAME_KEYS* keys = NULL)
+{
+    uint64_t frame = chip8->timer_ticks;
+    if (frame < recorder->info.start_frame)
+    {
+        return; // rewound to before the recording started
+    }
+
+    bool rewound = (!recorder->events.empty() && recorder->events.back().frame >= frame) ||
+                   (!recorder->keyframes.empty() && recorder->keyframes.back().frame >= frame);
+    if (rewound)
+    {
+        chip8_recorder_cut(recorder, frame);
+        recorder->keys = !recorder->events.empty() ? recorder->events.back().keys : recorder->start_keys;
+    }
+
+    if ((frame - recorder->info.start_frame) % recorder->info.keyframe_interval == 0)
+    {
+        CHIP8_SNAPSHOT snapshot;
+        chip8_snapshot(chip8, &snapshot);
+
+        size_t offset = recorder->states.size();
+        recorder->states.resize(offset + CHIP8_STATE_MAX_SIZE);
+        size_t size = chip8_state_encode(&snapshot, recorder->rom, recorder->rom_size, &recorder->states[offset], CHIP8_STATE_MAX_SIZE);
+        recorder->states.resize(offset + size);
+
+        uint32_t first_event = (uint32_t) recorder->events.size();
+        recorder->keyframes.push_back({frame, first_event, (uint32_t) offset, (uint32_t) size});
+    }
+
+    uint16_t start_keys = chip8_keypad_mask(chip8);
+    if (start_keys != recorder->keys)
+    {
+        recorder->events.push_back({frame, 0, start_keys});
+        recorder->keys = start_keys;
+    }
+    for (uint32_t i = 0; keys && i < keys->count; i++)
+    {
+        if (keys->changes[i].keys != recorder->keys)
+        {
+            recorder->events.push_back({frame, keys->changes[i].cycle, keys->changes[i].keys});
+            recorder->keys = keys->changes[i].keys;
+        }
+    }
+}
+
+/*
+ Replay file, little endian, no padding:
+    u32  magic "C8RP"
+    u16  version
+    u64  rom hash, seed
+    u8   quirks profile
+    u32  instructions per frame
+    u8   vblank quirk
+    u32  keyframe interval
+    u64  start frame, end frame, end video hash
+    u32  event count
+         per event: u32 frames since the previous event (or the start frame), u32 instruction in the frame, u16 keypad
+         (version 1 has no instruction, every change was at the start of its frame)
+    u32  keyframe count
+         per keyframe: u64 frame, u32 first event, u32 offset of its save state in the file, u32 save state size
+    ...  the save states (STATE FILE format)
+    u32  CRC-32 of everything before it
+ The keyframe index is in front of the states, so a reader can go straight to one keyframe.
+ */
+
+inline bool chip8_recorder_save(CHIP8_RECORDER* recorder, const CHIP8* chip8, const char* filename)
+{
+    recorder->info.end_frame = chip8->timer_ticks;
+    recorder->info.end_video_hash = chip8_video_hash(chip8);
+    chip8_recorder_cut(recorder, recorder->info.end_frame + 1);
+
+    const CHIP8_REPLAY_INFO* info = &recorder->info;
+    size_t events_size = recorder->events.size() * 10;
+    size_t index_size = recorder->keyframes.size() * 20;
+    size_t states_start = 4 + 2 + 8 + 8 + 1 + 4 + 1 + 4 + 24 + 4 + events_size + 4 + index_size;
+
+    std::vector<uint8_t> data(states_start + recorder->states.size() + 4);
+    CHIP8_STATE_CURSOR cursor = {data.data(), data.size(), 0, false};
+    chip8_state_put(&cursor, CHIP8_REPLAY_MAGIC, 4);
+    chip8_state_put(&cursor, CHIP8_REPLAY_VERSION, 2);
+    chip8_state_put(&cursor, info->rom_hash, 8);
+    chip8_state_put(&cursor, info->seed, 8);
+    chip8_state_put(&cursor, info->quirks, 1);
+    chip8_state_put(&cursor, info->instructions_per_frame, 4);
+    chip8_state_put(&cursor, info->vblank_wait, 1);
+    chip8_state_put(&cursor, info->keyframe_interval, 4);
+    chip8_state_put(&cursor, info->start_frame, 8);
+    chip8_state_put(&cursor, info->end_frame, 8);
+    chip8_state_put(&cursor, info->end_video_hash, 8);
+
+    chip8_state_put(&cursor, recorder->events.size(), 4);
+    uint64_t previous = info->start_frame;
+    for (const CHIP8_REPLAY_EVENT& event : recorder->events)
+    {
+        chip8_state_put(&cursor, event.frame - previous, 4);
+        chip8_state_put(&cursor, event.cycle, 4);
+        chip8_state_put(&cursor, event.keys, 2);
+        previous = event.frame;
+    }
+
+    chip8_state_put(&cursor, recorder->keyframes.size(), 4);
+    for (const CHIP8_REPLAY_KEYFRAME& keyframe : recorder->keyframes)
+    {
+        chip8_state_put(&cursor, keyframe.frame, 8);
+        chip8_state_put(&cursor, keyframe.first_event, 4);
+        chip8_state_put(&cursor, states_start + keyframe.offset, 4);
+        chip8_state_put(&cursor, keyframe.size, 4);
+    }
+
+    if (!recorder->states.empty())
+    {
+        memcpy(&data[cursor.used], recorder->states.data(), recorder->states.size());
+        cursor.used += recorder->states.size();
+    }
+    chip8_state_put(&cursor, chip8_crc32(data.data(), cursor.used), 4);
+
+    FILE* replay_file = fopen(filename, "wb");
+    if (!replay_file || cursor.overflow || fwrite(data.data(), data.size(), 1, replay_file) != 1)
+    {
+        if (replay_file)
+        {
+            fclose(replay_file);
+        }
+        printf("ERROR CANNOT WRITE REPLAY FILE %s\n", filename);
+        return false;
+    }
+    fclose(replay_file);
+    return true;
+}
+
+inline bool chip8_replay_load(CHIP8_REPLAY* replay, const char* filename)
+{
+    FILE* replay_file = fopen(filename, "rb");
+    if (!replay_file)
+    {
+        printf("ERROR CANNOT READ REPLAY FILE %s\n", filename);
+        return false;
+    }
+    fseek(replay_file, 0L, SEEK_END);
+    long size = ftell(replay_file);
+    rewind(replay_file);
+    replay->data.resize(size > 0 ? size : 0);
+    size_t read = replay->data.empty() ? 0 : fread(replay->data.data(), replay->data.size(), 1, replay_file);
+    fclose(replay_file);
+
+    const uint8_t* data = replay->data.data();
+    size_t data_size = replay->data.size();
+    if (read != 1 || data_size < 8)
+    {
+        printf("ERROR BAD REPLAY FILE %s (wrong size)\n", filename);
+        return false;
+    }
+
+    CHIP8_STATE_CURSOR cursor = {replay->data.data(), data_size - 4, 0, false};
+    uint32_t magic = (uint32_t) chip8_state_get(&cursor, 4);
+    uint32_t version = (uint32_t) chip8_state_get(&cursor, 2);
+    if (magic != CHIP8_REPLAY_MAGIC || version < 1 || version > CHIP8_REPLAY_VERSION)
+    {
+        printf("ERROR BAD REPLAY FILE %s (not a version %d replay)\n", filename, CHIP8_REPLAY_VERSION);
+        return false;
+    }
+    CHIP8_STATE_CURSOR crc_cursor = {replay->data.data(), data_size, data_size - 4, false};
+    if (chip8_state_get(&crc_cursor, 4) != chip8_crc32(data, data_size - 4))
+    {
+        printf("ERROR BAD REPLAY FILE %s (checksum mismatch)\n", filename);
+        return false;
+    }
+
+    CHIP8_REPLAY_INFO* info = &replay->info;
+    info->rom_hash = chip8_state_get(&cursor, 8);
+    info->seed = chip8_state_get(&cursor, 8);
+    info->quirks = (uint8_t) chip8_state_get(&cursor, 1);
+    info->instructions_per_frame = (uint32_t) chip8_state_get(&cursor, 4);
+    info->vblank_wait = chip8_state_get(&cursor, 1) != 0;
+    info->keyframe_interval = (uint32_t) chip8_state_get(&cursor, 4);
+    info->start_frame = chip8_state_get(&cursor, 8);
+    info->end_frame = chip8_state_get(&cursor, 8);
+    info->end_video_hash = chip8_state_get(&cursor, 8);
+
+    uint32_t event_count = (uint32_t) chip8_state_get(&cursor, 4);
+    replay->events.clear();
+    uint64_t frame = info->start_frame;
+    for (uint32_t i = 0; i < event_count && !cursor.overflow; i++)
+    {
+        frame += chip8_state_get(&cursor, 4);
+        uint32_t cycle = version >= 2 ? (uint32_t) chip8_state_get(&cursor, 4) : 0;
+        uint16_t keys = (uint16_t) chip8_state_get(&cursor, 2);
+        replay->events.push_back({frame, cycle, keys});
+    }
+
+    uint32_t keyframe_count = (uint32_t) chip8_state_get(&cursor, 4);
+    replay->keyframes.clear();
+    for (uint32_t i = 0; i < keyframe_count && !cursor.overflow; i++)
+    {
+        CHIP8_REPLAY_KEYFRAME keyframe;
+        keyframe.frame = chip8_state_get(&cursor, 8);
+        keyframe.first_event = (uint32_t) chip8_state_get(&cursor, 4);
+        keyframe.offset = (uint32_t) chip8_state_get(&cursor, 4);
+        keyframe.size = (uint32_t) chip8_state_get(&cursor, 4);
+        if ((size_t) keyframe.offset + keyframe.size > data_size - 4 || keyframe.first_event > event_count)
+        {
+            cursor.overflow = true;
+        }
+        replay->keyframes.push_back(keyframe);
+    }
+
+    if (cursor.overflow || keyframe_count == 0 || info->keyframe_interval == 0 || info->instructions_per_frame == 0 ||
+        info->quirks >= CHIP8_PROFILE_COUNT)
+    {
+        printf("ERROR BAD REPLAY FILE %s (truncated)\n", filename);
+        return false;
+    }
+    replay->next_event = 0;
+    return true;
+}
+
+// the frame config the replay was recorded with, running the given engine
+inline CHIP8_FRAME_CONFIG chip8_replay_frame_config(const CHIP8_REPLAY* replay, chip8_engine_fn engine)
+{
+    return {replay->info.instructions_per_frame, replay->info.vblank_wait, engine};
+}
+
+// Runs frames up to end_frame, pressing and releasing keys the way the recording did.
+// config has to come from chip8_replay_frame_config. Returns the instructions run
+inline uint64_t chip8_replay_run(CHIP8_REPLAY* replay, CHIP8* chip8, const CHIP8_FRAME_CONFIG* config, uint64_t end_frame)
+{
+    uint64_t cycles = 0;
+    uint32_t event_count = (uint32_t) replay->events.size();
+    CHIP8_FRAME_KEYS keys;
+    while (chip8->timer_ticks < end_frame)
+    {
+        // changes at the start of the frame go straight in, the ones partway through run with the frame
+        keys.count = 0;
+        while (replay->next_event < event_count && replay->events[replay->next_event].frame <= chip8->timer_ticks &&
+               keys.count < CHIP8_FRAME_KEYS_MAX)
+        {
+            const CHIP8_REPLAY_EVENT& event = replay->events[replay->next_event];
+            if (event.frame < chip8->timer_ticks || event.cycle == 0)
+            {
+                chip8_set_keypad_mask(chip8, event.keys);
+            }
+            else
+            {
+                keys.changes[keys.count++] = {event.cycle, event.keys};
+            }
+            replay->next_event++;
+        }
+        cycles += (keys.count > 0 ? chip8_run_frame_keys(chip8, config, &keys) : chip8_run_frame(chip8, config)).cycles;
+    }
+    return cycles;
+}
+
+// Puts the machine at the start of frame (clamped to the recording), restoring the keyframe below it and running
+// the frames in between. The machine needs the replay's rom loaded. False if the keyframe doesn't belong to this rom
+inline bool chip8_replay_seek(CHIP8_REPLAY* replay, CHIP8* chip8, const uint8_t* rom, unsigned int rom_size,
+                              const CHIP8_FRAME_CONFIG* config, uint64_t frame)
+{
+    const CHIP8_REPLAY_INFO* info = &replay->info;
+    frame = frame < info->start_frame ? info->start_frame : frame;
+    frame = frame > info->end_frame ? info->end_frame : frame;
+
+    // keyframes are evenly spaced, so the one to start from is a division away
+    size_t k = (size_t) ((frame - info->start_frame) / info->keyframe_interval);
+    k = k < replay->keyframes.size() ? k : replay->keyframes.size() - 1;
+    const CHIP8_REPLAY_KEYFRAME& keyframe = replay->keyframes[k];
+
+    CHIP8_SNAPSHOT snapshot;
+    if (chip8_state_decode(&snapshot, rom, rom_size, &replay->data[keyframe.offset], keyframe.size) != CHIP8_STATE_OK)
+    {
+        return false;
+    }
+    chip8_restore(chip8, &snapshot);
+    replay->next_event = keyframe.first_event;
+
+    chip8_replay_run(replay, chip8, config, frame);
+    return true;
+}
+
+
+#endif //CHIP8_REPLAY_H
@@ -0,0 +1,347 @@
+﻿#ifndef CHIP8_REWIND_H
+#define CHIP8_REWIND_H
+
+#include <chrono>
+
+#include "chip8.h"
+#include "chip8_state.h"
+
+
+/*** REWIND ***/
+/*
+ Per frame history for rewinding, kept in a fixed size byte ring so memory use never grows past the budget.
+ Every pushed frame is stored as the XOR of the whole machine (memory, registers, video, timers...) against the
+ frame before it, run length encoded, so a frame that only moved a sprite costs a few dozen bytes.
+ XOR works both ways, so stepping back one frame from the newest state is one delta, which is what scrubbing
+ backwards in real time does. Every keyframe_interval frames the full machine is stored too (encoded against
+ zero) so a long jump back starts from the nearest keyframe instead of walking every delta from the newest.
+ When the ring is full the oldest frames are dropped.
+
+ USAGE:
+    CHIP8_REWIND rewind;
+    chip8_rewind_init(&rewind, chip8_rewind_config_default());
+    ... run a frame ...
+    chip8_rewind_push(&rewind, chip8);
+    ... rewind key held ...
+    chip8_rewind_step_back(&rewind, chip8, 1);
+    chip8_rewind_free(&rewind);
+ */
+
+typedef struct CHIP8_REWIND_CONFIG
+{
+    size_t budget_bytes; // size of the byte ring every frame is stored in
+    uint32_t max_frames; // most frames held at once, even if the budget would hold more
+    uint32_t keyframe_interval; // frames between full copies, more is cheaper to record but slower to jump far back
+} CHIP8_REWIND_CONFIG;
+
+// five minutes at 60fps, most roms need well under the budget for it
+inline CHIP8_REWIND_CONFIG chip8_rewind_config_default()
+{
+    return {8 * 1024 * 1024, 5 * 60 * CHIP8_FRAME_RATE, CHIP8_FRAME_RATE};
+}
+
+typedef struct CHIP8_REWIND_FRAME
+{
+    uint32_t offset; // in the byte ring, the delta then the keyframe
+    uint16_t delta_size; // 0 for the first frame pushed, there is nothing before it
+    uint16_t key_size; // 0 when the frame is not a keyframe
+} CHIP8_REWIND_FRAME;
+
+#define CHIP8_REWIND_STATE_SIZE sizeof(CHIP8)
+// runs of less than this many unchanged bytes are cheaper kept in with the changed ones than skipped
+#define CHIP8_REWIND_MIN_SKIP 4
+// worst case encoding, 4 byte run header per CHIP8_REWIND_MIN_SKIP + 1 bytes
+#define CHIP8_REWIND_MAX_ENCODED (CHIP8_REWIND_STATE_SIZE * 2)
+
+static_assert(CHIP8_REWIND_STATE_SIZE < 65536, "run lengths and frame sizes are stored in 16 bits");
+
+typedef struct CHIP8_REWIND
+{
+    CHIP8_REWIND_CONFIG config;
+
+    uint8_t* data; // budget_bytes
+    size_t head; // where the next frame is written
+    CHIP8_REWIND_FRAME* frames; // ring of max_frames, oldest at first
+    uint32_t first;
+    uint32_t count;
+    uint32_t since_keyframe;
+
+    CHIP8_SNAPSHOT last; // the newest frame, deltas are taken against it and stepped back from it
+    uint8_t scratch[CHIP8_REWIND_MAX_ENCODED * 2];
+
+    //stats
+    uint64_t pushed;
+    uint64_t pushed_bytes;
+    uint64_t keyframes;
+    uint64_t dropped; // frames pushed out of the ring to make room
+    uint64_t push_ns;
+    uint64_t push_max_ns;
+} CHIP8_REWIND;
+
+// Runs of (u16 unchanged bytes to skip, u16 changed bytes, the changed bytes XORed) that turn previous into
+// current and back. previous NULL encodes current against zero. Returns the bytes written to out
+inline size_t chip8_rewind_encode(const uint8_t* current, const uint8_t* previous, uint8_t* out)
+{
+    static const uint8_t zero[CHIP8_REWIND_STATE_SIZE] = {};
+    if (!previous)
+    {
+        previous = zero;
+    }
+
+    const size_t size = CHIP8_REWIND_STATE_SIZE;
+    size_t used = 0;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        // unchanged bytes, a word at a time until the word that differs
+        size_t start = pos;
+        while (pos + 8 <= size && memcmp(&current[pos], &previous[pos], 8) == 0)
+        {
+            pos += 8;
+        }
+        while (pos < size && current[pos] == previous[pos])
+        {
+            pos++;
+        }
+        if (pos == size)
+        {
+            break; // the rest is unchanged
+        }
+
+        // changed bytes until a long enough unchanged run
+        size_t changed = pos;
+        size_t same = 0;
+        while (pos < size && same < CHIP8_REWIND_MIN_SKIP)
+        {
+            same = current[pos] == previous[pos] ? same + 1 : 0;
+            pos++;
+        }
+        pos -= same;
+
+        uint16_t skip = (uint16_t) (changed - start);
+        uint16_t length = (uint16_t) (pos - changed);
+        memcpy(&out[used], &skip, 2);
+        memcpy(&out[used + 2], &length, 2);
+        used += 4;
+        for (size_t i = changed; i < pos; i++)
+        {
+            out[used++] = current[i] ^ previous[i];
+        }
+    }
+    return used;
+}
+
+// XORs encoded runs into state, applied to a frame it gives the other one
+inline void chip8_rewind_apply(uint8_t* state, const uint8_t* runs, size_t size)
+{
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < size)
+    {
+        uint16_t skip;
+        uint16_t length;
+        memcpy(&skip, &runs[i], 2);
+        memcpy(&length, &runs[i + 2], 2);
+        i += 4;
+        pos += skip;
+        for (uint16_t k = 0; k < length; k++)
+        {
+            state[pos + k] ^= runs[i + k];
+        }
+        pos += length;
+        i += length;
+    }
+}
+
+inline CHIP8_REWIND_FRAME* chip8_rewind_frame(CHIP8_REWIND* rewind, uint32_t i)
+{
+    return &rewind->frames[(rewind->first + i) % rewind->config.max_frames];
+}
+
+inline void chip8_rewind_drop_oldest(CHIP8_REWIND* rewind)
+{
+    rewind->first = (rewind->first + 1) % rewind->config.max_frames;
+    rewind->count--;
+    rewind->dropped++;
+}
+
+// Makes room for size bytes at head by dropping the oldest frames, returns the offset to write at
+inline size_t chip8_rewind_reserve(CHIP8_REWIND* rewind, size_t size)
+{
+    if (rewind->count == rewind->config.max_frames)
+    {
+        chip8_rewind_drop_oldest(rewind);
+    }
+
+    if (rewind->head + size > rewind->config.budget_bytes)
+    {
+        // frames stored past head are the oldest ones, the ring wraps over them
+        while (rewind->count > 0 && chip8_rewind_frame(rewind, 0)->offset >= rewind->head)
+        {
+            chip8_rewind_drop_oldest(rewind);
+        }
+        rewind->head = 0;
+    }
+
+    while (rewind->count > 0)
+    {
+        const CHIP8_REWIND_FRAME* oldest = chip8_rewind_frame(rewind, 0);
+        size_t oldest_end = oldest->offset + oldest->delta_size + oldest->key_size;
+        if (oldest->offset >= rewind->head + size || oldest_end <= rewind->head)
+        {
+            break;
+        }
+        chip8_rewind_drop_oldest(rewind);
+    }
+
+    size_t offset = rewind->head;
+    rewind->head += size;
+    return offset;
+}
+
+// Returns false if the ring can't be allocated. The budget has to hold at least a couple of full frames
+inline bool chip8_rewind_init(CHIP8_REWIND* rewind, CHIP8_REWIND_CONFIG config)
+{
+    memset(rewind, 0, sizeof(*rewind));
+    config.budget_bytes = config.budget_bytes > CHIP8_REWIND_MAX_ENCODED * 4 ? config.budget_bytes : CHIP8_REWIND_MAX_ENCODED * 4;
+    config.max_frames = config.max_frames > 2 ? config.max_frames : 2;
+    config.keyframe_interval = config.keyframe_interval > 0 ? config.keyframe_interval : 1;
+    rewind->config = config;
+
+    rewind->data = (uint8_t*) malloc(config.budget_bytes);
+    rewind->frames = (CHIP8_REWIND_FRAME*) calloc(config.max_frames, sizeof(CHIP8_REWIND_FRAME));
+    if (!rewind->data || !rewind->frames)
+    {
+        free(rewind->data);
+        free(rewind->frames);
+        rewind->data = NULL;
+        rewind->frames = NULL;
+        return false;
+    }
+    // touch the whole ring now so recording a frame never stalls on a first page fault
+    memset(rewind->data, 0, config.budget_bytes);
+    return true;
+}
+
+inline void chip8_rewind_free(CHIP8_REWIND* rewind)
+{
+    free(rewind->data);
+    free(rewind->frames);
+    rewind->data = NULL;
+    rewind->frames = NULL;
+    rewind->count = 0;
+}
+
+// call once per emulated frame, after it ran
+inline void chip8_rewind_push(CHIP8_REWIND* rewind, const CHIP8* chip8)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    CHIP8_SNAPSHOT current;
+    chip8_snapshot(chip8, &current);
+    const uint8_t* current_bytes = (const uint8_t*) &current.state;
+
+    bool first = rewind->count == 0;
+    size_t delta_size = first ? 0 : chip8_rewind_encode(current_bytes, (const uint8_t*) &rewind->last.state, rewind->scratch);
+
+    size_t key_size = 0;
+    if (first || ++rewind->since_keyframe >= rewind->config.keyframe_interval)
+    {
+        key_size = chip8_rewind_encode(current_bytes, NULL, &rewind->scratch[delta_size]);
+        rewind->since_keyframe = 0;
+        rewind->keyframes++;
+    }
+
+    size_t offset = chip8_rewind_reserve(rewind, delta_size + key_size);
+    memcpy(&rewind->data[offset], rewind->scratch, delta_size + key_size);
+
+    CHIP8_REWIND_FRAME* frame = &rewind->frames[(rewind->first + rewind->count) % rewind->config.max_frames];
+    frame->offset = (uint32_t) offset;
+    frame->delta_size = (uint16_t) delta_size;
+    frame->key_size = (uint16_t) key_size;
+    rewind->count++;
+    rewind->last = current;
+
+    uint64_t ns = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    rewind->pushed++;
+    rewind->pushed_bytes += delta_size + key_size;
+    rewind->push_ns += ns;
+    rewind->push_max_ns = ns > rewind->push_max_ns ? ns : rewind->push_max_ns;
+}
+
+// frames the history can go back from the newest one
+inline uint32_t chip8_rewind_available(const CHIP8_REWIND* rewind)
+{
+    return rewind->count > 0 ? rewind->count - 1 : 0;
+}
+
+// Puts the machine back the given number of pushed frames (fewer if the history is shorter) and forgets the
+// frames after it, pushing again carries on from there. Returns the frames it went back
+inline uint32_t chip8_rewind_step_back(CHIP8_REWIND* rewind, CHIP8* chip8, uint32_t frames)
+{
+    uint32_t available = chip8_rewind_available(rewind);
+    frames = frames < available ? frames : available;
+    if (rewind->count == 0)
+    {
+        return 0;
+    }
+
+    uint32_t target = rewind->count - 1 - frames;
+    uint8_t* state = (uint8_t*) &rewind->last.state;
+
+    // start from the oldest keyframe newer than the target if there is one, fewer deltas to walk back
+    uint32_t from = rewind->count - 1;
+    for (uint32_t i = target + 1; i < rewind->count - 1; i++)
+    {
+        const CHIP8_REWIND_FRAME* frame = chip8_rewind_frame(rewind, i);
+        if (frame->key_size > 0)
+        {
+            memset(state, 0, CHIP8_REWIND_STATE_SIZE);
+            chip8_rewind_apply(state, &rewind->data[frame->offset + frame->delta_size], frame->key_size);
+            from = i;
+            break;
+        }
+    }
+
+    for (uint32_t i = from; i > target; i--)
+    {
+        const CHIP8_REWIND_FRAME* frame = chip8_rewind_frame(rewind, i);
+        chip8_rewind_apply(state, &rewind->data[frame->offset], frame->delta_size);
+    }
+
+    rewind->count = target + 1;
+    const CHIP8_REWIND_FRAME* newest = chip8_rewind_frame(rewind, target);
+    rewind->head = newest->offset + newest->delta_size + newest->key_size;
+    rewind->since_keyframe = 0;
+    for (uint32_t i = target; i > 0 && chip8_rewind_frame(rewind, i)->key_size == 0; i--)
+    {
+        rewind->since_keyframe++;
+    }
+
+    chip8_restore(chip8, &rewind->last);
+    return frames;
+}
+
+inline void chip8_rewind_print_stats(const CHIP8_REWIND* rewind)
+{
+    if (rewind->pushed == 0)
+    {
+        return;
+    }
+
+    size_t used = 0;
+    for (uint32_t i = 0; i < rewind->count; i++)
+    {
+        const CHIP8_REWIND_FRAME* frame = &rewind->frames[(rewind->first + i) % rewind->config.max_frames];
+        used += frame->delta_size + frame->key_size;
+    }
+
+    printf("rewind:       %u frames held (%.1f s), %.1f of %.1f KB used, %.0f bytes a frame, %llu keyframes, %llu dropped\n",
+           rewind->count, (double) rewind->count / CHIP8_FRAME_RATE, used / 1024.0, rewind->config.budget_bytes / 1024.0,
+           (double) rewind->pushed_bytes / rewind->pushed, (unsigned long long) rewind->keyframes,
+           (unsigned long long) rewind->dropped);
+    printf("rewind push:  %.2f us mean, %.2f us max\n", rewind->push_ns / 1000.0 / rewind->pushed, rewind->push_max_ns / 1000.0);
+}
+
+
+#endif //CHIP8_REWIND_H
@@ -0,0 +1,237 @@
+﻿#ifndef CHIP8_RUNAHEAD_H
+#define CHIP8_RUNAHEAD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "chip8.h"
+#include "chip8_state.h"
+
+
+/*** RUN-AHEAD ***/
+/*
+ Hides the frames of lag a rom has between reading a key and drawing the result. Every host frame the real frame
+ runs as normal, then a shadow machine is set to the same state (chip8_restore, so only the memory lines that
+ changed are copied and re-decoded) and runs N more frames with the current input. The shadow's display is what
+ gets presented, the real machine never runs anything speculative so nothing has to be rolled back.
+ With a thread the shadow starts from the state before the real frame and runs N + 1 frames on a second core while
+ the real frame runs, which gives the same display for about the cost of max(1, N + 1) frames instead of 1 + N.
+ The speculative frames are measured against the real ones so the extra cpu time can be shown (chip8_runahead_print_stats).
+ Sound and input side effects of the speculative frames are thrown away with the shadow state.
+
+ USAGE:
+    CHIP8_RUNAHEAD runahead;
+    chip8_runahead_init(&runahead, chip8, 2, true);
+    ... each host frame, after input ...
+    CHIP8_RUN_RESULT result = chip8_runahead_frame(&runahead, chip8, &frame_config);
+    chip8_video_expand(runahead.shadow, pixels);
+    chip8_runahead_free(&runahead);
+ */
+
+typedef struct CHIP8_RUNAHEAD
+{
+    uint32_t frames; // speculative frames run past the real one, 0 turns run-ahead off
+    bool threaded;
+    CHIP8* shadow; // runs the speculative frames, its display is the one to present
+    CHIP8_SNAPSHOT start; // what the shadow is set to before it runs
+    uint64_t presented[VIDEO_HEIGHT]; // the shadow display last time, to tell if it changed
+
+    // second thread for the shadow, only used when threaded
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    const CHIP8_FRAME_CONFIG* job_config;
+    CHIP8_FRAME_KEYS job_keys; // the real frame's key changes, the shadow runs that frame too
+    uint32_t job_frames;
+    bool job_pending;
+    bool job_done;
+    bool stopping;
+
+    //stats
+    uint64_t host_frames;
+    uint64_t real_ns; // running the real frames
+    uint64_t speculative_ns; // running the shadow, on whichever thread did it
+    uint64_t restore_ns; // setting the shadow to the real state
+} CHIP8_RUNAHEAD;
+
+inline uint64_t chip8_runahead_now_ns()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// sets the shadow to start and runs frames on it, the first one with keys if there are any
+inline void chip8_runahead_speculate(CHIP8_RUNAHEAD* runahead, const CHIP8_FRAME_CONFIG* config, uint32_t frames,
+                                     const CHIP8_FRAME_KEYS* keys)
+{
+    uint64_t start_ns = chip8_runahead_now_ns();
+    chip8_restore(runahead->shadow, &runahead->start);
+    uint64_t restored_ns = chip8_runahead_now_ns();
+
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        if (i == 0 && keys)
+        {
+            chip8_run_frame_keys(runahead->shadow, config, keys);
+        }
+        else
+        {
+            chip8_run_frame(runahead->shadow, config);
+        }
+    }
+
+    runahead->restore_ns += restored_ns - start_ns;
+    runahead->speculative_ns += chip8_runahead_now_ns() - restored_ns;
+}
+
+inline void chip8_runahead_thread(CHIP8_RUNAHEAD* runahead)
+{
+    std::unique_lock<std::mutex> guard(runahead->lock);
+    while (true)
+    {
+        runahead->wake.wait(guard, [runahead] { return runahead->job_pending || runahead->stopping; });
+        if (runahead->stopping)
+        {
+            return;
+        }
+        runahead->job_pending = false;
+
+        guard.unlock();
+        chip8_runahead_speculate(runahead, runahead->job_config, runahead->job_frames, &runahead->job_keys);
+        guard.lock();
+
+        runahead->job_done = true;
+        runahead->wake.notify_all();
+    }
+}
+
+// frames can be changed later through runahead->frames. The shadow is a normal machine, attach the same
+// engine to it as the real one (blocks, jit) if the frame config needs it.
+// Traced builds (CHIP8_TRACE) never use the thread, the trace ring only takes one producer.
+// False if the shadow machine can't be allocated
+inline bool chip8_runahead_init(CHIP8_RUNAHEAD* runahead, const CHIP8* chip8, uint32_t frames, bool threaded)
+{
+    runahead->frames = frames;
+    runahead->threaded = threaded && CHIP8_TRACE_LEVEL == 0;
+    runahead->shadow = chip8_init();
+    if (!runahead->shadow)
+    {
+        return false;
+    }
+    chip8_snapshot(chip8, &runahead->start);
+    chip8_restore(runahead->shadow, &runahead->start);
+    memcpy(runahead->presented, chip8->video, sizeof(runahead->presented));
+
+    runahead->job_config = NULL;
+    runahead->job_keys.count = 0;
+    runahead->job_frames = 0;
+    runahead->job_pending = false;
+    runahead->job_done = false;
+    runahead->stopping = false;
+    runahead->host_frames = 0;
+    runahead->real_ns = 0;
+    runahead->speculative_ns = 0;
+    runahead->restore_ns = 0;
+
+    if (runahead->threaded)
+    {
+        runahead->worker = std::thread(chip8_runahead_thread, runahead);
+    }
+    return true;
+}
+
+inline void chip8_runahead_free(CHIP8_RUNAHEAD* runahead)
+{
+    if (runahead->worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(runahead->lock);
+            runahead->stopping = true;
+        }
+        runahead->wake.notify_all();
+        runahead->worker.join();
+    }
+    chip8_free(runahead->shadow);
+    runahead->shadow = NULL;
+}
+
+// Runs the real frame and the speculative ones, call it instead of chip8_run_frame once per host frame with the
+// input already set, or instead of chip8_run_frame_keys with its keys. The speculative frames keep the keypad the
+// real frame ended with. Returns the real frame's result, with CHIP8_EVENT_DRAW added whenever the shadow display changed
+inline CHIP8_RUN_RESULT chip8_runahead_frame(CHIP8_RUNAHEAD* runahead, CHIP8* chip8, const CHIP8_FRAME_CONFIG* config,
+                                             const CHIP8_FRAME_KEYS* keys = NULL)
+{
+    CHIP8_RUN_RESULT result;
+    uint64_t start_ns = chip8_runahead_now_ns();
+
+    if (runahead->frames == 0)
+    {
+        result = keys ? chip8_run_frame_keys(chip8, config, keys) : chip8_run_frame(chip8, config);
+        runahead->real_ns += chip8_runahead_now_ns() - start_ns;
+        // nothing speculative, the shadow just follows so the display to present is always the shadow's
+        memcpy(runahead->shadow->video, chip8->video, sizeof(chip8->video));
+    }
+    else if (runahead->threaded)
+    {
+        // the shadow starts from the same state as the real frame and runs it too, then the speculative ones
+        chip8_snapshot(chip8, &runahead->start);
+        {
+            std::lock_guard<std::mutex> guard(runahead->lock);
+            runahead->job_config = config;
+            runahead->job_keys.count = 0;
+            if (keys)
+            {
+                runahead->job_keys = *keys;
+            }
+            runahead->job_frames = runahead->frames + 1;
+            runahead->job_pending = true;
+            runahead->job_done = false;
+        }
+        runahead->wake.notify_all();
+
+        result = keys ? chip8_run_frame_keys(chip8, config, keys) : chip8_run_frame(chip8, config);
+        runahead->real_ns += chip8_runahead_now_ns() - start_ns;
+
+        std::unique_lock<std::mutex> guard(runahead->lock);
+        runahead->wake.wait(guard, [runahead] { return runahead->job_done; });
+    }
+    else
+    {
+        result = keys ? chip8_run_frame_keys(chip8, config, keys) : chip8_run_frame(chip8, config);
+        runahead->real_ns += chip8_runahead_now_ns() - start_ns;
+
+        chip8_snapshot(chip8, &runahead->start);
+        chip8_runahead_speculate(runahead, config, runahead->frames, NULL);
+    }
+
+    runahead->host_frames++;
+    if (memcmp(runahead->presented, runahead->shadow->video, sizeof(runahead->presented)) != 0)
+    {
+        memcpy(runahead->presented, runahead->shadow->video, sizeof(runahead->presented));
+        result.events |= CHIP8_EVENT_DRAW;
+    }
+    return result;
+}
+
+// extra cpu time run-ahead costs, as a share of running the real frames alone
+inline double chip8_runahead_overhead(const CHIP8_RUNAHEAD* runahead)
+{
+    return runahead->real_ns > 0 ? (double) (runahead->speculative_ns + runahead->restore_ns) / runahead->real_ns : 0.0;
+}
+
+inline void chip8_runahead_print_stats(const CHIP8_RUNAHEAD* runahead)
+{
+    if (runahead->host_frames == 0)
+    {
+        return;
+    }
+
+    printf("run-ahead:    %u frames%s, real %.1f us, speculative %.1f us, restore %.1f us per frame (+%.0f%% cpu)\n",
+           runahead->frames, runahead->threaded ? " on a second thread" : "",
+           runahead->real_ns / 1000.0 / runahead->host_frames, runahead->speculative_ns / 1000.0 / runahead->host_frames,
+           runahead->restore_ns / 1000.0 / runahead->host_frames, chip8_runahead_overhead(runahead) * 100.0);
+}
+
+
+#endif //CHIP8_RUNAHEAD_H
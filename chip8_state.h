@@ -0,0 +1,429 @@
+﻿#ifndef CHIP8_STATE_H
+#define CHIP8_STATE_H
+
+#include "chip8.h"
+
+
+/*** SAVE STATES ***/
+/*
+ chip8_snapshot copies the whole machine (registers, stack, timers, random state, quirks, keys, display, memory)
+ into a CHIP8_SNAPSHOT and chip8_restore puts it back, neither allocates. The decode cache and any code cache
+ (blocks, jit, aot) stay attached to the machine, restore only re-decodes and invalidates the 64 byte lines of
+ memory that are different, so a restore costs about as much as the copy.
+
+ chip8_state_encode/decode turn a snapshot into a compact versioned binary (see STATE FILE) and back,
+ chip8_save_state/chip8_load_state do the same to a file.
+
+ USAGE:
+    CHIP8_SNAPSHOT snapshot;
+    chip8_snapshot(chip8, &snapshot);
+    ... run ...
+    chip8_restore(chip8, &snapshot);
+
+    chip8_save_state(chip8, rom, rom_size, "tetris.c8state");
+    chip8_load_state(chip8, rom, rom_size, "tetris.c8state");
+ */
+
+typedef struct CHIP8_SNAPSHOT
+{
+    CHIP8 state; // decoded and code_cache are always NULL
+} CHIP8_SNAPSHOT;
+
+#define CHIP8_STATE_LINE 64 // memory is compared, stored and re-decoded in lines this big
+#define CHIP8_STATE_LINES (4096 / CHIP8_STATE_LINE)
+
+static_assert(CHIP8_STATE_LINES == 64, "the state file keeps one bit per memory line in a uint64_t");
+
+inline void chip8_snapshot(const CHIP8* chip8, CHIP8_SNAPSHOT* snapshot)
+{
+    memcpy(&snapshot->state, chip8, sizeof(CHIP8));
+    snapshot->state.decoded = NULL;
+    snapshot->state.code_cache = NULL;
+}
+
+inline void chip8_restore(CHIP8* chip8, const CHIP8_SNAPSHOT* snapshot)
+{
+    const CHIP8* state = &snapshot->state;
+    bool same_quirks = state->quirks == chip8->quirks;
+
+    // memory a line at a time, lines that are already the same keep their decoded records and translated code
+    for (unsigned int address = 0; address < sizeof(chip8->memory); address += CHIP8_STATE_LINE)
+    {
+        if (memcmp(&chip8->memory[address], &state->memory[address], CHIP8_STATE_LINE) != 0)
+        {
+            memcpy(&chip8->memory[address], &state->memory[address], CHIP8_STATE_LINE);
+            if (same_quirks)
+            {
+                chip8_code_written(chip8, address, CHIP8_STATE_LINE);
+            }
+        }
+    }
+
+    // everything in front of memory, the attachments are put back afterwards
+    static_assert(offsetof(CHIP8, memory) + sizeof(CHIP8::memory) + CHIP8_CACHE_LINE > sizeof(CHIP8), "memory must be the last field of CHIP8");
+    CHIP8_INSTR* decoded = chip8->decoded;
+    CHIP8_CODE_CACHE* code_cache = chip8->code_cache;
+    memcpy(chip8, state, offsetof(CHIP8, memory));
+    chip8->decoded = decoded;
+    chip8->code_cache = code_cache;
+
+    if (!same_quirks)
+    {
+        // every record changes handler, rebuild them all
+        chip8_set_quirks(chip8, state->quirks);
+    }
+}
+
+
+/*** STATE FILE ***/
+/*
+ Little endian, no padding:
+    u32  magic "C8ST"
+    u16  version
+    u64  rom hash (FNV-1a of the rom bytes), loading checks it against the rom it is given
+    u64  line mask, bit n set when memory line n (64 bytes) is different from the rom image and is stored
+    u16  pc, I, sp, opcode (pc and I 0x000-0xFFF, sp 0-16)
+    u8   V0-VF
+    u16  stack[16]
+    u64  timer ticks, delay set tick, sound set tick
+    u8   delay set value, sound set value, quirks profile, events, waiting for a key, key waited on (0x0-0xF or none)
+    u64  random state, idle skipped
+    u8   keypad[16]
+    u64  display rows[32]
+    ...  the stored memory lines, lowest address first
+    u32  CRC-32 of everything before it
+ The rom image is what chip8_init plus chip8_load_rom_memory put in memory (fontset and rom), so a state taken
+ while a rom runs only stores the few lines it wrote to (stack, variables, self modified code).
+ The machine only ever uses pc and I within memory and sp within the stack, so they are stored that way, and a
+ file with them (or the key waited on) out of range is rejected instead of indexing past the arrays.
+ */
+
+#define CHIP8_STATE_MAGIC 0x54533843u // "C8ST"
+#define CHIP8_STATE_VERSION 1
+#define CHIP8_STATE_MAX_SIZE (512 + 4096) // fixed fields and every memory line
+
+enum CHIP8_STATE_RESULT
+{
+    CHIP8_STATE_OK,
+    CHIP8_STATE_BAD_SIZE,
+    CHIP8_STATE_BAD_MAGIC,
+    CHIP8_STATE_BAD_VERSION,
+    CHIP8_STATE_BAD_CHECKSUM,
+    CHIP8_STATE_WRONG_ROM,
+    CHIP8_STATE_BAD_VALUE,
+    CHIP8_STATE_RESULT_COUNT,
+};
+
+inline const char* const chip8_state_result_names[CHIP8_STATE_RESULT_COUNT] = {
+    "ok", "wrong size", "not a state file", "unsupported version", "checksum mismatch", "made with a different rom",
+    "register out of range"};
+
+inline constexpr std::array<uint32_t, 256> chip8_crc32_table = []
+{
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ ((crc & 1u) ? 0xEDB88320u : 0u);
+        }
+        table[i] = crc;
+    }
+    return table;
+}();
+
+// standard CRC-32 (zlib, png)
+inline uint32_t chip8_crc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = chip8_crc32_table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+inline uint64_t chip8_rom_hash(const uint8_t* rom, unsigned int rom_size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned int i = 0; i < rom_size; i++)
+    {
+        hash ^= rom[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// memory straight after chip8_init and chip8_load_rom_memory
+inline void chip8_rom_image(const uint8_t* rom, unsigned int rom_size, uint8_t* memory)
+{
+    memset(memory, 0, 4096);
+    memcpy(&memory[FONTSET_START_ADDRESS], fontset, FONTSET_SIZE);
+    if (rom_size > 4096 - START_ADDRESS)
+    {
+        rom_size = 4096 - START_ADDRESS;
+    }
+    memcpy(&memory[START_ADDRESS], rom, rom_size);
+}
+
+// a position in a state buffer, reads and writes past the end set overflow
+typedef struct CHIP8_STATE_CURSOR
+{
+    uint8_t* data;
+    size_t size;
+    size_t used;
+    bool overflow;
+} CHIP8_STATE_CURSOR;
+
+inline void chip8_state_put(CHIP8_STATE_CURSOR* cursor, uint64_t value, unsigned int bytes)
+{
+    if (cursor->used + bytes > cursor->size)
+    {
+        cursor->overflow = true;
+        return;
+    }
+    for (unsigned int i = 0; i < bytes; i++)
+    {
+        cursor->data[cursor->used++] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+inline uint64_t chip8_state_get(CHIP8_STATE_CURSOR* cursor, unsigned int bytes)
+{
+    if (cursor->used + bytes > cursor->size)
+    {
+        cursor->overflow = true;
+        return 0;
+    }
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t) cursor->data[cursor->used++] << (8 * i);
+    }
+    return value;
+}
+
+// Writes the snapshot into out, returns the bytes used or 0 if capacity is too small (CHIP8_STATE_MAX_SIZE always fits).
+// rom is the rom the machine was loaded with, memory is stored as the lines that differ from it
+inline size_t chip8_state_encode(const CHIP8_SNAPSHOT* snapshot, const uint8_t* rom, unsigned int rom_size,
+                                 uint8_t* out, size_t capacity)
+{
+    const CHIP8* state = &snapshot->state;
+    uint8_t image[4096];
+    chip8_rom_image(rom, rom_size, image);
+
+    uint64_t line_mask = 0;
+    for (unsigned int line = 0; line < CHIP8_STATE_LINES; line++)
+    {
+        if (memcmp(&state->memory[line * CHIP8_STATE_LINE], &image[line * CHIP8_STATE_LINE], CHIP8_STATE_LINE) != 0)
+        {
+            line_mask |= 1ull << line;
+        }
+    }
+
+    CHIP8_STATE_CURSOR cursor = {out, capacity, 0, false};
+    chip8_state_put(&cursor, CHIP8_STATE_MAGIC, 4);
+    chip8_state_put(&cursor, CHIP8_STATE_VERSION, 2);
+    chip8_state_put(&cursor, chip8_rom_hash(rom, rom_size), 8);
+    chip8_state_put(&cursor, line_mask, 8);
+
+    // every use masks these the same way, so the machine loaded back runs exactly the same
+    chip8_state_put(&cursor, state->pc & 0x0FFFu, 2);
+    chip8_state_put(&cursor, state->index & 0x0FFFu, 2);
+    chip8_state_put(&cursor, state->sp & 0x0Fu, 2);
+    chip8_state_put(&cursor, state->opcode, 2);
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        chip8_state_put(&cursor, state->registers[i], 1);
+    }
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        chip8_state_put(&cursor, state->stack[i], 2);
+    }
+    chip8_state_put(&cursor, state->timer_ticks, 8);
+    chip8_state_put(&cursor, state->delay_set_tick, 8);
+    chip8_state_put(&cursor, state->sound_set_tick, 8);
+    chip8_state_put(&cursor, state->delay_set_value, 1);
+    chip8_state_put(&cursor, state->sound_set_value, 1);
+    chip8_state_put(&cursor, state->quirks, 1);
+    chip8_state_put(&cursor, state->events, 1);
+    chip8_state_put(&cursor, state->waiting_key, 1);
+    chip8_state_put(&cursor, state->wait_key, 1);
+    chip8_state_put(&cursor, state->random_state, 8);
+    chip8_state_put(&cursor, state->idle_skipped, 8);
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        chip8_state_put(&cursor, state->keypad[i], 1);
+    }
+    for (unsigned int row = 0; row < VIDEO_HEIGHT; row++)
+    {
+        chip8_state_put(&cursor, state->video[row], 8);
+    }
+
+    for (unsigned int line = 0; line < CHIP8_STATE_LINES; line++)
+    {
+        if (line_mask & (1ull << line))
+        {
+            for (unsigned int i = 0; i < CHIP8_STATE_LINE; i++)
+            {
+                chip8_state_put(&cursor, state->memory[line * CHIP8_STATE_LINE + i], 1);
+            }
+        }
+    }
+
+    if (cursor.overflow)
+    {
+        return 0;
+    }
+    chip8_state_put(&cursor, chip8_crc32(out, cursor.used), 4);
+    return cursor.overflow ? 0 : cursor.used;
+}
+
+// Fills the snapshot from an encoded state, rom has to be the rom the state was saved with.
+// The snapshot is only written when the whole state checks out
+inline CHIP8_STATE_RESULT chip8_state_decode(CHIP8_SNAPSHOT* snapshot, const uint8_t* rom, unsigned int rom_size,
+                                             const uint8_t* data, size_t size)
+{
+    if (size < 4 + 2 + 4)
+    {
+        return CHIP8_STATE_BAD_SIZE;
+    }
+
+    CHIP8_STATE_CURSOR cursor = {(uint8_t*) data, size - 4, 0, false};
+    if (chip8_state_get(&cursor, 4) != CHIP8_STATE_MAGIC)
+    {
+        return CHIP8_STATE_BAD_MAGIC;
+    }
+    if (chip8_state_get(&cursor, 2) != CHIP8_STATE_VERSION)
+    {
+        return CHIP8_STATE_BAD_VERSION;
+    }
+
+    CHIP8_STATE_CURSOR crc_cursor = {(uint8_t*) data, size, size - 4, false};
+    if (chip8_state_get(&crc_cursor, 4) != chip8_crc32(data, size - 4))
+    {
+        return CHIP8_STATE_BAD_CHECKSUM;
+    }
+    if (chip8_state_get(&cursor, 8) != chip8_rom_hash(rom, rom_size))
+    {
+        return CHIP8_STATE_WRONG_ROM;
+    }
+    uint64_t line_mask = chip8_state_get(&cursor, 8);
+
+    CHIP8 state;
+    memset(&state, 0, sizeof(state));
+    state.pc = (uint16_t) chip8_state_get(&cursor, 2);
+    state.index = (uint16_t) chip8_state_get(&cursor, 2);
+    state.sp = (uint16_t) chip8_state_get(&cursor, 2);
+    state.opcode = (uint16_t) chip8_state_get(&cursor, 2);
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        state.registers[i] = (uint8_t) chip8_state_get(&cursor, 1);
+    }
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        state.stack[i] = (uint16_t) chip8_state_get(&cursor, 2);
+    }
+    state.timer_ticks = chip8_state_get(&cursor, 8);
+    state.delay_set_tick = chip8_state_get(&cursor, 8);
+    state.sound_set_tick = chip8_state_get(&cursor, 8);
+    state.delay_set_value = (uint8_t) chip8_state_get(&cursor, 1);
+    state.sound_set_value = (uint8_t) chip8_state_get(&cursor, 1);
+    state.quirks = (uint8_t) chip8_state_get(&cursor, 1);
+    state.events = (uint8_t) chip8_state_get(&cursor, 1);
+    state.waiting_key = chip8_state_get(&cursor, 1) != 0;
+    state.wait_key = (uint8_t) chip8_state_get(&cursor, 1);
+    state.random_state = chip8_state_get(&cursor, 8);
+    state.idle_skipped = chip8_state_get(&cursor, 8);
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        state.keypad[i] = (uint8_t) chip8_state_get(&cursor, 1);
+    }
+    for (unsigned int row = 0; row < VIDEO_HEIGHT; row++)
+    {
+        state.video[row] = chip8_state_get(&cursor, 8);
+    }
+
+    chip8_rom_image(rom, rom_size, state.memory);
+    for (unsigned int line = 0; line < CHIP8_STATE_LINES; line++)
+    {
+        if (line_mask & (1ull << line))
+        {
+            for (unsigned int i = 0; i < CHIP8_STATE_LINE; i++)
+            {
+                state.memory[line * CHIP8_STATE_LINE + i] = (uint8_t) chip8_state_get(&cursor, 1);
+            }
+        }
+    }
+
+    if (cursor.overflow || cursor.used != cursor.size)
+    {
+        return CHIP8_STATE_BAD_SIZE;
+    }
+    if (state.pc > 0x0FFFu || state.index > 0x0FFFu || state.sp > 16 || (state.wait_key > 0x0Fu && state.wait_key != CHIP8_NO_KEY))
+    {
+        return CHIP8_STATE_BAD_VALUE;
+    }
+    if (state.quirks >= CHIP8_PROFILE_COUNT)
+    {
+        state.quirks = CHIP8_PROFILE_DEFAULT;
+    }
+
+    snapshot->state = state;
+    return CHIP8_STATE_OK;
+}
+
+inline bool chip8_save_state(const CHIP8* chip8, const uint8_t* rom, unsigned int rom_size, const char* filename)
+{
+    CHIP8_SNAPSHOT snapshot;
+    chip8_snapshot(chip8, &snapshot);
+
+    uint8_t data[CHIP8_STATE_MAX_SIZE];
+    size_t size = chip8_state_encode(&snapshot, rom, rom_size, data, sizeof(data));
+
+    FILE* state_file = fopen(filename, "wb");
+    if (!state_file || size == 0 || fwrite(data, size, 1, state_file) != 1)
+    {
+        if (state_file)
+        {
+            fclose(state_file);
+        }
+        printf("ERROR CANNOT WRITE STATE FILE %s\n", filename);
+        return false;
+    }
+    fclose(state_file);
+    return true;
+}
+
+// the machine is only changed if the file is a good state for this rom
+inline bool chip8_load_state(CHIP8* chip8, const uint8_t* rom, unsigned int rom_size, const char* filename)
+{
+    FILE* state_file = fopen(filename, "rb");
+    if (!state_file)
+    {
+        printf("ERROR CANNOT READ STATE FILE %s\n", filename);
+        return false;
+    }
+
+    // one byte more than the biggest state so a longer file shows up as bad instead of being cut off
+    uint8_t data[CHIP8_STATE_MAX_SIZE + 1];
+    size_t size = fread(data, 1, sizeof(data), state_file);
+    fclose(state_file);
+
+    CHIP8_SNAPSHOT snapshot;
+    CHIP8_STATE_RESULT result = size <= CHIP8_STATE_MAX_SIZE
+                                    ? chip8_state_decode(&snapshot, rom, rom_size, data, size)
+                                    : CHIP8_STATE_BAD_SIZE;
+    if (result != CHIP8_STATE_OK)
+    {
+        printf("ERROR BAD STATE FILE %s (%s)\n", filename, chip8_state_result_names[result]);
+        return false;
+    }
+
+    chip8_restore(chip8, &snapshot);
+    return true;
+}
+
+
+#endif //CHIP8_STATE_H
@@ -0,0 +1,105 @@
+﻿#include "chip8_trace.h"
+
+#include <stdio.h>
+
+#if CHIP8_TRACE_LEVEL > 0
+
+#include <chrono>
+#include <thread>
+
+static FILE* trace_file = NULL;
+static std::thread trace_writer;
+static std::atomic<bool> trace_running = false;
+
+// Consumer side, copies whatever the emulator pushed straight to the file
+static void trace_drain()
+{
+    CHIP8_TRACE_RING* ring = &chip8_trace_ring;
+
+    while (true)
+    {
+        bool running = trace_running.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        if (head == tail)
+        {
+            if (!running)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        // up to the end of the ring in one write, the wrapped part goes next time around
+        uint64_t start = tail & (TRACE_RING_SIZE - 1);
+        uint64_t count = head - tail;
+        if (start + count > TRACE_RING_SIZE)
+        {
+            count = TRACE_RING_SIZE - start;
+        }
+        fwrite(&ring->records[start], sizeof(CHIP8_TRACE_RECORD), count, trace_file);
+        ring->tail.store(tail + count, std::memory_order_release);
+    }
+}
+
+bool chip8_trace_open(const char* path)
+{
+    if (trace_file)
+    {
+        chip8_trace_close();
+    }
+
+    trace_file = fopen(path, "wb");
+    if (!trace_file)
+    {
+        return false;
+    }
+
+    CHIP8_TRACE_FILE_HEADER header = {TRACE_FILE_MAGIC, TRACE_FILE_VERSION, sizeof(CHIP8_TRACE_RECORD)};
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    CHIP8_TRACE_RING* ring = &chip8_trace_ring;
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->sequence = 0;
+    ring->dropped = 0;
+
+    trace_running.store(true);
+    trace_writer = std::thread(trace_drain);
+    ring->active.store(true, std::memory_order_release);
+    return true;
+}
+
+uint64_t chip8_trace_close()
+{
+    if (!trace_file)
+    {
+        return 0;
+    }
+
+    CHIP8_TRACE_RING* ring = &chip8_trace_ring;
+    ring->active.store(false);
+    trace_running.store(false, std::memory_order_release);
+    trace_writer.join();
+
+    fclose(trace_file);
+    trace_file = NULL;
+    return ring->dropped;
+}
+
+#else
+
+bool chip8_trace_open(const char* path)
+{
+    (void) path;
+    return false;
+}
+
+uint64_t chip8_trace_close()
+{
+    return 0;
+}
+
+#endif
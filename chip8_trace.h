@@ -0,0 +1,135 @@
+﻿#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+
+/*** TRACE ***/
+/*
+ Compile time trace levels, picked with the CHIP8_TRACE cmake option (CHIP8_TRACE_LEVEL in code):
+    0  off, every trace call compiles to nothing
+    1  events: unknown opcodes, the sound timer running out
+    2  events and every instruction run by the interpreter loops (switch, table, cached)
+ When enabled, records are pushed into a lock-free single producer/single consumer ring and a background thread
+ writes them to a binary file. The emulator never waits on it, if the ring is full the record is dropped
+ (the sequence number shows the gap). chip8_trace_decode prints a trace file as text.
+
+ USAGE:
+    chip8_trace_open("run.c8trace");
+    ... run ...
+    chip8_trace_close();
+ */
+
+#ifndef CHIP8_TRACE_LEVEL
+#define CHIP8_TRACE_LEVEL 0
+#endif
+
+enum CHIP8_TRACE_LEVELS
+{
+    CHIP8_TRACE_OFF = 0,
+    CHIP8_TRACE_EVENTS = 1,
+    CHIP8_TRACE_INSTRUCTIONS = 2,
+};
+
+enum CHIP8_TRACE_KIND : uint8_t
+{
+    CHIP8_TRACE_INSTR,
+    CHIP8_TRACE_UNKNOWN_OPCODE,
+    CHIP8_TRACE_BEEP,
+};
+
+typedef struct CHIP8_TRACE_RECORD
+{
+    uint64_t sequence;
+    uint16_t pc; // address of the instruction
+    uint16_t opcode;
+    uint16_t index;
+    uint8_t sp;
+    uint8_t kind; // CHIP8_TRACE_KIND
+} CHIP8_TRACE_RECORD;
+
+static_assert(sizeof(CHIP8_TRACE_RECORD) == 16, "trace records are written to disk as is");
+
+#define TRACE_FILE_MAGIC 0x52543843u // "C8TR"
+#define TRACE_FILE_VERSION 1
+
+typedef struct CHIP8_TRACE_FILE_HEADER
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+} CHIP8_TRACE_FILE_HEADER;
+
+// Starts the writer thread, false if tracing is compiled out or the file can't be opened
+bool chip8_trace_open(const char* path);
+// Writes out what is left and stops the writer thread, returns the records that were dropped
+uint64_t chip8_trace_close();
+
+
+#if CHIP8_TRACE_LEVEL > 0
+
+#define TRACE_RING_SIZE 65536 // records, power of two
+
+typedef struct CHIP8_TRACE_RING
+{
+    alignas(64) std::atomic<uint64_t> head; // next slot the emulator writes
+    alignas(64) std::atomic<uint64_t> tail; // next slot the writer thread reads
+    alignas(64) std::atomic<bool> active;
+    uint64_t sequence; // only touched by the emulator
+    uint64_t dropped;
+    CHIP8_TRACE_RECORD records[TRACE_RING_SIZE];
+} CHIP8_TRACE_RING;
+
+inline CHIP8_TRACE_RING chip8_trace_ring;
+
+// Producer side, the emulator thread is the only caller
+inline void chip8_trace_push(CHIP8_TRACE_KIND kind, uint16_t pc, uint16_t opcode, uint16_t index, uint8_t sp)
+{
+    CHIP8_TRACE_RING* ring = &chip8_trace_ring;
+    if (!ring->active.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    uint64_t sequence = ring->sequence++;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= TRACE_RING_SIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    CHIP8_TRACE_RECORD* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->sequence = sequence;
+    record->pc = pc;
+    record->opcode = opcode;
+    record->index = index;
+    record->sp = sp;
+    record->kind = kind;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+#endif
+
+// Level is the least CHIP8_TRACE_LEVEL the record is compiled in at
+template <int Level>
+inline void chip8_trace(CHIP8_TRACE_KIND kind, uint16_t pc, uint16_t opcode, uint16_t index, uint8_t sp)
+{
+#if CHIP8_TRACE_LEVEL > 0
+    if constexpr (Level <= CHIP8_TRACE_LEVEL)
+    {
+        chip8_trace_push(kind, pc, opcode, index, sp);
+    }
+#else
+    (void) kind;
+    (void) pc;
+    (void) opcode;
+    (void) index;
+    (void) sp;
+#endif
+}
+
+
+#endif //CHIP8_TRACE_H
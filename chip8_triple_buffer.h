@@ -0,0 +1,117 @@
+﻿#ifndef CHIP8_TRIPLE_BUFFER_H
+#define CHIP8_TRIPLE_BUFFER_H
+
+#include <atomic>
+
+#include "chip8.h"
+
+
+/*** TRIPLE BUFFER ***/
+/*
+ Hands finished frames from the emulation thread to the render thread without either one waiting on the other.
+ There are three slots: the writer fills the back one, the reader shows the front one, and the middle one holds the
+ newest finished frame. Publishing swaps back and middle, picking up swaps middle and front, each with one atomic
+ exchange on the middle index, so neither side ever sees a slot the other is writing (no tearing, no locks).
+ The reader always gets the newest frame. Frames the writer replaced before the reader took them are dropped,
+ and a pick up with nothing new shows the same frame again (duplicated).
+
+ USAGE:
+    CHIP8_TRIPLE_BUFFER frames;
+    chip8_triple_buffer_init(&frames);
+    ... emulation thread, after each frame ...
+    CHIP8_PRESENT_FRAME* back = chip8_triple_buffer_back(&frames);
+    memcpy(back->video, chip8->video, sizeof(back->video));
+    chip8_triple_buffer_publish(&frames);
+    ... render thread, each present ...
+    bool fresh;
+    const CHIP8_PRESENT_FRAME* frame = chip8_triple_buffer_acquire(&frames, &fresh);
+ */
+
+#define CHIP8_TRIPLE_FRESH 0x4u // set in middle while it holds a frame the reader hasn't taken
+
+// cache line aligned so the slot being written and the slot being read never share a line
+typedef struct alignas(CHIP8_CACHE_LINE) CHIP8_PRESENT_FRAME
+{
+    uint64_t video[VIDEO_HEIGHT];
+    uint64_t frame; // timer_ticks of the machine it came from
+    bool halted; // waiting on Fx0A with the timers stopped, nothing changes until a key does
+} CHIP8_PRESENT_FRAME;
+
+typedef struct CHIP8_TRIPLE_BUFFER
+{
+    CHIP8_PRESENT_FRAME slots[3];
+
+    alignas(CHIP8_CACHE_LINE) std::atomic<uint8_t> middle; // slot index | CHIP8_TRIPLE_FRESH
+
+    // writer side
+    alignas(CHIP8_CACHE_LINE) uint8_t back;
+    std::atomic<uint64_t> produced;
+    std::atomic<uint64_t> dropped; // published then replaced before the reader took them
+
+    // reader side
+    alignas(CHIP8_CACHE_LINE) uint8_t front;
+    std::atomic<uint64_t> consumed;
+    std::atomic<uint64_t> duplicated; // pick ups that had nothing new
+} CHIP8_TRIPLE_BUFFER;
+
+inline void chip8_triple_buffer_init(CHIP8_TRIPLE_BUFFER* buffer)
+{
+    memset(buffer->slots, 0, sizeof(buffer->slots));
+    buffer->front = 0;
+    buffer->middle.store(1);
+    buffer->back = 2;
+    buffer->produced.store(0);
+    buffer->dropped.store(0);
+    buffer->consumed.store(0);
+    buffer->duplicated.store(0);
+}
+
+// writer only, the slot to fill next
+inline CHIP8_PRESENT_FRAME* chip8_triple_buffer_back(CHIP8_TRIPLE_BUFFER* buffer)
+{
+    return &buffer->slots[buffer->back];
+}
+
+// writer only, makes the back slot the newest frame
+inline void chip8_triple_buffer_publish(CHIP8_TRIPLE_BUFFER* buffer)
+{
+    uint8_t previous = buffer->middle.exchange((uint8_t) (buffer->back | CHIP8_TRIPLE_FRESH));
+    if (previous & CHIP8_TRIPLE_FRESH)
+    {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    buffer->back = previous & 0x3u;
+    buffer->produced.fetch_add(1, std::memory_order_relaxed);
+}
+
+// reader only, true if a frame was published since the last chip8_triple_buffer_acquire
+inline bool chip8_triple_buffer_fresh(const CHIP8_TRIPLE_BUFFER* buffer)
+{
+    return (buffer->middle.load() & CHIP8_TRIPLE_FRESH) != 0;
+}
+
+// reader only, the newest frame. It stays valid until the next call, fresh says if it's a new one
+inline const CHIP8_PRESENT_FRAME* chip8_triple_buffer_acquire(CHIP8_TRIPLE_BUFFER* buffer, bool* fresh)
+{
+    *fresh = chip8_triple_buffer_fresh(buffer);
+    if (*fresh)
+    {
+        buffer->front = buffer->middle.exchange(buffer->front) & 0x3u;
+        buffer->consumed.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        buffer->duplicated.fetch_add(1, std::memory_order_relaxed);
+    }
+    return &buffer->slots[buffer->front];
+}
+
+inline void chip8_triple_buffer_print_stats(const CHIP8_TRIPLE_BUFFER* buffer)
+{
+    printf("frames:       %llu produced, %llu presented, %llu dropped, %llu shown twice\n",
+           (unsigned long long) buffer->produced.load(), (unsigned long long) buffer->consumed.load(),
+           (unsigned long long) buffer->dropped.load(), (unsigned long long) buffer->duplicated.load());
+}
+
+
+#endif //CHIP8_TRIPLE_BUFFER_H
@@ -0,0 +1,459 @@
+﻿#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_audio.h"
+#include "chip8_blocks.h"
+#include "chip8_jit.h"
+#include "chip8_replay.h"
+#include "chip8_rewind.h"
+#include "chip8_runahead.h"
+#include "chip8_state.h"
+#include "clock.h"
+
+
+//COMMAND LINE USAGE: ./chip8_headless <ROM> [--cycles N] [--frames N] [--ipf N] [--vblank] [--dispatch switch|table|cached|run|blocks|jit] [--trace FILE] [--realtime] [--seed N] [--quirks default|vip|chip48|schip] [--load-state FILE] [--save-state FILE] [--rewind N] [--replay FILE [--seek FRAME]] [--runahead N [--runahead-thread]] [--audio null|FILE.wav [--audio-buffer N]]
+// runs the interpreter at full speed without a window and reports throughput and the final display hash
+
+static void print_usage()
+{
+    printf("usage: chip8_headless <ROM> [--cycles N] [--frames N] [--ipf N] [--vblank] [--dispatch switch|table|cached|run|blocks|jit] [--trace FILE] [--realtime] [--seed N] [--quirks default|vip|chip48|schip] [--load-state FILE] [--save-state FILE] [--rewind N] [--replay FILE [--seek FRAME]] [--runahead N [--runahead-thread]] [--audio null|FILE.wav [--audio-buffer N]]\n");
+    printf("  --cycles N   number of instructions to run, rounded up to whole frames (default 1000000)\n");
+    printf("  --frames N   number of 60hz frames to run instead of a cycle count\n");
+    printf("  --ipf N      instructions per frame, the timers tick once per frame (default %d)\n", CHIP8_DEFAULT_IPF);
+    printf("  --vblank     display wait quirk, a draw ends the frame (always runs the interpreter)\n");
+    printf("  --dispatch   execution engine, switch, table, cached, run, blocks or jit (default switch)\n");
+    printf("  --trace FILE write a binary trace (needs a CHIP8_TRACE build), read it with chip8_trace_decode\n");
+    printf("  --realtime   run frames at 60hz like the frontend instead of flat out, and report the frame pacing\n");
+    printf("  --quirks P   behaviour profile: default, vip (COSMAC VIP), chip48 or schip (SUPER-CHIP 1.1)\n");
+    printf("  --seed N     seed for the Cxkk random numbers, the same seed gives the same run (default %u)\n", CHIP8_DEFAULT_SEED);
+    printf("  --load-state FILE  start from a save state made with the same rom instead of power on\n");
+    printf("  --save-state FILE  save the machine when the run ends\n");
+    printf("  --replay FILE      play back a recorded session (seed, quirks, ipf and keys come from the file) as fast as possible\n");
+    printf("  --seek FRAME       with --replay, start from this frame of the recording\n");
+    printf("  --rewind N   record every frame in the rewind buffer, then step back N frames at the end and report its cost\n");
+    printf("  --runahead N run N speculative frames past every real one like the frontend does, and report the extra cpu time\n");
+    printf("  --runahead-thread  run the speculative frames on a second thread\n");
+    printf("  --audio OUT  make the sound timer's tone, null throws it away, a .wav file keeps it. With --realtime a device\n");
+    printf("               thread takes it at the sample rate and the latency and underruns are reported\n");
+    printf("  --audio-buffer N   audio ring size in samples, rounded up to a power of two (default %u)\n", chip8_audio_config_default().buffer_samples);
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    data.resize(size > 0 ? size : 0);
+    size_t read = data.empty() ? 0 : fread(data.data(), data.size(), 1, file);
+    fclose(file);
+    return data.empty() || read == 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    const char* rom_path = argv[1];
+    uint64_t cycles = 1000000;
+    uint64_t frames = 0;
+    CHIP8_FRAME_CONFIG config = chip8_frame_config_default();
+    config.engine = chip8_run_switch;
+    bool blocks = false; // block engine, needs its cache attached first
+    bool jit = false; // same for the jit
+    const char* trace_path = nullptr;
+    bool realtime = false;
+    uint64_t seed = CHIP8_DEFAULT_SEED;
+    uint8_t quirks = CHIP8_PROFILE_DEFAULT;
+    const char* load_state_path = nullptr;
+    const char* save_state_path = nullptr;
+    bool rewind_enabled = false;
+    const char* replay_path = nullptr;
+    uint64_t seek_frame = 0;
+    uint32_t rewind_frames = 0;
+    bool runahead_enabled = false;
+    uint32_t runahead_frames = 0;
+    bool runahead_threaded = false;
+    const char* audio_path = nullptr;
+    CHIP8_AUDIO_CONFIG audio_config = chip8_audio_config_default();
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+        {
+            cycles = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            frames = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            config.instructions_per_frame = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--vblank") == 0)
+        {
+            config.vblank_wait = true;
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            quirks = chip8_profile_from_name(argv[++i]);
+            if (quirks == CHIP8_PROFILE_COUNT)
+            {
+                print_usage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+        {
+            load_state_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc)
+        {
+            save_state_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replay_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc)
+        {
+            seek_frame = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc)
+        {
+            rewind_frames = (uint32_t) strtoul(argv[++i], nullptr, 10);
+            rewind_enabled = true;
+        }
+        else if (strcmp(argv[i], "--runahead") == 0 && i + 1 < argc)
+        {
+            runahead_frames = (uint32_t) strtoul(argv[++i], nullptr, 10);
+            runahead_enabled = true;
+        }
+        else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc)
+        {
+            audio_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc)
+        {
+            audio_config.buffer_samples = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--runahead-thread") == 0)
+        {
+            runahead_threaded = true;
+        }
+        else if (strcmp(argv[i], "--realtime") == 0)
+        {
+            realtime = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--dispatch") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            if (strcmp(name, "switch") == 0)
+            {
+                config.engine = chip8_run_switch;
+            }
+            else if (strcmp(name, "table") == 0)
+            {
+                config.engine = chip8_run_table;
+            }
+            else if (strcmp(name, "cached") == 0)
+            {
+                config.engine = chip8_run_cached;
+            }
+            else if (strcmp(name, "run") == 0)
+            {
+                config.engine = NULL;
+            }
+            else if (strcmp(name, "blocks") == 0)
+            {
+                config.engine = chip8_run_blocks;
+                blocks = true;
+            }
+            else if (strcmp(name, "jit") == 0)
+            {
+                config.engine = chip8_run_jit;
+                jit = true;
+            }
+            else
+            {
+                print_usage();
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (config.instructions_per_frame == 0)
+    {
+        print_usage();
+        return 1;
+    }
+    if (frames > 0)
+    {
+        cycles = frames * config.instructions_per_frame;
+    }
+
+    // a replay brings the settings it was recorded with
+    CHIP8_REPLAY replay;
+    if (replay_path)
+    {
+        if (!chip8_replay_load(&replay, replay_path))
+        {
+            return 1;
+        }
+        seed = replay.info.seed;
+        quirks = replay.info.quirks;
+        config = chip8_replay_frame_config(&replay, config.engine);
+    }
+
+    CHIP8* chip8 = chip8_init(seed);
+    if (!chip8)
+    {
+        printf("ERROR CANNOT ALLOCATE MACHINE\n");
+        return 1;
+    }
+    chip8_set_quirks(chip8, quirks);
+    if (!chip8_load_rom(chip8, rom_path))
+    {
+        chip8_free(chip8);
+        return 1;
+    }
+
+    if (blocks)
+    {
+        chip8_blocks_attach(chip8);
+    }
+    if (jit && !chip8_jit_attach(chip8))
+    {
+        printf("jit not supported on this machine, using the interpreter\n");
+        config.engine = chip8_run_cached;
+    }
+
+    // save states and replay keyframes store memory as the lines that differ from the rom, so they need the rom bytes
+    std::vector<uint8_t> rom;
+    if ((load_state_path || save_state_path || replay_path) && !read_file(rom_path, rom))
+    {
+        printf("ERROR CANNOT READ ROM FILE\n");
+        chip8_free(chip8);
+        return 1;
+    }
+    if (load_state_path && !chip8_load_state(chip8, rom.data(), (unsigned int) rom.size(), load_state_path))
+    {
+        chip8_free(chip8);
+        return 1;
+    }
+
+    if (replay_path && chip8_rom_hash(rom.data(), (unsigned int) rom.size()) != replay.info.rom_hash)
+    {
+        printf("ERROR REPLAY %s WAS RECORDED WITH A DIFFERENT ROM\n", replay_path);
+        chip8_free(chip8);
+        return 1;
+    }
+
+    if (trace_path && !chip8_trace_open(trace_path))
+    {
+        printf("could not trace to %s (tracing is compiled in with -DCHIP8_TRACE=1 or 2)\n", trace_path);
+    }
+
+    CHIP8_REWIND rewind;
+    if (rewind_enabled && !chip8_rewind_init(&rewind, chip8_rewind_config_default()))
+    {
+        printf("ERROR CANNOT ALLOCATE REWIND BUFFER\n");
+        chip8_free(chip8);
+        return 1;
+    }
+
+    // the shadow machine runs the same engine, so it needs the same cache attached
+    CHIP8_RUNAHEAD runahead;
+    if (runahead_enabled)
+    {
+        if (!chip8_runahead_init(&runahead, chip8, runahead_frames, runahead_threaded))
+        {
+            printf("ERROR CANNOT ALLOCATE RUNAHEAD MACHINE\n");
+            if (rewind_enabled)
+            {
+                chip8_rewind_free(&rewind);
+            }
+            chip8_free(chip8);
+            return 1;
+        }
+        if (blocks)
+        {
+            chip8_blocks_attach(runahead.shadow);
+        }
+        if (jit && config.engine == chip8_run_jit)
+        {
+            chip8_jit_attach(runahead.shadow);
+        }
+    }
+
+    // null has nowhere to go, anything else is a wav file
+    CHIP8_AUDIO audio;
+    CHIP8_AUDIO_OUTPUT audio_output;
+    if (audio_path && (!chip8_audio_init(&audio, audio_config) ||
+                       !chip8_audio_output_open(&audio_output, &audio, strcmp(audio_path, "null") == 0 ? nullptr : audio_path, realtime)))
+    {
+        printf("ERROR CANNOT START AUDIO\n");
+        chip8_free(chip8);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    frame_pacer pacer;
+    frame_pacer_init(pacer, CHIP8_FRAME_RATE);
+    if (replay_path)
+    {
+        auto seek_start = std::chrono::steady_clock::now();
+        if (!chip8_replay_seek(&replay, chip8, rom.data(), (unsigned int) rom.size(), &config, seek_frame))
+        {
+            printf("ERROR BAD KEYFRAME IN REPLAY %s\n", replay_path);
+            chip8_free(chip8);
+            return 1;
+        }
+        double seek_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - seek_start).count();
+        printf("replay:       frames %llu-%llu, seek to %llu took %.1f us\n", (unsigned long long) replay.info.start_frame,
+               (unsigned long long) replay.info.end_frame, (unsigned long long) chip8->timer_ticks, seek_us);
+        start = std::chrono::steady_clock::now();
+        cycles = chip8_replay_run(&replay, chip8, &config, replay.info.end_frame);
+    }
+    else if (realtime)
+    {
+        uint64_t ran = 0;
+        while (ran < cycles)
+        {
+            uint32_t due = frame_pacer_wait(pacer);
+            for (uint32_t i = 0; i < due && ran < cycles; i++)
+            {
+                bool sound = chip8_sound_playing(chip8);
+                CHIP8_RUN_RESULT result = runahead_enabled ? chip8_runahead_frame(&runahead, chip8, &config) : chip8_run_frame(chip8, &config);
+                ran += result.cycles;
+                if (audio_path)
+                {
+                    // on for the frame if the timer was running when it started or Fx18 started it
+                    chip8_audio_frame(&audio, sound || (result.events & CHIP8_EVENT_SOUND));
+                }
+                if (rewind_enabled)
+                {
+                    chip8_rewind_push(&rewind, chip8);
+                }
+            }
+        }
+        cycles = ran;
+    }
+    else if (rewind_enabled || runahead_enabled || audio_path)
+    {
+        uint64_t ran = 0;
+        while (ran < cycles)
+        {
+            bool sound = chip8_sound_playing(chip8);
+            CHIP8_RUN_RESULT result = runahead_enabled ? chip8_runahead_frame(&runahead, chip8, &config) : chip8_run_frame(chip8, &config);
+            ran += result.cycles;
+            if (audio_path)
+            {
+                chip8_audio_frame(&audio, sound || (result.events & CHIP8_EVENT_SOUND));
+                chip8_audio_output_pump(&audio_output);
+            }
+            if (rewind_enabled)
+            {
+                chip8_rewind_push(&rewind, chip8);
+            }
+        }
+        cycles = ran;
+    }
+    else
+    {
+        cycles = chip8_run_frames(chip8, &config, cycles);
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (audio_path)
+    {
+        chip8_audio_output_close(&audio_output);
+    }
+
+    double rewind_us = 0.0;
+    uint32_t rewound = 0;
+    if (rewind_enabled)
+    {
+        auto rewind_start = std::chrono::steady_clock::now();
+        rewound = chip8_rewind_step_back(&rewind, chip8, rewind_frames);
+        rewind_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - rewind_start).count();
+    }
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    if (trace_path)
+    {
+        uint64_t dropped = chip8_trace_close();
+        if (dropped)
+        {
+            printf("trace:        %llu records dropped\n", (unsigned long long) dropped);
+        }
+    }
+
+    printf("rom:          %s\n", rom_path);
+    printf("instructions: %llu\n", (unsigned long long) cycles);
+    printf("time:         %.6f s\n", seconds);
+    printf("throughput:   %.0f instructions/sec\n", seconds > 0.0 ? cycles / seconds : 0.0);
+    frame_pacer_print_stats(pacer);
+    if (replay_path)
+    {
+        bool same = chip8->timer_ticks == replay.info.end_frame && chip8_video_hash(chip8) == replay.info.end_video_hash;
+        printf("replay:       %s\n", same ? "ends on the recorded display" : "DIFFERENT FROM THE RECORDING");
+    }
+    if (rewind_enabled)
+    {
+        chip8_rewind_print_stats(&rewind);
+        printf("rewound:      %u frames in %.1f us\n", rewound, rewind_us);
+        chip8_rewind_free(&rewind);
+    }
+    if (audio_path)
+    {
+        chip8_audio_print_stats(&audio);
+        chip8_audio_free(&audio);
+    }
+    if (runahead_enabled)
+    {
+        chip8_runahead_print_stats(&runahead);
+        printf("presented:    %016llx\n", (unsigned long long) chip8_video_hash(runahead.shadow));
+        chip8_runahead_free(&runahead);
+    }
+    if (chip8_waiting_for_key(chip8))
+    {
+        printf("halted:       waiting for a key (Fx0A)\n");
+    }
+    printf("idle skipped: %llu instructions\n", (unsigned long long) chip8->idle_skipped);
+    printf("video hash:   %016llx\n", (unsigned long long) chip8_video_hash(chip8));
+
+    if (save_state_path && !chip8_save_state(chip8, rom.data(), (unsigned int) rom.size(), save_state_path))
+    {
+        chip8_free(chip8);
+        return 1;
+    }
+
+    chip8_free(chip8);
+    return 0;
+}
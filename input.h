@@ -6,6 +6,8 @@
 #include <GLFW/glfw3.h>
 
 #include "chip8.h"
+#include "chip8_input.h"
+#include "clock.h"
 
 
 // Keypad       Keyboard
@@ -29,88 +31,40 @@ inline bool right_key_pressed = false;
 inline bool space_key_pressed = false;
 
 
-inline void key_callback(GLFWwindow* window, CHIP8* chip8)
-{
+// keyboard key for each keypad slot, keypad[0] is 1, keypad[1] is 2 ... keypad[15] is V
+inline const int keypad_keys[16] = {
+    GLFW_KEY_1, GLFW_KEY_2, GLFW_KEY_3, GLFW_KEY_4,
+    GLFW_KEY_Q, GLFW_KEY_W, GLFW_KEY_E, GLFW_KEY_R,
+    GLFW_KEY_A, GLFW_KEY_S, GLFW_KEY_D, GLFW_KEY_F,
+    GLFW_KEY_Z, GLFW_KEY_X, GLFW_KEY_C, GLFW_KEY_V,
+};
 
-    // Clear all keys
-    for (int i = 0; i < 16; i++)
-    {
-        chip8->keypad[i] = 0;
-    }
-
-    //here for testing
-    if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS)
-    {
-        printf("test key pressed\n");
-    }
+// the queue the key callback sends keypad events to, see input_init
+inline CHIP8_INPUT_QUEUE* input_queue = nullptr;
 
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
-    {
-        chip8->keypad[0] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
-    {
-        chip8->keypad[1] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
-    {
-        chip8->keypad[2] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS)
-    {
-        chip8->keypad[3] = 1;
-    }
-
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-    {
-        chip8->keypad[4] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-    {
-        chip8->keypad[5] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-    {
-        chip8->keypad[6] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS)
+// glfw calls this from glfwPollEvents/glfwWaitEvents for every key change, so a tap between two frames isn't missed.
+// It only pushes into the queue, the emulation takes the events at the instruction they fall on (chip8_input.h)
+inline void input_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action == GLFW_REPEAT || !input_queue)
     {
-        chip8->keypad[7] = 1;
+        return;
     }
 
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-    {
-        chip8->keypad[8] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    for (uint8_t slot = 0; slot < 16; slot++)
     {
-        chip8->keypad[9] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-    {
-        chip8->keypad[10] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS)
-    {
-        chip8->keypad[11] = 1;
+        if (keypad_keys[slot] == key)
+        {
+            chip8_input_push(input_queue, {clock_now_ns(), slot, action == GLFW_PRESS});
+        }
     }
+}
 
-    if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS)
-    {
-        chip8->keypad[12] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_X) == GLFW_PRESS)
-    {
-        chip8->keypad[13] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS)
-    {
-        chip8->keypad[14] = 1;
-    }
-    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS)
-    {
-        chip8->keypad[15] = 1;
-    }
+inline void input_init(GLFWwindow* window, CHIP8_INPUT_QUEUE* queue)
+{
+    chip8_input_init(queue);
+    input_queue = queue;
+    glfwSetKeyCallback(window, input_key_callback);
 }
 
 
@@ -1,5 +1,18 @@
-﻿#include <cstdio>
+﻿#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "chip8.h"
+#include "chip8_audio.h"
+#include "chip8_input.h"
+#include "chip8_replay.h"
+#include "chip8_rewind.h"
+#include "chip8_runahead.h"
+#include "chip8_triple_buffer.h"
 #include "clock.h"
 #include "input.h"
 #include "Mesh.h"
@@ -11,18 +24,117 @@
 #include "vk_vertex.h"
 
 
-//COMMAND LINE USAGE: ./chip 8 <ROM>
+//COMMAND LINE USAGE: ./chip 8 <ROM> [--ipf N] [--vblank] [--turbo N] [--quirks default|vip|chip48|schip] [--record FILE] [--runahead N [--runahead-thread]] [--audio null|FILE.wav [--audio-buffer N]]
+// Tab toggles fast forward, --turbo N starts with it on at N times speed (0 = as fast as the cpu allows)
+// holding Backspace rewinds at normal speed, up to 5 minutes back
+// --record FILE saves the session as a replay on exit, play it back with chip8_headless <ROM> --replay FILE
+// --runahead N shows the display N frames ahead of the real machine to hide a rom's input lag, --runahead-thread runs those on a second core
+// --audio plays the sound timer's tone into a sample ring a device thread takes from in real time, null throws the
+// samples away and FILE.wav keeps them. --audio-buffer N sets the ring size in samples, smaller is less delay
+
+#define RECORD_KEYFRAME_INTERVAL 600 // frames, 10 seconds
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    data.resize(size > 0 ? size : 0);
+    size_t read = data.empty() ? 0 : fread(data.data(), data.size(), 1, file);
+    fclose(file);
+    return data.empty() || read == 1;
+}
 
 int main(int argc, char** argv)
 {
 
-    CHIP8* chip8 = chip8_init();
+    // instructions per 60hz frame sets the cpu speed, the timers always tick 60 times a second
+    CHIP8_FRAME_CONFIG frame_config = chip8_frame_config_default();
+    // fast forward runs turbo_speed emulated frames per presented frame, 0 runs flat out until the next present
+    bool turbo = false;
+    uint32_t turbo_speed = 0;
+    uint8_t quirks = CHIP8_PROFILE_DEFAULT;
+    const char* record_path = nullptr;
+    uint32_t runahead_frames = 0;
+    bool runahead_threaded = false;
+    const char* audio_path = nullptr;
+    CHIP8_AUDIO_CONFIG audio_config = chip8_audio_config_default();
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            frame_config.instructions_per_frame = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--vblank") == 0)
+        {
+            frame_config.vblank_wait = true;
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            quirks = chip8_profile_from_name(argv[++i]);
+            if (quirks == CHIP8_PROFILE_COUNT)
+            {
+                throw std::runtime_error("UNKNOWN QUIRKS PROFILE");
+            }
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--runahead") == 0 && i + 1 < argc)
+        {
+            runahead_frames = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--runahead-thread") == 0)
+        {
+            runahead_threaded = true;
+        }
+        else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc)
+        {
+            audio_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc)
+        {
+            audio_config.buffer_samples = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--turbo") == 0 && i + 1 < argc)
+        {
+            turbo_speed = (uint32_t) strtoul(argv[++i], nullptr, 10);
+            turbo = true;
+        }
+    }
+
+    // a new Cxkk sequence every time it's played
+    uint64_t seed = clock_now_ns();
+    CHIP8* chip8 = chip8_init(seed);
+    if (!chip8)
+    {
+        throw std::runtime_error("MACHINE COULD NOT ALLOCATE");
+    }
+    chip8_set_quirks(chip8, quirks);
     if (!chip8_load_rom(chip8, argv[1]))
     {
         std::cout << argv[1] << std::endl;
        throw std::runtime_error("ROM COULD NOT LOAD");
     };
 
+    // the recorder keeps its keyframes against the rom bytes
+    std::vector<uint8_t> rom;
+    CHIP8_RECORDER recorder;
+    if (record_path)
+    {
+        if (!read_file(argv[1], rom))
+        {
+            throw std::runtime_error("ROM COULD NOT LOAD");
+        }
+        chip8_recorder_init(&recorder, chip8, rom.data(), (unsigned int) rom.size(), seed, &frame_config, RECORD_KEYFRAME_INTERVAL);
+    }
+
     //TESTING ROMS:
     // if (!chip8_load_rom(chip8, "../games/Tic-Tac-Toe [David Winter].ch8"))
     // if (!chip8_load_rom(chip8, "../games/Tetris [Fran Dachille, 1991].ch8"))
@@ -54,53 +166,319 @@ int main(int argc, char** argv)
 
 
 
+    // the display is bit packed, the texture wants a byte per pixel
+    uint8_t pixels[VIDEO_WIDTH * VIDEO_HEIGHT] = {};
+
     init_vulkan(vulkan_context, window_info, swapchain_context, graphics_context, buffer_context,
-                command_buffer_context, semaphore_fences_context, texture, chip8->video, descriptor_set);
-    clock_windows_init();
+                command_buffer_context, semaphore_fences_context, texture, pixels, descriptor_set);
+    clock_init();
+
+    // keys come in through the glfw key callback as timestamped events
+    CHIP8_INPUT_QUEUE input;
+    input_init(window_info.window, &input);
 
     // add_quad_textured(glm::vec2{0.0f, 0.0f}, 1.0, vertex_info);
     add_full_screen_quad_textured(vertex_info);
 
 
-    float cycle_time = SECONDS(0.01f);
-    float dt = 0.0f; // in ms
-    float dt_accumulation = 0.0f; // in ms
+    // every emulated frame is recorded so Backspace can play the game backwards
+    CHIP8_REWIND rewind;
+    if (!chip8_rewind_init(&rewind, chip8_rewind_config_default()))
+    {
+        throw std::runtime_error("REWIND BUFFER COULD NOT ALLOCATE");
+    }
+
+    // at normal speed the last frame of each present also runs the speculative ones and the shadow is what's shown.
+    // Rewind and fast forward show the real machine
+    CHIP8_RUNAHEAD runahead;
+    if (!chip8_runahead_init(&runahead, chip8, runahead_frames, runahead_threaded))
+    {
+        throw std::runtime_error("RUNAHEAD MACHINE COULD NOT ALLOCATE");
+    }
 
-    while (!glfwWindowShouldClose(window_info.window))
+    // the emulation thread writes a frame of samples per 60hz tick, the device thread plays them at the sample rate.
+    // Fast forward keeps the tone going at normal speed, rewind is silent
+    CHIP8_AUDIO audio;
+    CHIP8_AUDIO_OUTPUT audio_output;
+    if (audio_path && (!chip8_audio_init(&audio, audio_config) ||
+                       !chip8_audio_output_open(&audio_output, &audio, strcmp(audio_path, "null") == 0 ? nullptr : audio_path, true)))
     {
-        glfwPollEvents();
+        throw std::runtime_error("AUDIO COULD NOT START");
+    }
 
-        dt = clock_window_delta_time();
-        dt_accumulation += dt;
-        // get input
-        key_callback(window_info.window, chip8);
+    // The emulation runs on its own thread and hands each finished frame to this one through a triple buffer, so a
+    // slow present or a swapchain rebuild doesn't hold up the machine and a long emulation frame doesn't hold up
+    // the window. The two only share the input queue, the triple buffer and the flags below
+    CHIP8_TRIPLE_BUFFER frames;
+    chip8_triple_buffer_init(&frames);
+    std::atomic<bool> quit = false;
+    std::atomic<bool> turbo_on = turbo;
+    std::atomic<bool> rewinding = false;
+    std::atomic<uint64_t> emulated_frames = 0; // not counting rewound ones
+    std::atomic<uint32_t> runahead_cost = 0; // percent extra cpu, for the title bar
+    // a machine halted on Fx0A with idle timers can't do anything until a key changes, so instead of spinning the
+    // emulation sleeps until the window thread wakes it after an event, and the window thread sleeps in glfwWaitEvents
+    // until an event or a new frame (glfwPostEmptyEvent) comes in
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    bool woken = false;
+    std::atomic<bool> window_waiting = false;
+    frame_pacer pacer;
 
-        // draw_frame(vulkan_context, window_info, swapchain_context,
-                             // graphics_context, command_buffer_context,
-                             // buffer_context, vertex_info, semaphore_fences_context, descriptor_set);
+    std::thread emulation([&]()
+    {
+        CHIP8_FRAME_KEYS frame_keys;
+        frame_pacer_init(pacer, CHIP8_FRAME_RATE);
 
-        if (dt_accumulation > cycle_time)
+        // shown is the machine whose display goes out, the run-ahead shadow or the real one
+        auto publish = [&](const CHIP8* shown)
         {
+            CHIP8_PRESENT_FRAME* back = chip8_triple_buffer_back(&frames);
+            memcpy(back->video, shown->video, sizeof(back->video));
+            back->frame = chip8->timer_ticks;
+            back->halted = chip8_waiting_for_key(chip8) && chip8_delay_timer(chip8) == 0 && !chip8_sound_playing(chip8);
+            chip8_triple_buffer_publish(&frames);
+            if (window_waiting)
+            {
+                glfwPostEmptyEvent();
+            }
+        };
 
-            //reset the timer
-            dt_accumulation -= cycle_time;
+        while (!quit)
+        {
+            {
+                std::lock_guard<std::mutex> guard(wake_lock);
+                woken = false;
+            }
 
-            //process emulator
-            chip8_cycle(chip8);
+            uint32_t due;
+            CHIP8_INPUT_EVENT event;
+            if (chip8_waiting_for_key(chip8) && chip8_delay_timer(chip8) == 0 && !chip8_sound_playing(chip8) &&
+                !rewinding && !chip8_input_peek(&input, &event))
+            {
+                if (audio_path)
+                {
+                    // the ring running dry while halted is silence, not an underrun
+                    chip8_audio_idle(&audio);
+                }
+                std::unique_lock<std::mutex> guard(wake_lock);
+                wake.wait(guard, [&] { return woken || quit; });
+                frame_pacer_reset(pacer);
+                due = 1;
+            }
+            else
+            {
+                // one frame every 1/60s, more if the last one ran long
+                due = frame_pacer_wait(pacer);
+            }
+            if (quit)
+            {
+                break;
+            }
 
+            // the frames about to run stand for the time that just went by, up to now
+            uint64_t input_ns = clock_now_ns();
+            bool turbo_now = turbo_on;
 
+            if (rewinding)
+            {
+                // back as many frames as would have run forward
+                chip8_rewind_step_back(&rewind, chip8, due);
+                // keys that change while rewinding only matter as the keypad to carry on with
+                chip8_input_drain(&input);
+                publish(chip8);
+                for (uint32_t i = 0; i < due && audio_path; i++)
+                {
+                    chip8_audio_frame(&audio, false);
+                }
+            }
+            else if (turbo_now && turbo_speed == 0)
+            {
+                // flat out until the next 60hz tick, the window picks up whichever frame is newest
+                do
+                {
+                    chip8_input_take_frame(&input, chip8, clock_now_ns(), 0, frame_config.instructions_per_frame, &frame_keys);
+                    if (record_path)
+                    {
+                        chip8_recorder_frame(&recorder, chip8, &frame_keys);
+                    }
+                    chip8_run_frame_keys(chip8, &frame_config, &frame_keys);
+                    chip8_rewind_push(&rewind, chip8);
+                    publish(chip8);
+                    emulated_frames++;
+                } while (clock_now_ns() < pacer.deadline_ns && !quit);
+                for (uint32_t i = 0; i < due && audio_path; i++)
+                {
+                    chip8_audio_frame(&audio, chip8_sound_playing(chip8));
+                }
+            }
+            else
+            {
+                uint64_t run = (uint64_t) due * (turbo_now ? turbo_speed : 1);
+                uint64_t frame_ns = 1000000000ull / CHIP8_FRAME_RATE / (turbo_now ? turbo_speed : 1);
+                // frame i gets its slice of the time that elapsed, so a key lands on the instruction it was
+                // pressed during and keeps its length, anything newer stays queued for the next wakeup
+                uint64_t window_ns = input_ns - run * frame_ns;
+                bool sound = false;
+                for (uint64_t i = 0; i < run; i++)
+                {
+                    sound = sound || chip8_sound_playing(chip8);
+                    chip8_input_take_frame(&input, chip8, window_ns + i * frame_ns, frame_ns, frame_config.instructions_per_frame, &frame_keys);
+                    if (record_path)
+                    {
+                        chip8_recorder_frame(&recorder, chip8, &frame_keys);
+                    }
+                    CHIP8_RUN_RESULT result;
+                    if (runahead_frames > 0 && !turbo_now && i + 1 == run)
+                    {
+                        result = chip8_runahead_frame(&runahead, chip8, &frame_config, &frame_keys);
+                        runahead_cost = (uint32_t) (chip8_runahead_overhead(&runahead) * 100.0);
+                        chip8_rewind_push(&rewind, chip8);
+                        publish(runahead.shadow);
+                    }
+                    else
+                    {
+                        result = chip8_run_frame_keys(chip8, &frame_config, &frame_keys);
+                        chip8_rewind_push(&rewind, chip8);
+                        publish(chip8);
+                    }
 
-            update_texture_image_pixels(vulkan_context, command_buffer_context, texture, VK_FORMAT_R8_UNORM, chip8->video, VIDEO_WIDTH, VIDEO_HEIGHT);
+                    // a frame of samples per turbo_speed frames, on if the tone was on at any point in them
+                    sound = sound || (result.events & CHIP8_EVENT_SOUND);
+                    if (audio_path && (!turbo_now || (i + 1) % turbo_speed == 0))
+                    {
+                        chip8_audio_frame(&audio, sound);
+                        sound = false;
+                    }
+                }
+                emulated_frames += run;
+            }
+        }
+    });
+
+    frame_pacer present_pacer;
+    frame_pacer_init(present_pacer, CHIP8_FRAME_RATE);
+    bool tab_was_down = false;
+    bool shown_halted = false;
+    // emulated and presented frames counted separately, shown in the title bar once a second
+    uint64_t rate_start_ns = clock_now_ns();
+    uint64_t rate_emulated = 0;
+    uint64_t rate_produced = 0;
+    uint64_t rate_consumed = 0;
+    uint64_t presented_frames = 0;
 
+    while (!glfwWindowShouldClose(window_info.window))
+    {
+        // the presents stay on their own 60hz pacer whatever the emulation speed, so the swapchain never has more
+        // than one present queued to block on. While the machine is halted there's nothing to draw until an event
+        window_waiting = shown_halted;
+        if (shown_halted && !chip8_triple_buffer_fresh(&frames))
+        {
+            glfwWaitEvents();
+            frame_pacer_reset(present_pacer);
+        }
+        else
+        {
+            window_waiting = false;
+            frame_pacer_wait(present_pacer);
+            glfwPollEvents();
+        }
+        window_waiting = false;
+
+        bool tab_down = glfwGetKey(window_info.window, GLFW_KEY_TAB) == GLFW_PRESS;
+        if (tab_down && !tab_was_down)
+        {
+            turbo_on = !turbo_on;
+        }
+        tab_was_down = tab_down;
+        rewinding = glfwGetKey(window_info.window, GLFW_KEY_BACKSPACE) == GLFW_PRESS;
+
+        // key events went into the queue, a sleeping emulation has to look at them
+        {
+            std::lock_guard<std::mutex> guard(wake_lock);
+            woken = true;
+        }
+        wake.notify_one();
+
+        // draw_frame(vulkan_context, window_info, swapchain_context,
+                             // graphics_context, command_buffer_context,
+                             // buffer_context, vertex_info, semaphore_fences_context, descriptor_set);
+
+        // only upload when there's a new frame
+        bool fresh;
+        const CHIP8_PRESENT_FRAME* frame = chip8_triple_buffer_acquire(&frames, &fresh);
+        shown_halted = frame->halted;
+        if (fresh)
+        {
+            chip8_video_expand_rows(frame->video, pixels);
+            update_texture_image_pixels(vulkan_context, command_buffer_context, texture, VK_FORMAT_R8_UNORM, pixels, VIDEO_WIDTH, VIDEO_HEIGHT);
         }
 
         //grab the pixel data, send it to a shader basically
         draw_frame(vulkan_context, window_info, swapchain_context,
         graphics_context, command_buffer_context,
         buffer_context, vertex_info, semaphore_fences_context, descriptor_set);
+        presented_frames++;
+
+        uint64_t now_ns = clock_now_ns();
+        if (now_ns - rate_start_ns >= 1000000000ull)
+        {
+            double seconds = (now_ns - rate_start_ns) / 1e9;
+            uint64_t emulated = emulated_frames;
+            uint64_t produced = frames.produced;
+            uint64_t consumed = frames.consumed;
+            double emulated_rate = (emulated - rate_emulated) / seconds;
+            // produced frames the window never took were dropped, presents without a new frame showed one twice
+            char title[256];
+            int length = snprintf(title, sizeof(title), "%s - emulation %.0f fps (%.1fx)%s - present %.0f fps (%.0f new, %.0f dropped)",
+                                  window_info.WINDOW_NAME, emulated_rate, emulated_rate / CHIP8_FRAME_RATE, turbo_on ? " turbo" : "",
+                                  presented_frames / seconds, (consumed - rate_consumed) / seconds,
+                                  ((produced - rate_produced) - (consumed - rate_consumed)) / seconds);
+            if (runahead_frames > 0 && length > 0 && length < (int) sizeof(title))
+            {
+                snprintf(title + length, sizeof(title) - length, " - run-ahead %u (+%u%% cpu)", runahead_frames, runahead_cost.load());
+            }
+            glfwSetWindowTitle(window_info.window, title);
+
+            rate_start_ns = now_ns;
+            rate_emulated = emulated;
+            rate_produced = produced;
+            rate_consumed = consumed;
+            presented_frames = 0;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        quit = true;
+    }
+    wake.notify_one();
+    emulation.join();
+    if (audio_path)
+    {
+        chip8_audio_output_close(&audio_output);
     }
 
 
+    frame_pacer_print_stats(pacer);
+    chip8_triple_buffer_print_stats(&frames);
+    chip8_rewind_print_stats(&rewind);
+    chip8_runahead_print_stats(&runahead);
+    if (audio_path)
+    {
+        chip8_audio_print_stats(&audio);
+        chip8_audio_free(&audio);
+    }
+    if (input.dropped)
+    {
+        printf("input:        %u key events dropped, the queue was full\n", input.dropped);
+    }
+    if (record_path && chip8_recorder_save(&recorder, chip8, record_path))
+    {
+        printf("recorded %llu frames to %s\n", (unsigned long long) (chip8->timer_ticks - recorder.info.start_frame), record_path);
+    }
+    chip8_rewind_free(&rewind);
+    chip8_runahead_free(&runahead);
     chip8_free(chip8);
     return 0;
-}
\ No newline at end of file
+}
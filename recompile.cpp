@@ -0,0 +1,394 @@
+﻿#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8_blocks.h"
+
+
+//COMMAND LINE USAGE: ./chip8_recompile <ROM> -o <OUT.cpp> [--name NAME] [--quirks default|vip|chip48|schip]
+// turns a rom into a C++ file that runs against the same CHIP8 struct, see chip8_aot.h
+
+static void print_usage()
+{
+    printf("usage: chip8_recompile <ROM> -o <OUT.cpp> [--name NAME] [--quirks default|vip|chip48|schip]\n");
+    printf("  -o FILE      C++ file to write\n");
+    printf("  --name NAME  identifier for the program (default taken from the rom file name)\n");
+    printf("  --quirks P   quirks profile the code is generated for, the machine has to run the same one\n");
+}
+
+static const char* const op_names[CHIP8_OP_COUNT] =
+{
+    "NULL", "00E0", "00EE", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+    "8xy0", "8xy1", "8xy2", "8xy3", "8xy4", "8xy5", "8xy6", "8xy7", "8xyE", "9xy0",
+    "Annn", "Bnnn", "Cxkk", "Dxyn", "Ex9E", "ExA1", "Fx07", "Fx0A", "Fx15", "Fx18",
+    "Fx1E", "Fx29", "Fx33", "Fx55", "Fx65",
+};
+
+// the quirks type for each CHIP8_QUIRK_PROFILE, spelled out for the generated code
+static const char* const quirks_types[CHIP8_PROFILE_COUNT] =
+{
+    "CHIP8_QUIRKS_DEFAULT", "CHIP8_QUIRKS_VIP", "CHIP8_QUIRKS_CHIP48", "CHIP8_QUIRKS_SCHIP",
+};
+
+static const char* const profile_enums[CHIP8_PROFILE_COUNT] =
+{
+    "CHIP8_PROFILE_DEFAULT", "CHIP8_PROFILE_VIP", "CHIP8_PROFILE_CHIP48", "CHIP8_PROFILE_SCHIP",
+};
+
+// OP_8xy1<CHIP8_QUIRKS_VIP> for the ops that depend on the profile, OP_6xkk for the rest
+static std::string handler_name(uint8_t op, uint8_t profile)
+{
+    std::string handler = std::string("OP_") + op_names[op];
+    if (chip8_op_has_quirks(op))
+    {
+        handler += std::string("<") + quirks_types[profile] + ">";
+    }
+    return handler;
+}
+
+#define LAST_ADDRESS 0x0FFEu // last address a whole instruction fits at
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    data.resize(size > 0 ? size : 0);
+    size_t read = data.empty() ? 0 : fread(data.data(), data.size(), 1, file);
+    fclose(file);
+    return data.empty() || read == 1;
+}
+
+static std::string identifier_from_path(const char* path)
+{
+    std::string name = path;
+    size_t slash = name.find_last_of("/\\");
+    if (slash != std::string::npos)
+    {
+        name = name.substr(slash + 1);
+    }
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos)
+    {
+        name = name.substr(0, dot);
+    }
+
+    for (char& c : name)
+    {
+        if (!isalnum((unsigned char) c))
+        {
+            c = '_';
+        }
+    }
+    if (name.empty() || isdigit((unsigned char) name[0]))
+    {
+        name = "_" + name;
+    }
+    return name;
+}
+
+
+/*** CONTROL FLOW ***/
+
+struct Flow
+{
+    bool reachable[4096] = {};
+    bool leader[4096] = {}; // start of a block, gets its own case in the generated switch
+};
+
+static void flow_add(Flow& flow, std::vector<unsigned int>& worklist, unsigned int address, bool leader)
+{
+    if (address > LAST_ADDRESS)
+    {
+        return; // the interpreter deals with pc wrapping past the end of memory
+    }
+    if (leader)
+    {
+        flow.leader[address] = true;
+    }
+    if (!flow.reachable[address])
+    {
+        flow.reachable[address] = true;
+        worklist.push_back(address);
+    }
+}
+
+static void flow_walk(const CHIP8* chip8, Flow& flow)
+{
+    std::vector<unsigned int> worklist;
+    flow_add(flow, worklist, START_ADDRESS, true);
+
+    while (!worklist.empty())
+    {
+        unsigned int address = worklist.back();
+        worklist.pop_back();
+
+        const CHIP8_INSTR* instr = &chip8->decoded[address];
+        unsigned int next = address + 2;
+
+        switch (instr->op)
+        {
+            case CHIP8_OP_00EE:
+                // returns land after a 2nnn, those are leaders already
+                break;
+            case CHIP8_OP_1nnn:
+                flow_add(flow, worklist, instr->nnn, true);
+                break;
+            case CHIP8_OP_2nnn:
+                flow_add(flow, worklist, instr->nnn, true);
+                flow_add(flow, worklist, next, true);
+                break;
+            case CHIP8_OP_3xkk:
+            case CHIP8_OP_4xkk:
+            case CHIP8_OP_5xy0:
+            case CHIP8_OP_9xy0:
+            case CHIP8_OP_Ex9E:
+            case CHIP8_OP_ExA1:
+                flow_add(flow, worklist, next, true);
+                flow_add(flow, worklist, next + 2, true);
+                break;
+            case CHIP8_OP_Bnnn:
+            {
+                // usually a jump table: nnn followed by a run of jumps indexed by V0.
+                // anything else it lands on is left to the interpreter at runtime
+                flow_add(flow, worklist, instr->nnn, true);
+                for (unsigned int entry = instr->nnn; entry <= LAST_ADDRESS; entry += 2)
+                {
+                    uint8_t op = chip8->decoded[entry].op;
+                    if (op != CHIP8_OP_1nnn && op != CHIP8_OP_2nnn)
+                    {
+                        break;
+                    }
+                    flow_add(flow, worklist, entry, true);
+                }
+                break;
+            }
+            case CHIP8_OP_Fx0A:
+                // runs again until a key is down
+                flow_add(flow, worklist, address, true);
+                flow_add(flow, worklist, next, true);
+                break;
+            default:
+                flow_add(flow, worklist, next, chip8_block_ends_at(instr->op));
+                break;
+        }
+    }
+
+    // cap block length so the budget check stays fine grained, the cut starts a new block
+    for (unsigned int address = 0; address <= LAST_ADDRESS; address++)
+    {
+        if (!flow.leader[address])
+        {
+            continue;
+        }
+
+        unsigned int pc = address;
+        for (unsigned int length = 1; ; length++, pc += 2)
+        {
+            if (chip8_block_ends_at(chip8->decoded[pc].op) || pc + 2 > LAST_ADDRESS || flow.leader[pc + 2])
+            {
+                break;
+            }
+            if (length == BLOCK_MAX_LENGTH)
+            {
+                flow.leader[pc + 2] = true;
+                break;
+            }
+        }
+    }
+}
+
+
+/*** CODE GENERATION ***/
+
+static void emit_block(FILE* out, const CHIP8* chip8, const Flow& flow, unsigned int start)
+{
+    std::vector<unsigned int> addresses;
+    for (unsigned int pc = start; ; pc += 2)
+    {
+        addresses.push_back(pc);
+        if (chip8_block_ends_at(chip8->decoded[pc].op) || pc + 2 > LAST_ADDRESS || flow.leader[pc + 2])
+        {
+            break;
+        }
+    }
+    unsigned int length = (unsigned int) addresses.size();
+
+    fprintf(out, "            case 0x%03X:\n", start);
+    fprintf(out, "                if (max_cycles - executed < %u) return executed;\n", length);
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        unsigned int pc = addresses[i];
+        const CHIP8_INSTR* instr = &chip8->decoded[pc];
+
+        // flow ops read or change pc, so it has to hold what the interpreter would have
+        if (chip8_block_ends_at(instr->op))
+        {
+            fprintf(out, "                chip8->pc = 0x%03X;\n", pc + 2);
+        }
+        fprintf(out, "                %s(chip8, &i_%03X);\n", handler_name(instr->op, chip8->quirks).c_str(), pc);
+    }
+
+    if (!chip8_block_ends_at(chip8->decoded[addresses.back()].op))
+    {
+        fprintf(out, "                chip8->pc = 0x%03X;\n", addresses.back() + 2);
+    }
+    fprintf(out, "                executed += %u;\n", length);
+    fprintf(out, "                break;\n");
+}
+
+static void emit_program(FILE* out, const char* rom_path, const std::string& name, const std::vector<uint8_t>& rom,
+                         const CHIP8* chip8, const Flow& flow)
+{
+    fprintf(out, "// generated by chip8_recompile from %s, do not edit\n", rom_path);
+    fprintf(out, "#include \"chip8_aot.h\"\n\n\n");
+
+    fprintf(out, "static const uint8_t rom[%u] =\n{", (unsigned int) rom.size());
+    for (size_t i = 0; i < rom.size(); i++)
+    {
+        fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", rom[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    uint8_t covered[4096 / 8] = {};
+    for (unsigned int address = 0; address <= LAST_ADDRESS; address++)
+    {
+        if (flow.reachable[address])
+        {
+            covered[address >> 3] |= 1u << (address & 7u);
+            covered[(address + 1) >> 3] |= 1u << ((address + 1) & 7u);
+        }
+    }
+    fprintf(out, "static const uint8_t covered[%u] =\n{", (unsigned int) sizeof(covered));
+    for (size_t i = 0; i < sizeof(covered); i++)
+    {
+        fprintf(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", covered[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    for (unsigned int address = 0; address <= LAST_ADDRESS; address++)
+    {
+        if (!flow.reachable[address])
+        {
+            continue;
+        }
+        const CHIP8_INSTR* instr = &chip8->decoded[address];
+        fprintf(out, "static constexpr CHIP8_INSTR i_%03X = {%s, 0x%04X, 0x%03X, 0x%X, 0x%X, 0x%02X, CHIP8_OP_%s};\n",
+                address, handler_name(instr->op, chip8->quirks).c_str(), instr->opcode, instr->nnn, instr->x, instr->y,
+                instr->kk, op_names[instr->op]);
+    }
+
+    fprintf(out, "\nstatic uint64_t run(CHIP8* chip8, uint64_t max_cycles, const bool* stop)\n{\n");
+    fprintf(out, "    uint64_t executed = 0;\n\n");
+    fprintf(out, "    while (!*stop)\n    {\n");
+    fprintf(out, "        switch (chip8->pc)\n        {\n");
+    for (unsigned int address = 0; address <= LAST_ADDRESS; address++)
+    {
+        if (flow.leader[address])
+        {
+            emit_block(out, chip8, flow, address);
+        }
+    }
+    fprintf(out, "            default:\n");
+    fprintf(out, "                return executed;\n");
+    fprintf(out, "        }\n    }\n\n    return executed;\n}\n\n");
+
+    fprintf(out, "CHIP8_AOT_PROGRAM chip8_aot_%s = {\"%s\", rom, sizeof(rom), covered, %s, run, NULL};\n",
+            name.c_str(), name.c_str(), profile_enums[chip8->quirks]);
+    fprintf(out, "[[maybe_unused]] static const bool registered = chip8_aot_register(&chip8_aot_%s);\n", name.c_str());
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    const char* rom_path = argv[1];
+    const char* out_path = NULL;
+    std::string name = identifier_from_path(rom_path);
+    uint8_t profile = CHIP8_PROFILE_DEFAULT;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+        {
+            name = identifier_from_path(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            profile = chip8_profile_from_name(argv[++i]);
+            if (profile == CHIP8_PROFILE_COUNT)
+            {
+                print_usage();
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if (!out_path)
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<uint8_t> rom;
+    if (!read_file(rom_path, rom) || rom.empty() || rom.size() > sizeof(CHIP8::memory) - START_ADDRESS)
+    {
+        printf("could not read rom %s\n", rom_path);
+        return 1;
+    }
+
+    CHIP8* chip8 = chip8_init();
+    if (!chip8)
+    {
+        printf("ERROR CANNOT ALLOCATE MACHINE\n");
+        return 1;
+    }
+    chip8_set_quirks(chip8, profile);
+    chip8_load_rom_memory(chip8, rom.data(), (unsigned int) rom.size());
+
+    Flow flow;
+    flow_walk(chip8, flow);
+
+    FILE* out = fopen(out_path, "w");
+    if (!out)
+    {
+        printf("could not write %s\n", out_path);
+        chip8_free(chip8);
+        return 1;
+    }
+    emit_program(out, rom_path, name, rom, chip8, flow);
+    fclose(out);
+
+    unsigned int instructions = 0;
+    unsigned int blocks = 0;
+    for (unsigned int address = 0; address <= LAST_ADDRESS; address++)
+    {
+        instructions += flow.reachable[address];
+        blocks += flow.leader[address];
+    }
+    printf("%s: %u instructions in %u blocks -> %s\n", rom_path, instructions, blocks, out_path);
+
+    chip8_free(chip8);
+    return 0;
+}
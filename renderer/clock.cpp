@@ -4,44 +4,45 @@
 
 #include "clock.h"
 
-void clock_windows_init()
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+static uint64_t last_tick_ns;
+
+uint64_t clock_now_ns()
 {
-    QueryPerformanceCounter(&ticks_per_second);
-    QueryPerformanceCounter(&last_tick_count);
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-
-void clock_window_time(m_clock& clock)
+void clock_init()
 {
-    //get current tick
-    QueryPerformanceCounter(&current_tick_count);
-    //difference from last frame
-    double elapsed_ticks = current_tick_count.QuadPart - last_tick_count.QuadPart;
-    // to milliseconds
-    double temp_delta = (elapsed_ticks * 100) / ticks_per_second.QuadPart;
-    last_tick_count = current_tick_count;
+    last_tick_ns = clock_now_ns();
+}
+
 
-    temp_delta = float(temp_delta);
+void clock_time(m_clock& clock)
+{
+    float temp_delta = clock_delta_time();
 
     clock.delta_time = temp_delta;
     clock.last_time = temp_delta;
 }
 
 //time in milliseconds
-float clock_window_delta_time()
+float clock_delta_time()
 {
     //get current tick
-    QueryPerformanceCounter(&current_tick_count);
+    uint64_t current_tick_ns = clock_now_ns();
     //difference from last frame
-    double elapsed_ticks = current_tick_count.QuadPart - last_tick_count.QuadPart;
-    // to milliseconds
-    double temp_delta = (elapsed_ticks * 100) / ticks_per_second.QuadPart;
+    uint64_t elapsed_ns = current_tick_ns - last_tick_ns;
 
     //store last frame time
-    last_tick_count = current_tick_count;
+    last_tick_ns = current_tick_ns;
 
-    //do a conversion
-    return (float) temp_delta;
+    // to milliseconds
+    return (float) (elapsed_ns / 1000000.0);
 }
 
 float delta_time_to_second(float dt)
@@ -58,3 +59,89 @@ float delta_time_to_fps(float dt)
 {
     return 1000.0f / dt;
 }
+
+
+/*** FRAME PACER ***/
+
+void frame_pacer_init(frame_pacer& pacer, uint32_t frames_per_second)
+{
+    pacer = {};
+    pacer.period_ns = 1000000000ull / frames_per_second;
+    pacer.spin_margin_ns = FRAME_PACER_MIN_SPIN_NS;
+    pacer.stats.late_min_ns = INT64_MAX;
+    frame_pacer_reset(pacer);
+}
+
+void frame_pacer_reset(frame_pacer& pacer)
+{
+    pacer.deadline_ns = clock_now_ns() + pacer.period_ns;
+}
+
+uint32_t frame_pacer_wait(frame_pacer& pacer)
+{
+    uint64_t now = clock_now_ns();
+
+    if (now + pacer.spin_margin_ns < pacer.deadline_ns)
+    {
+        uint64_t wake = pacer.deadline_ns - pacer.spin_margin_ns;
+        std::this_thread::sleep_for(std::chrono::nanoseconds(wake - now));
+        uint64_t woke = clock_now_ns();
+        pacer.stats.sleep_ns += woke - now;
+
+        // overslept past where spinning should have taken over, spin for longer from now on (up to half a frame).
+        // Otherwise let the margin shrink back slowly so one bad wake up doesn't cost spinning forever
+        if (woke > wake && woke - wake > pacer.spin_margin_ns)
+        {
+            pacer.spin_margin_ns = std::min(woke - wake + 50000, pacer.period_ns / 2);
+        }
+        else
+        {
+            pacer.spin_margin_ns = std::max(pacer.spin_margin_ns - pacer.spin_margin_ns / 32, (uint64_t) FRAME_PACER_MIN_SPIN_NS);
+        }
+        now = woke;
+    }
+
+    uint64_t spin_start = now;
+    while (now < pacer.deadline_ns)
+    {
+        now = clock_now_ns();
+    }
+    pacer.stats.spin_ns += now - spin_start;
+
+    int64_t late = (int64_t) (now - pacer.deadline_ns);
+    pacer.stats.frames++;
+    pacer.stats.late_total_ns += late;
+    pacer.stats.late_min_ns = std::min(pacer.stats.late_min_ns, late);
+    pacer.stats.late_max_ns = std::max(pacer.stats.late_max_ns, late);
+
+    // more than a period late means frames were missed, run them now unless there's too many
+    uint64_t due = 1 + (uint64_t) late / pacer.period_ns;
+    if (due > FRAME_PACER_MAX_CATCH_UP)
+    {
+        pacer.stats.dropped += due - FRAME_PACER_MAX_CATCH_UP;
+        due = FRAME_PACER_MAX_CATCH_UP;
+        pacer.deadline_ns = now + pacer.period_ns;
+    }
+    else
+    {
+        pacer.deadline_ns += due * pacer.period_ns;
+    }
+    return (uint32_t) due;
+}
+
+void frame_pacer_print_stats(const frame_pacer& pacer)
+{
+    const frame_pacer_stats& stats = pacer.stats;
+    if (stats.frames == 0)
+    {
+        return;
+    }
+
+    double waited = (double) (stats.sleep_ns + stats.spin_ns);
+    printf("frames:       %llu paced, %llu dropped\n", (unsigned long long) stats.frames, (unsigned long long) stats.dropped);
+    printf("jitter:       min %.1f us, mean %.1f us, max %.1f us late\n", stats.late_min_ns / 1000.0,
+           stats.late_total_ns / 1000.0 / stats.frames, stats.late_max_ns / 1000.0);
+    printf("waiting:      %.1f%% asleep, %.1f%% spinning (margin %.1f us)\n",
+           waited > 0 ? 100.0 * stats.sleep_ns / waited : 0.0, waited > 0 ? 100.0 * stats.spin_ns / waited : 0.0,
+           pacer.spin_margin_ns / 1000.0);
+}
@@ -5,11 +5,11 @@
 #ifndef CLOCK_H
 #define CLOCK_H
 #include <chrono>
+#include <cstdint>
 
-#include <windows.h>                // for Windows APIs
 
-
-static LARGE_INTEGER ticks_per_second, last_tick_count, current_tick_count;
+// monotonic clock on std::chrono::steady_clock (clock_gettime(CLOCK_MONOTONIC) on linux, QueryPerformanceCounter
+// on windows), everything underneath is integer nanoseconds, floats only come out of the delta time helpers
 
 struct m_clock
 {
@@ -24,9 +24,11 @@ struct m_clock
 
 //constexpr float SECONDS(float s) { return s / 1000.0f;}
 
-void clock_windows_init();
-float clock_window_delta_time();
-void clock_window_time(m_clock& clock);
+uint64_t clock_now_ns();
+
+void clock_init();
+float clock_delta_time();
+void clock_time(m_clock& clock);
 
 
 
@@ -34,6 +36,40 @@ float delta_time_to_second(float dt);
 float delta_time_to_fps(float dt);
 
 
+// Frame pacer: sleeps most of the way to the next frame, then spins the last stretch on the clock,
+// since sleep wakes up late by anything from 50us (linux) to a whole scheduler tick (windows).
+// The spin margin grows to the worst oversleep seen so far, so the pacer only burns the CPU it has to
+
+#define FRAME_PACER_MAX_CATCH_UP 4 // after a longer stall drop the missed frames instead of running them all
+#define FRAME_PACER_MIN_SPIN_NS 200000 // 0.2ms, the margin grows past this when sleeps overshoot more
+
+struct frame_pacer_stats
+{
+    uint64_t frames;
+    uint64_t dropped; // frames skipped after a stall
+    int64_t late_min_ns; // how far past its deadline each frame started
+    int64_t late_max_ns;
+    int64_t late_total_ns;
+    uint64_t sleep_ns; // time given back to the os
+    uint64_t spin_ns; // time spent spinning
+};
+
+struct frame_pacer
+{
+    uint64_t period_ns;
+    uint64_t deadline_ns;
+    uint64_t spin_margin_ns;
+    frame_pacer_stats stats;
+};
+
+void frame_pacer_init(frame_pacer& pacer, uint32_t frames_per_second);
+// waits for the next deadline, returns how many frames are due (1 unless the caller fell behind)
+uint32_t frame_pacer_wait(frame_pacer& pacer);
+// start counting from now, after the caller blocked on purpose (waiting for input)
+void frame_pacer_reset(frame_pacer& pacer);
+void frame_pacer_print_stats(const frame_pacer& pacer);
+
+
 
 
 
@@ -0,0 +1,71 @@
+﻿#include <cstdio>
+#include <cstring>
+
+#include "chip8_trace.h"
+
+
+//COMMAND LINE USAGE: ./chip8_trace_decode <TRACE FILE>
+// prints a binary trace written by a CHIP8_TRACE build as text
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: chip8_trace_decode <TRACE FILE>\n");
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        printf("could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    CHIP8_TRACE_FILE_HEADER header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_FILE_MAGIC ||
+        header.version != TRACE_FILE_VERSION || header.record_size != sizeof(CHIP8_TRACE_RECORD))
+    {
+        printf("%s is not a version %d chip8 trace\n", argv[1], TRACE_FILE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    CHIP8_TRACE_RECORD record;
+    uint64_t expected = 0;
+    uint64_t records = 0;
+    uint64_t dropped = 0;
+
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.sequence != expected)
+        {
+            printf("... %llu records dropped\n", (unsigned long long) (record.sequence - expected));
+            dropped += record.sequence - expected;
+        }
+        expected = record.sequence + 1;
+        records++;
+
+        switch (record.kind)
+        {
+            case CHIP8_TRACE_INSTR:
+                printf("%10llu  pc %03X  op %04X  I %03X  sp %X\n", (unsigned long long) record.sequence,
+                       record.pc, record.opcode, record.index, record.sp);
+                break;
+            case CHIP8_TRACE_UNKNOWN_OPCODE:
+                printf("%10llu  pc %03X  unknown opcode %04X\n", (unsigned long long) record.sequence, record.pc,
+                       record.opcode);
+                break;
+            case CHIP8_TRACE_BEEP:
+                printf("%10llu  pc %03X  beep\n", (unsigned long long) record.sequence, record.pc);
+                break;
+            default:
+                printf("%10llu  unknown record kind %u\n", (unsigned long long) record.sequence, record.kind);
+                break;
+        }
+    }
+
+    fclose(file);
+    printf("%llu records, %llu dropped\n", (unsigned long long) records, (unsigned long long) dropped);
+    return 0;
+}